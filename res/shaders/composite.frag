@@ -0,0 +1,15 @@
+#version 450 core
+
+// Output of the raycaster, same size as the viewport
+uniform sampler2D raycast_tex;
+
+out vec4 fragColor;
+
+void main()
+{
+    vec4 color = texelFetch(raycast_tex, ivec2(gl_FragCoord.xy), 0);
+    // Keep the background where no surface was hit
+    if (color.a == 0.0)
+        discard;
+    fragColor = color;
+}
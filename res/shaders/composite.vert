@@ -0,0 +1,8 @@
+#version 450 core
+
+// Full screen triangle, no vertex buffer needed
+void main()
+{
+    vec2 pos = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4.0 - 1.0;
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
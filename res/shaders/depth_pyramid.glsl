@@ -0,0 +1,39 @@
+#version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Builds one level of a pyramid with the farthest depth, in meters, around
+// every pixel of the frames of a batch. Invalid depths count as 0, so texels
+// that only cover invalid pixels are 0. The z dimension of the dispatch
+// selects the frame.
+
+layout(binding = 3)       uniform usampler2DArray frame_depth_tex;
+layout(binding = 0, r32f) uniform writeonly image2DArray dst_level;
+layout(binding = 1, r32f) uniform readonly  image2DArray src_level;
+
+uniform int level;
+
+
+void main()
+{
+    ivec3 texel = ivec3(gl_GlobalInvocationID);
+    ivec2 size = imageSize(dst_level).xy;
+    if (any(greaterThanEqual(texel.xy, size)))
+        return;
+
+    float depth = 0.0;
+    if (level == 0) {
+        uint depth_mm = texelFetch(frame_depth_tex, texel, 0).r;
+        if (depth_mm != 65535u)
+            depth = float(depth_mm) / 1000.0;
+    } else {
+        // The last row and column of a level with an odd size are folded
+        // into the last texel of the next one
+        ivec2 src_size = imageSize(src_level).xy;
+        ivec2 first = texel.xy * 2;
+        ivec2 last = mix(first + 1, src_size - 1, equal(texel.xy, size - 1));
+        for (int y = first.y; y <= last.y; ++y)
+        for (int x = first.x; x <= last.x; ++x)
+            depth = max(depth, imageLoad(src_level, ivec3(x, y, texel.z)).r);
+    }
+    imageStore(dst_level, texel, vec4(depth));
+}
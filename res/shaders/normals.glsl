@@ -0,0 +1,66 @@
+#version 450
+// One workgroup per brick of texels
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+// Must match OCCUPANCY_BRICK_SIZE
+#define BRICK_SIZE 8
+
+#include "tsdf_image.glsl"
+
+// Octahedral encoding of the normalized tsdf gradient in voxel units
+layout(binding = 4, rg8_snorm) uniform writeonly image3D normal_tex;
+
+// Non-zero for the bricks written by the integration since the last update,
+// see tsdf.glsl
+layout(std430, binding = 0) readonly buffer TouchedBricks {
+    uint touched_bricks[];
+};
+
+
+int brickIndex(ivec3 brick, ivec3 bricks)
+{
+    brick = (brick + bricks) % bricks;
+    return (brick.z * bricks.y + brick.y) * bricks.x + brick.x;
+}
+
+vec2 octEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * mix(vec2(-1.0), vec2(1.0),
+                                       greaterThanEqual(n.xy, vec2(0.0)));
+    return n.xy;
+}
+
+void main()
+{
+    ivec3 dims = volumeSize();
+    ivec3 bricks = dims / BRICK_SIZE;
+    ivec3 brick = ivec3(gl_WorkGroupID);
+
+    // The central differences of the voxels on a face of the brick also
+    // read the brick on the other side of it
+    bool touched = touched_bricks[brickIndex(brick, bricks)] != 0u;
+    for (int axis = 0; axis < 3; ++axis) {
+        ivec3 offset = ivec3(0);
+        offset[axis] = 1;
+        touched = touched ||
+            touched_bricks[brickIndex(brick + offset, bricks)] != 0u ||
+            touched_bricks[brickIndex(brick - offset, bricks)] != 0u;
+    }
+    if (!touched)
+        return;
+
+    // Same differences as calculateNormal() in volume_sampling.glsl
+    ivec3 v = ivec3(gl_GlobalInvocationID);
+    vec3 n;
+    n.x = loadTsdf((ivec3(v.x + 1, v.yz) + dims) % dims)
+        - loadTsdf((ivec3(v.x - 1, v.yz) + dims) % dims);
+    n.y = loadTsdf((ivec3(v.x, v.y + 1, v.z) + dims) % dims)
+        - loadTsdf((ivec3(v.x, v.y - 1, v.z) + dims) % dims);
+    n.z = loadTsdf((ivec3(v.xy, v.z + 1) + dims) % dims)
+        - loadTsdf((ivec3(v.xy, v.z - 1) + dims) % dims);
+
+    vec2 encoded = n == vec3(0.0) ? vec2(0.0) : octEncode(n);
+    imageStore(normal_tex, v, vec4(encoded, 0.0, 0.0));
+}
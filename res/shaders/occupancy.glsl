@@ -0,0 +1,75 @@
+#version 450
+// One workgroup per brick of texels
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+// Must match OCCUPANCY_BRICK_SIZE
+#define BRICK_SIZE 8
+
+#include "tsdf_image.glsl"
+
+// x = number of negative voxels around the brick, y = epoch of the last
+// update that touched it
+layout(binding = 3, rg32ui) uniform uimage3D occupancy_tex;
+
+// Non-zero for the bricks written by the integration since the last update,
+// see tsdf.glsl
+layout(std430, binding = 0) readonly buffer TouchedBricks {
+    uint touched_bricks[];
+};
+
+uniform uint epoch;
+
+shared uint negative;
+
+
+int brickIndex(ivec3 brick, ivec3 bricks)
+{
+    brick = (brick + bricks) % bricks;
+    return (brick.z * bricks.y + brick.y) * bricks.x + brick.x;
+}
+
+void main()
+{
+    // The region counted below reaches into every neighbour, so only the
+    // bricks next to a touched one can change. The whole workgroup takes
+    // the same branch.
+    ivec3 bricks = volumeSize() / BRICK_SIZE;
+    ivec3 n;
+    bool touched = false;
+    for (n.z = -1; n.z <= 1; ++n.z)
+    for (n.y = -1; n.y <= 1; ++n.y)
+    for (n.x = -1; n.x <= 1; ++n.x)
+        touched = touched || touched_bricks[
+            brickIndex(ivec3(gl_WorkGroupID) + n, bricks)] != 0u;
+    if (!touched)
+        return;
+
+    if (gl_LocalInvocationIndex == 0u)
+        negative = 0u;
+    barrier();
+
+    ivec3 dims = volumeSize();
+
+    // A trilinear sample can only be negative if one of its corners is, and
+    // the corners of a sample inside the brick are at most one voxel outside
+    // of it. The border wraps around like the volume.
+    const int REGION = BRICK_SIZE + 2;
+    ivec3 first = ivec3(gl_WorkGroupID) * BRICK_SIZE - 1;
+    for (int i = int(gl_LocalInvocationIndex); i < REGION * REGION * REGION;
+         i += BRICK_SIZE * BRICK_SIZE * BRICK_SIZE) {
+        ivec3 offset = ivec3(i % REGION, i / REGION % REGION,
+                             i / (REGION * REGION));
+        ivec3 texel = (first + offset + dims) % dims;
+        if (loadTsdf(texel) < 0.0)
+            atomicAdd(negative, 1u);
+    }
+    barrier();
+
+    // The epoch tells the raycaster which bricks may have grown a surface
+    // since its last frame, see raycast.glsl. A surface can move inside a
+    // brick without changing its count, so every brick whose samples the
+    // integration touched gets the new epoch.
+    if (gl_LocalInvocationIndex == 0u)
+        imageStore(occupancy_tex, ivec3(gl_WorkGroupID),
+                   uvec4(negative, epoch, 0u, 0u));
+}
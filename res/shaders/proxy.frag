@@ -0,0 +1,18 @@
+#version 450 core
+
+// Blended with GL_MIN into the first target and GL_MAX into the second, so
+// every pixel ends up with the distances where its ray enters the first
+// occupied brick and leaves the last one
+
+uniform vec3 camera_pos_tex_space;
+
+in  vec3 v_texCoord;
+layout(location = 0) out float t_min;
+layout(location = 1) out float t_max;
+
+void main()
+{
+    float t = length(v_texCoord - camera_pos_tex_space);
+    t_min = t;
+    t_max = t;
+}
@@ -0,0 +1,60 @@
+#version 450
+// One invocation per brick of texels of a level
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Must match OCCUPANCY_BRICK_SIZE
+#define BRICK_SIZE 8
+
+layout(binding = 3, rg32ui) uniform readonly uimage3D occupancy_tex;
+
+// Same layout as glDrawArraysIndirect() expects
+layout(std430, binding = 0) buffer DrawCommand {
+    uint vertex_count;
+    uint instance_count;
+    uint first_vertex;
+    uint base_instance;
+};
+
+// Two entries per box, its first and last corners in the texture space of
+// level 0
+layout(std430, binding = 1) writeonly buffer ProxyBricks {
+    vec4 proxy_bricks[];
+};
+
+uniform ivec3 volume_dims;
+uniform ivec3 volume_wrap;   // Texel that holds the first voxel
+uniform int   level;
+
+
+void main()
+{
+    ivec3 brick = ivec3(gl_GlobalInvocationID);
+    if (any(greaterThanEqual(brick * BRICK_SIZE, volume_dims)))
+        return;
+    if (imageLoad(occupancy_tex, brick).x == 0u)
+        return;
+
+    // Bricks are aligned to the texels, so in a rolled volume a brick can
+    // straddle the seam between the last and the first voxel. Each side of
+    // the seam becomes a box of its own.
+    ivec3 first = (brick * BRICK_SIZE - volume_wrap + volume_dims) % volume_dims;
+    ivec3 last = first + BRICK_SIZE;
+    ivec3 pieces = ivec3(greaterThan(last, volume_dims)) + 1;
+    float scale = float(1 << level);
+
+    for (int z = 0; z < pieces.z; ++z)
+    for (int y = 0; y < pieces.y; ++y)
+    for (int x = 0; x < pieces.x; ++x) {
+        ivec3 piece = ivec3(x, y, z);
+        ivec3 lo = mix(first, ivec3(0), equal(piece, ivec3(1)));
+        ivec3 hi = mix(min(last, volume_dims), last - volume_dims,
+                       equal(piece, ivec3(1)));
+        // Level coordinates to the texture space of level 0, the inverse of
+        // levelCoords() in volume_sampling.glsl
+        uint index = atomicAdd(instance_count, 1u);
+        proxy_bricks[index * 2u] =
+            vec4((vec3(lo) / vec3(volume_dims) - 0.5) * scale + 0.5, 1.0);
+        proxy_bricks[index * 2u + 1u] =
+            vec4((vec3(hi) / vec3(volume_dims) - 0.5) * scale + 0.5, 1.0);
+    }
+}
@@ -0,0 +1,31 @@
+#version 450 core
+
+// Draws one box per instance without any vertex data, see proxy.glsl
+
+layout(std430, binding = 1) readonly buffer ProxyBricks {
+    vec4 proxy_bricks[];
+};
+
+uniform mat4  mvp;       // Texture space to clip space
+uniform float margin;    // Boxes grow by this much in texture space
+
+out vec3 v_texCoord;
+
+// Two triangles per face, corners given as zyx bits
+const int CUBE_CORNERS[36] = int[36](
+    0, 2, 1,  1, 2, 3,    4, 5, 6,  5, 7, 6,    // -z, +z
+    0, 1, 4,  1, 5, 4,    2, 6, 3,  3, 6, 7,    // -y, +y
+    0, 4, 2,  2, 4, 6,    1, 3, 5,  3, 7, 5     // -x, +x
+);
+
+
+void main()
+{
+    vec3 lo = proxy_bricks[gl_InstanceID * 2].xyz - margin;
+    vec3 hi = proxy_bricks[gl_InstanceID * 2 + 1].xyz + margin;
+    int corner = CUBE_CORNERS[gl_VertexID];
+    vec3 p = mix(lo, hi, vec3(corner & 1, (corner >> 1) & 1, corner >> 2));
+
+    gl_Position = mvp * vec4(p, 1.0);
+    v_texCoord = p;
+}
@@ -0,0 +1,249 @@
+#version 450
+// Each workgroup raycasts a tile of the screen. The rays of the tile first
+// agree on the interval where any of them can hit a surface, and walk the
+// frustum of the tile through the occupied bricks once, together. The rays
+// start where the frustum meets the first occupied brick, and tiles that
+// meet none finish before any voxel is sampled.
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+const vec3 AMBIENT_COLOR = vec3(0.1);
+const vec3 SURFACE_COLOR = vec3(0.8);
+
+#include "volume_sampling.glsl"
+
+// Alpha is 0 where no surface was hit
+layout(binding = 0, rgba8) uniform writeonly image2D output_image;
+// Distance along the ray of the hit in texture space, 0 on a miss. Read back
+// by the next frame through reproject.glsl.
+layout(binding = 1, r32f)  uniform writeonly image2D hit_history;
+// Distances of the previous hits reprojected into this view
+layout(binding = 2, r32ui) uniform readonly uimage2D reprojected;
+// Distances where the ray enters the first occupied brick and leaves the
+// last one, rasterized by proxy.vert and proxy.frag. t_max is 0 if the ray
+// misses all of them.
+layout(binding = 3, r32f)  uniform readonly image2D proxy_t_min;
+layout(binding = 4, r32f)  uniform readonly image2D proxy_t_max;
+
+uniform mat4      inv_mvp;                 // NDC to texture space
+uniform vec3      camera_pos_tex_space;    // Camera position in texture space
+uniform int       display_mode;
+uniform ivec2     size;
+
+uniform bool      use_proxy;
+uniform float     proxy_margin;            // Added to both ends of the bounds
+uniform float     near_distance;           // To the corners of the near plane
+
+uniform bool      use_history;
+uniform uint      history_epoch;           // Occupancy epoch of the history
+uniform float     history_backoff;         // In voxels
+
+// Interval of the tile, as float bits, and the tangent of the half angle of
+// its frustum around the center ray. Rays start at 0, so their distances
+// compare the same as floats and as bits.
+shared uint tile_t_near;
+shared uint tile_t_far;
+shared uint tile_tan;
+// Set when the frustum may touch an occupied brick at the current step
+shared uint tile_hit;
+
+// The tile walk gives up, leaving the rest to every ray, once its steps fall
+// below this fraction of a brick
+const float MIN_TILE_STEP = 0.25;
+
+vec4 phongShading(vec3 p)
+{
+    vec3 normal = calculateNormal(p);
+
+    // The light is placed at the camera
+    vec3 lightDir = normalize(camera_pos_tex_space - p);
+
+    vec3 diffuse = vec3(max(dot(normal, lightDir), 0.0));
+    vec3 result = (AMBIENT_COLOR + diffuse) * SURFACE_COLOR;
+
+    return vec4(result, 1.0);
+}
+
+// Narrow [t, t_end] down to the bounds rasterized from the occupied bricks
+void proxyBounds(ivec2 pixel, vec3 origin, vec3 dir,
+                 inout float t, inout float t_end)
+{
+    float t_max = imageLoad(proxy_t_max, pixel).r;
+    if (t_max == 0.0) {
+        t_end = t;
+        return;
+    }
+    t_end = min(t_end, t_max + proxy_margin);
+
+    // Faces closer than the near plane have been clipped away, so the ray
+    // may already be inside a brick before the first face it crossed
+    float s = t;
+    float t_min = imageLoad(proxy_t_min, pixel).r - proxy_margin;
+    if (skipEmptyBricks(origin, dir, s, min(t_min, t + near_distance)))
+        return;
+    t = max(t, t_min);
+}
+
+// Conservative start of the ray from the hits of the previous frame, or
+// t_entry if there are none nearby or they can't be trusted
+float reprojectedStart(ivec2 pixel, vec3 origin, vec3 dir,
+                       float t_entry, float t_exit)
+{
+    // Scattering leaves holes, take the closest hit of the neighbourhood
+    uint closest = 0xFFFFFFFFu;
+    for (int y = -1; y <= 1; ++y)
+    for (int x = -1; x <= 1; ++x) {
+        ivec2 q = clamp(pixel + ivec2(x, y), ivec2(0), size - 1);
+        closest = min(closest, imageLoad(reprojected, q).r);
+    }
+    // Disoccluded
+    if (closest == 0xFFFFFFFFu)
+        return t_entry;
+
+    // Back off, the hit may come from a neighbouring ray or a slightly
+    // different surface
+    float t = uintBitsToFloat(closest);
+    int level = selectLevel(origin + dir * t);
+    t -= history_backoff * float(1 << level) / volume_dims.x;
+    if (t <= t_entry)
+        return t_entry;
+    t = min(t, t_exit);
+
+    // Integration may have added a surface in front of the previous hits
+    for (float s = t_entry; s < t; ) {
+        vec3 p = origin + dir * s;
+        level = selectLevel(p);
+        uvec2 occupancy = brickOccupancy(p, level);
+        if (occupancy.x != 0u && occupancy.y > history_epoch)
+            return t_entry;
+        s += brickExit(p, dir, level);
+    }
+    return t;
+}
+
+// Walk the center ray of the tile from 'near' until the frustum of the tile
+// may touch an occupied brick. Every step is short enough that the frustum
+// stays within one brick of the center point, so the 27 bricks around it are
+// checked, one per invocation. Returns where the rays of the tile can start,
+// or 'far' if they can't hit anything. Must be called by the whole workgroup.
+float walkTile(vec3 origin, vec3 dir, float tan_angle, float near, float far)
+{
+    uint i = gl_LocalInvocationIndex;
+    ivec3 offset = ivec3(i % 3u, i / 3u % 3u, i / 9u) - 1;
+    float s = near;
+    while (s < far) {
+        vec3 p = origin + dir * s;
+        int level = selectLevel(p);
+        vec3 brick = vec3(BRICK_SIZE << level) / volume_dims;
+        float h = min(brick.x, min(brick.y, brick.z));
+        // Points of the frustum between s and s + step are within
+        // step + (s + step) * tan_angle of p
+        float step = (h - s * tan_angle) / (1.0 + tan_angle);
+
+        if (i == 0u)
+            tile_hit = 0u;
+        barrier();
+        if (i < 27u) {
+            // Bricks of another level don't line up with the ones of p
+            vec3 q = p + vec3(offset) * brick;
+            if (step < h * MIN_TILE_STEP || selectLevel(q) != level ||
+                brickOccupied(q, level))
+                atomicOr(tile_hit, 1u);
+        }
+        barrier();
+        bool hit = tile_hit != 0u;
+        // Everyone has read the flag before it's cleared again
+        barrier();
+        if (hit)
+            return s;
+        s += step;
+    }
+    return far;
+}
+
+void main()
+{
+    if (gl_LocalInvocationIndex == 0u) {
+        tile_t_near = floatBitsToUint(3.402823e38);
+        tile_t_far = 0u;
+        tile_tan = 0u;
+    }
+    barrier();
+
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    bool inside = all(lessThan(pixel, size));
+
+    // Calculate the view ray direction in texture space. We are going to traverse
+    // the volume front-to-back (the camera is the origin) in 3D texture space.
+    vec2 ndc = (vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0;
+    vec4 far_point = inv_mvp * vec4(ndc, 1.0, 1.0);
+    vec3 rayDir = normalize(far_point.xyz / far_point.w - camera_pos_tex_space);
+
+    vec2 intersection = rayVolumeIntersect(camera_pos_tex_space, rayDir);
+    // Do not sample voxels behind the camera
+    float t = max(intersection.x, 0.0);
+    float t_end = intersection.y;
+    if (inside && use_proxy && t < t_end)
+        proxyBounds(pixel, camera_pos_tex_space, rayDir, t, t_end);
+
+    // Center ray of the tile, the same for every invocation
+    vec2 center = vec2(gl_WorkGroupID.xy * gl_WorkGroupSize.xy +
+                       gl_WorkGroupSize.xy / 2u);
+    vec4 center_far = inv_mvp *
+        vec4(center / vec2(size) * 2.0 - 1.0, 1.0, 1.0);
+    vec3 center_dir = normalize(center_far.xyz / center_far.w -
+                                camera_pos_tex_space);
+
+    if (inside && t < t_end) {
+        // Slightly widened against rounding
+        float c = dot(rayDir, center_dir);
+        float tan_angle = sqrt(max(1.0 - c * c, 0.0)) / c * 1.01 + 1e-6;
+        atomicMin(tile_t_near, floatBitsToUint(t));
+        atomicMax(tile_t_far, floatBitsToUint(t_end));
+        atomicMax(tile_tan, floatBitsToUint(tan_angle));
+    }
+    barrier();
+    float tile_near = uintBitsToFloat(tile_t_near);
+    float tile_far = uintBitsToFloat(tile_t_far);
+    float tile_start = tile_far;
+    if (tile_near < tile_far)
+        tile_start = walkTile(camera_pos_tex_space, center_dir,
+                              uintBitsToFloat(tile_tan), tile_near, tile_far);
+    // Every ray of the tile misses the occupied bricks
+    if (tile_start >= tile_far) {
+        if (inside) {
+            imageStore(output_image, pixel, vec4(0.0));
+            imageStore(hit_history, pixel, vec4(0.0));
+        }
+        return;
+    }
+    t = max(t, tile_start);
+
+    if (inside && use_history && t < t_end)
+        t = reprojectedStart(pixel, camera_pos_tex_space, rayDir, t, t_end);
+
+    // Walk the bricks of the ray on from where the tile stopped. This is
+    // cheap compared to marching, and lets rays over empty space finish
+    // before any voxel is sampled.
+    bool occupied = inside &&
+        skipEmptyBricks(camera_pos_tex_space, rayDir, t, t_end);
+
+    vec4 color = vec4(0.0);
+    float hit_t = 0.0;
+    vec3 surface_point;
+    if (occupied && marchInterval(camera_pos_tex_space, rayDir,
+                                  t, t_end, surface_point)) {
+        hit_t = length(surface_point - camera_pos_tex_space);
+        if (display_mode == 0) {
+            color = vec4(sampleColor(surface_point, selectLevel(surface_point)), 1.0);
+        } else if (display_mode == 1) {
+            color = vec4(calculateNormal(surface_point), 1.0);
+        } else if (display_mode == 2) {
+            color = phongShading(surface_point);
+        }
+    }
+
+    if (inside) {
+        imageStore(output_image, pixel, color);
+        imageStore(hit_history, pixel, vec4(hit_t));
+    }
+}
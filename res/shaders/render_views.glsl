@@ -0,0 +1,50 @@
+#version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Raycasts a batch of views into the layers of 2D array textures. The z
+// dimension of the dispatch selects the view.
+
+#include "volume_sampling.glsl"
+
+// Must match MAX_RENDER_VIEWS
+#define MAX_VIEWS 16
+
+layout(binding = 0, rgba8)   uniform writeonly image2DArray color_map;
+layout(binding = 1, r32f)    uniform writeonly image2DArray depth_map;
+layout(binding = 2, rgba16f) uniform writeonly image2DArray normal_map;
+
+uniform vec3  view_origin[MAX_VIEWS]; // Camera position in texture space
+uniform mat3  view_rays[MAX_VIEWS];   // Pixel to texture space ray direction
+uniform vec4  view_depth[MAX_VIEWS];  // Texture space to camera space z
+uniform mat3  normal_matrix;          // Voxel gradient to world space normal
+uniform int   num_views;
+uniform int   first_layer;
+uniform ivec2 size;
+
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    int view = int(gl_GlobalInvocationID.z);
+    if (any(greaterThanEqual(pixel, size)) || view >= num_views)
+        return;
+
+    // Pixel centers have integer coordinates, like in the integration shader
+    vec3 dir = normalize(view_rays[view] * vec3(vec2(pixel), 1.0));
+
+    vec4 color = vec4(0.0);
+    float depth = 0.0;
+    vec3 normal = vec3(0.0);
+
+    vec3 p;
+    if (marchRay(view_origin[view], dir, p)) {
+        color = vec4(sampleColor(p, selectLevel(p)), 1.0);
+        depth = dot(view_depth[view], vec4(p, 1.0));
+        normal = normalize(normal_matrix * calculateNormal(p));
+    }
+
+    ivec3 texel = ivec3(pixel, first_layer + view);
+    imageStore(color_map, texel, color);
+    imageStore(depth_map, texel, vec4(depth));
+    imageStore(normal_map, texel, vec4(normal, 0.0));
+}
@@ -0,0 +1,44 @@
+#version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Scatters the surface hits of the previous frame into the current view.
+// Every pixel keeps the closest distance from the current camera, stored as
+// the bits of a positive float so atomicMin() orders them.
+
+// Distance along the ray of the previous hit in texture space, 0 on a miss
+layout(binding = 1, r32f)  uniform readonly image2D hit_history;
+layout(binding = 2, r32ui) uniform uimage2D reprojected;
+
+uniform mat4  prev_inv_mvp;          // Previous NDC to texture space
+uniform vec3  prev_camera_pos;       // Previous camera in texture space
+uniform mat4  mvp;                   // Texture space to current clip space
+uniform vec3  camera_pos_tex_space;
+uniform ivec2 size;
+
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(pixel, size)))
+        return;
+
+    float t = imageLoad(hit_history, pixel).r;
+    if (t <= 0.0)
+        return;
+
+    // Same ray as the raycaster traced through this pixel last frame
+    vec2 ndc = (vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0;
+    vec4 far_point = prev_inv_mvp * vec4(ndc, 1.0, 1.0);
+    vec3 dir = normalize(far_point.xyz / far_point.w - prev_camera_pos);
+    vec3 hit = prev_camera_pos + dir * t;
+
+    vec4 clip = mvp * vec4(hit, 1.0);
+    if (clip.w <= 0.0)
+        return;
+    ivec2 target = ivec2(floor((clip.xy / clip.w * 0.5 + 0.5) * vec2(size)));
+    if (any(lessThan(target, ivec2(0))) || any(greaterThanEqual(target, size)))
+        return;
+
+    float distance = length(hit - camera_pos_tex_space);
+    imageAtomicMin(reprojected, target, floatBitsToUint(distance));
+}
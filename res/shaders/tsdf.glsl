@@ -1,72 +1,269 @@
 #version 450
-layout(local_size_x = 32, local_size_y = 32, local_size_z = 1) in;
+// One workgroup per column of bricks along z, every invocation walks a
+// column of voxels
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 
+#ifdef PACKED_VOXELS
+// x = snorm16 tsdf in the low half and the weight in the high half,
+// y = RGBA8 color
+layout(binding = 0, rg32ui) uniform uimage3D voxel_tex;
+#else
 layout(binding = 0, r16f)  uniform image3D tsdf_tex;
 layout(binding = 1, rgba8) uniform image3D color_tex;
+#ifdef WEIGHT_8BIT
+layout(binding = 2, r8ui)  uniform uimage3D weight_tex;
+#else
 layout(binding = 2, r16ui) uniform uimage3D weight_tex;
-layout(binding = 3)        uniform usampler2D frame_depth_tex;
-layout(binding = 4)        uniform sampler2D  frame_color_tex;
+#endif
+#endif
+// One layer per frame of the batch
+layout(binding = 3)        uniform usampler2DArray frame_depth_tex;
+layout(binding = 4)        uniform sampler2DArray  frame_color_tex;
+// Farthest depth around every pixel of each frame, see depth_pyramid.glsl
+layout(binding = 5)        uniform sampler2DArray  depth_pyramid_tex;
 
-uniform mat4 texture_to_model;
-uniform mat4 model;
-uniform mat4 extrinsic;
-uniform mat3 intrinsic;
+// Must match MAX_BATCH_FRAMES
+#define MAX_FRAMES 8
+
+// Voxel index inside the volume to image coordinates (x, y, w) and camera
+// space z, see Volume::integrateBatch(). Column 2 is the step from a voxel
+// to the next one along the column.
+uniform mat4 voxel_to_image[MAX_FRAMES];
+uniform int  num_frames;
 uniform float trunc_margin;
+uniform ivec3 volume_dims;
+uniform ivec3 volume_wrap;   // Texel that holds the first voxel
+uniform uint max_weight;     // Weights saturate at this value
+uniform bool depth_culling;
+// Subtract the frames instead of adding them, see Volume::deintegrateBatch()
+uniform bool deintegrate;
 
+// Must match OCCUPANCY_BRICK_SIZE
+#define BRICK_SIZE 8
 
-void main()
+// One flag per brick of texels, set for every brick with an updated voxel
+layout(std430, binding = 0) buffer TouchedBricks {
+    uint touched_bricks[];
+};
+
+// Must match BLOCK_SIZE
+#define BLOCK_SIZE 32
+
+// Two flags per block of texels, set for every block with an updated voxel.
+// The first half is cleared when the blocks are checkpointed, the second one
+// only when the volume is reset, see Volume::copyModifiedBlocks() and
+// Volume::copyObservedBlocks().
+layout(std430, binding = 1) buffer DirtyBlocks {
+    uint dirty_blocks[];
+};
+
+// Bit i is set if frame i may update a voxel of the current brick
+shared uint frame_mask;
+
+
+// Whether frame i skips every voxel inside the given corners, in the space
+// of voxel_to_image. Voxels in front of the surface are never skipped, they
+// carve free space, so only bricks outside the frame, over invalid depths
+// or hidden behind the surface by more than the truncation margin are
+// culled.
+bool brickCulled(int i, vec4 corners[8], vec2 texSize)
+{
+    // The voxels in between the corners project inside their bounds as
+    // long as all of them are in front of the camera
+    float z_min = 1e30;
+    float z_max = -1e30;
+    vec2 lo = vec2(1e30);
+    vec2 hi = vec2(-1e30);
+    for (int c = 0; c < 8; ++c) {
+        z_min = min(z_min, corners[c].w);
+        z_max = max(z_max, corners[c].w);
+        lo = min(lo, corners[c].xy / corners[c].z);
+        hi = max(hi, corners[c].xy / corners[c].z);
+    }
+    if (z_max <= 0.0)
+        return true;
+    if (z_min <= 0.0)
+        return false;
+
+    // Voxels sample the closest pixel
+    ivec2 first = ivec2(max(round(lo), vec2(0.0)));
+    ivec2 last = ivec2(min(round(hi), texSize - 1.0));
+    if (any(greaterThan(first, last)))
+        return true;
+
+    // The finest level where the footprint covers at most 2x2 texels
+    ivec2 extent = last - first;
+    int lod = min(findMSB(max(extent.x, extent.y)) + 1,
+                  textureQueryLevels(depth_pyramid_tex) - 1);
+    ivec2 level_size = textureSize(depth_pyramid_tex, lod).xy;
+    ivec2 t0 = min(first >> lod, level_size - 1);
+    ivec2 t1 = min(last >> lod, level_size - 1);
+    float depth = 0.0;
+    for (int y = t0.y; y <= t1.y; ++y)
+    for (int x = t0.x; x <= t1.x; ++x)
+        depth = max(depth, texelFetch(depth_pyramid_tex, ivec3(x, y, i), lod).r);
+    return z_min > depth + trunc_margin;
+}
+
+// Fuse every frame set in 'mask' into a voxel. 'image_pos' holds the voxel
+// in the space of voxel_to_image of each frame.
+void integrateVoxel(ivec3 voxel, uint mask, vec4 image_pos[MAX_FRAMES],
+                    vec2 texSize)
 {
-    ivec3 coords = ivec3(gl_GlobalInvocationID);
-    // Normalized texture coordinates [0,1]
-    vec3 normCoords = (vec3(coords) + 0.5) / // Sample the voxel mid point
-        vec3(gl_NumWorkGroups * gl_WorkGroupSize);
-    // Invert the y and z coordinates to correct for the model being upside down
-    normCoords.yz = 1.0 - normCoords.yz;
-
-    // Transform the voxel position from 3D texture coordinates to 2D image coordinates
-    vec4 voxelPosCameraSpace = extrinsic * model * texture_to_model *
-        vec4(normCoords, 1.0);
-    vec3 voxelPosImageSpace = intrinsic * voxelPosCameraSpace.xyz;
-    // Perspective division
-    voxelPosImageSpace.xy /= voxelPosImageSpace.z;
-    voxelPosImageSpace.xy = round(voxelPosImageSpace.xy);
-
-    // Sample the real depth at this voxel in millimeters
-    unsigned int depth_mm =
-        texelFetch(frame_depth_tex, ivec2(voxelPosImageSpace.xy), 0).r;
-    // Invalid depth values are set to 65535, ignore them
-    if (depth_mm == 65535) depth_mm = 0;
-
-    vec2 texSize = textureSize(frame_depth_tex, 0);
-
-    // Check that:
-    // 1. It's a valid depth value
-    // 2. The voxel is in front of the camera
-    // 3. The voxel image coordinates are within the texture borders
-    if ( depth_mm != 0                                       &&
-         voxelPosCameraSpace.z > 0.0                         &&
-         all(greaterThan(voxelPosImageSpace.xy, vec2(0.0)) ) &&
-         all(lessThan   (voxelPosImageSpace.xy, texSize  ) ) )
-    {
+    // The volume is addressed toroidally so it can follow the camera without
+    // moving any voxel data around
+    ivec3 coords = (voxel + volume_wrap) % volume_dims;
+
+    // The voxel is loaded on the first frame that observes it, updated in
+    // registers by every frame of the batch and stored once at the end
+    bool loaded = false;
+    unsigned int weight = 0;
+    float tsdf = 0.0;
+    vec3 color = vec3(0.0);
+#ifdef PACKED_VOXELS
+    uvec2 voxel_data;
+#endif
+
+    for (int i = 0; i < num_frames; ++i) {
+        if ((mask & (1u << i)) == 0u)
+            continue;
+        // Perspective division
+        vec2 pixel = round(image_pos[i].xy / image_pos[i].z);
+        float voxel_z = image_pos[i].w;
+        ivec3 texel = ivec3(pixel, i);
+
+        // Sample the real depth at this voxel in millimeters
+        unsigned int depth_mm = texelFetch(frame_depth_tex, texel, 0).r;
+        // Invalid depth values are set to 65535, ignore them
+        if (depth_mm == 65535) depth_mm = 0;
+
+        // Check that:
+        // 1. It's a valid depth value
+        // 2. The voxel is in front of the camera
+        // 3. The voxel image coordinates are within the texture borders
+        if (!( depth_mm != 0                          &&
+               voxel_z > 0.0                          &&
+               all(greaterThan(pixel, vec2(0.0)) )    &&
+               all(lessThan   (pixel, texSize  ) ) ))
+            continue;
+
         float depth = float(depth_mm) / 1000.0; // To meters
         // Calculate the signed distance function of this voxel
-        float sdf = depth - voxelPosCameraSpace.z;
-        if (sdf >= -trunc_margin) {
-            float dist = min(1.0, sdf / trunc_margin);
-
-            unsigned int prev_weight = imageLoad(weight_tex, coords).r;
-            unsigned int new_weight = prev_weight + 1;
-            imageStore(weight_tex, coords, uvec4(new_weight, 0, 0, 0));
-
-            float prev_tsdf = imageLoad(tsdf_tex, coords).r;
-            float avg_tsdf = (prev_tsdf * prev_weight + dist) / new_weight;
-            imageStore(tsdf_tex, coords, vec4(dist, 0.0, 0.0, 0.0));
-
-            vec3 color =
-                texelFetch(frame_color_tex, ivec2(voxelPosImageSpace.xy), 0).rgb;
-            vec3 prev_color = imageLoad(color_tex, coords).rgb;
-            vec3 avg_color = (prev_color * prev_weight + color) / new_weight;
-            imageStore(color_tex, coords, vec4(avg_color, 1.0));
+        float sdf = depth - voxel_z;
+        if (sdf < -trunc_margin)
+            continue;
+        float dist = min(1.0, sdf / trunc_margin);
+
+        if (!loaded) {
+#ifdef PACKED_VOXELS
+            voxel_data = imageLoad(voxel_tex, coords).xy;
+            weight = voxel_data.x >> 16;
+            tsdf = unpackSnorm2x16(voxel_data.x).x;
+            color = unpackUnorm4x8(voxel_data.y).rgb;
+#else
+            weight = imageLoad(weight_tex, coords).r;
+            tsdf = imageLoad(tsdf_tex, coords).r;
+            color = imageLoad(color_tex, coords).rgb;
+#endif
+            loaded = true;
+        }
+
+        vec3 frame_color = texelFetch(frame_color_tex, texel, 0).rgb;
+        if (deintegrate) {
+            // Inverse of the update below. A saturated voxel can't tell
+            // whether the frame raised its weight, so it's assumed it didn't.
+            if (weight == 0)
+                continue;
+            if (weight == 1) {
+                // Back to an unobserved voxel, see Volume::clearRegion()
+                tsdf = 0.0;
+                color = vec3(1.0);
+                weight = 0;
+                continue;
+            }
+            float n = float(weight == max_weight ? weight + 1 : weight);
+            float m = n - 1.0;
+            tsdf = clamp((tsdf * n - dist) / m, -1.0, 1.0);
+            color = clamp((color * n - frame_color) / m, 0.0, 1.0);
+            if (weight < max_weight)
+                weight -= 1;
+            continue;
+        }
+
+        // Running average. Once the weight saturates every new observation
+        // keeps the same share, so the voxel can still adapt.
+        float n = float(weight + 1);
+        tsdf = (tsdf * weight + dist) / n;
+        color = (color * weight + frame_color) / n;
+        weight = min(weight + 1, max_weight);
+    }
+
+    if (!loaded)
+        return;
+
+    ivec3 bricks = volume_dims / BRICK_SIZE;
+    ivec3 brick = coords / BRICK_SIZE;
+    touched_bricks[(brick.z * bricks.y + brick.y) * bricks.x + brick.x] = 1u;
+    ivec3 blocks = volume_dims / BLOCK_SIZE;
+    ivec3 block = coords / BLOCK_SIZE;
+    int block_index = (block.z * blocks.y + block.y) * blocks.x + block.x;
+    dirty_blocks[block_index] = 1u;
+    dirty_blocks[blocks.x * blocks.y * blocks.z + block_index] = 1u;
+
+#ifdef PACKED_VOXELS
+    voxel_data.x = (packSnorm2x16(vec2(tsdf, 0.0)) & 0xFFFFu) | (weight << 16);
+    voxel_data.y = packUnorm4x8(vec4(color, 1.0));
+    imageStore(voxel_tex, coords, uvec4(voxel_data, 0, 0));
+#else
+    imageStore(weight_tex, coords, uvec4(weight, 0, 0, 0));
+    imageStore(tsdf_tex, coords, vec4(tsdf, 0.0, 0.0, 0.0));
+    imageStore(color_tex, coords, vec4(color, 1.0));
+#endif
+}
+
+void main()
+{
+    ivec2 column = ivec2(gl_GlobalInvocationID.xy);
+    vec2 texSize = textureSize(frame_depth_tex, 0).xy;
+    int frame = int(gl_LocalInvocationIndex);
+
+    // Position of the first voxel of the column in every frame. The rest
+    // are one step apart, so walking the column costs a multiply-add per
+    // frame and voxel instead of a chain of matrix products.
+    vec4 first_pos[MAX_FRAMES];
+    for (int i = 0; i < num_frames; ++i)
+        first_pos[i] = voxel_to_image[i] * vec4(column, 0.0, 1.0);
+
+    for (int z0 = 0; z0 < volume_dims.z; z0 += BRICK_SIZE) {
+        // Cull the whole brick against each frame first, one invocation per
+        // frame, so bricks that no frame can update are skipped right away
+        if (gl_LocalInvocationIndex == 0u)
+            frame_mask = depth_culling ? 0u : ~0u;
+        barrier();
+        if (depth_culling && frame < num_frames) {
+            ivec3 first = ivec3(gl_WorkGroupID.xy * gl_WorkGroupSize.xy, z0);
+            vec4 corners[8];
+            for (int c = 0; c < 8; ++c) {
+                ivec3 corner = first + ivec3(c & 1, (c >> 1) & 1, c >> 2) *
+                                       (BRICK_SIZE - 1);
+                corners[c] = voxel_to_image[frame] * vec4(corner, 1.0);
+            }
+            if (!brickCulled(frame, corners, texSize))
+                atomicOr(frame_mask, 1u << frame);
+        }
+        barrier();
+        uint mask = frame_mask;
+        // Everyone must have read the mask before it's reset for the next
+        // brick
+        barrier();
+        if (mask == 0u)
+            continue;
+
+        for (int z = z0; z < z0 + BRICK_SIZE; ++z) {
+            vec4 image_pos[MAX_FRAMES];
+            for (int i = 0; i < num_frames; ++i)
+                image_pos[i] = first_pos[i] + float(z) * voxel_to_image[i][2];
+            integrateVoxel(ivec3(column, z), mask, image_pos, texSize);
         }
     }
 }
@@ -0,0 +1,26 @@
+// Read access to the tsdf of a level bound as an image, see
+// Volume::bindLevelImages()
+
+#ifdef PACKED_VOXELS
+layout(binding = 0, rg32ui) uniform readonly uimage3D voxel_tex;
+#else
+layout(binding = 0, r16f)   uniform readonly image3D tsdf_tex;
+#endif
+
+float loadTsdf(ivec3 texel)
+{
+#ifdef PACKED_VOXELS
+    return unpackSnorm2x16(imageLoad(voxel_tex, texel).x).x;
+#else
+    return imageLoad(tsdf_tex, texel).r;
+#endif
+}
+
+ivec3 volumeSize()
+{
+#ifdef PACKED_VOXELS
+    return imageSize(voxel_tex);
+#else
+    return imageSize(tsdf_tex);
+#endif
+}
@@ -0,0 +1,291 @@
+// Volume sampling and ray marching shared by the raycasters. Positions are
+// given in the texture space of level 0, relative to the current origin of a
+// rolling volume.
+
+// Must match MAX_VOLUME_LEVELS
+#define MAX_LEVELS 4
+// Must match OCCUPANCY_BRICK_SIZE
+#define BRICK_SIZE 8
+
+#ifdef PACKED_VOXELS
+// x = snorm16 tsdf in the low half and the weight in the high half,
+// y = RGBA8 color
+uniform usampler3D voxel_tex[MAX_LEVELS];
+#else
+uniform sampler3D tsdf_tex[MAX_LEVELS];
+uniform sampler3D color_tex[MAX_LEVELS];
+#endif
+// One texel per brick of texels. x is non-zero if the brick or its one voxel
+// border has a negative tsdf, y is the epoch when x last changed, see
+// occupancy.glsl.
+uniform usampler3D occupancy_tex[MAX_LEVELS];
+// Octahedral encoded normals kept up to date by normals.glsl. Only valid
+// when cached_normals is set.
+uniform sampler3D normal_tex[MAX_LEVELS];
+uniform bool      cached_normals;
+
+uniform vec3      volume_dims;
+uniform int       num_levels;
+uniform ivec3     volume_wrap[MAX_LEVELS]; // Texel that holds the first voxel
+uniform float     step_size;
+
+
+// Positions are given in the texture space of level 0. Every level shares the
+// same center and doubles the extent of the previous one.
+vec3 levelCoords(vec3 p, int level)
+{
+    return (p - 0.5) / float(1 << level) + 0.5;
+}
+
+// Finest level that contains p, keeping one voxel away from its border so
+// the filtering and the gradients don't read outside of it
+int selectLevel(vec3 p)
+{
+    vec3 d = abs(p - 0.5) * 2.0;
+    float extent = max(d.x, max(d.y, d.z)) / (1.0 - 2.0 / volume_dims.x);
+    int level = extent <= 1.0 ? 0 : int(ceil(log2(extent)));
+    return min(level, num_levels - 1);
+}
+
+// The volume is addressed toroidally, so every lookup is offset by the texel
+// that holds the first voxel and wrapped around the texture borders
+vec3 wrapCoords(vec3 p, int level)
+{
+    return p + vec3(volume_wrap[level]) / volume_dims;
+}
+
+ivec3 wrapVoxel(ivec3 v, int level)
+{
+    ivec3 dims = ivec3(volume_dims);
+    return (v + volume_wrap[level] + dims) % dims;
+}
+
+// Sampler arrays can only be indexed with dynamically uniform expressions,
+// and the level changes from one fragment to the next
+#ifdef PACKED_VOXELS
+uvec2 texelVoxel(ivec3 t, int level)
+{
+    switch (level) {
+    case 0:  return texelFetch(voxel_tex[0], t, 0).xy;
+    case 1:  return texelFetch(voxel_tex[1], t, 0).xy;
+    case 2:  return texelFetch(voxel_tex[2], t, 0).xy;
+    default: return texelFetch(voxel_tex[3], t, 0).xy;
+    }
+}
+
+// Integer textures can't be filtered, so packed voxels are interpolated by hand
+
+float fetchTsdf(ivec3 v, int level)
+{
+    return unpackSnorm2x16(texelVoxel(wrapVoxel(v, level), level).x).x;
+}
+
+vec3 fetchColor(ivec3 v, int level)
+{
+    return unpackUnorm4x8(texelVoxel(wrapVoxel(v, level), level).y).rgb;
+}
+
+float sampleTsdf(vec3 p, int level)
+{
+    vec3 v = levelCoords(p, level) * volume_dims - 0.5;
+    ivec3 v0 = ivec3(floor(v));
+    vec3 f = v - vec3(v0);
+    float c00 = mix(fetchTsdf(v0, level),                 fetchTsdf(v0 + ivec3(1, 0, 0), level), f.x);
+    float c10 = mix(fetchTsdf(v0 + ivec3(0, 1, 0), level), fetchTsdf(v0 + ivec3(1, 1, 0), level), f.x);
+    float c01 = mix(fetchTsdf(v0 + ivec3(0, 0, 1), level), fetchTsdf(v0 + ivec3(1, 0, 1), level), f.x);
+    float c11 = mix(fetchTsdf(v0 + ivec3(0, 1, 1), level), fetchTsdf(v0 + ivec3(1, 1, 1), level), f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+}
+
+vec3 sampleColor(vec3 p, int level)
+{
+    vec3 v = levelCoords(p, level) * volume_dims - 0.5;
+    ivec3 v0 = ivec3(floor(v));
+    vec3 f = v - vec3(v0);
+    vec3 c00 = mix(fetchColor(v0, level),                 fetchColor(v0 + ivec3(1, 0, 0), level), f.x);
+    vec3 c10 = mix(fetchColor(v0 + ivec3(0, 1, 0), level), fetchColor(v0 + ivec3(1, 1, 0), level), f.x);
+    vec3 c01 = mix(fetchColor(v0 + ivec3(0, 0, 1), level), fetchColor(v0 + ivec3(1, 0, 1), level), f.x);
+    vec3 c11 = mix(fetchColor(v0 + ivec3(0, 1, 1), level), fetchColor(v0 + ivec3(1, 1, 1), level), f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+}
+#else
+float fetchTsdf(ivec3 v, int level)
+{
+    ivec3 t = wrapVoxel(v, level);
+    switch (level) {
+    case 0:  return texelFetch(tsdf_tex[0], t, 0).r;
+    case 1:  return texelFetch(tsdf_tex[1], t, 0).r;
+    case 2:  return texelFetch(tsdf_tex[2], t, 0).r;
+    default: return texelFetch(tsdf_tex[3], t, 0).r;
+    }
+}
+
+float sampleTsdf(vec3 p, int level)
+{
+    vec3 c = wrapCoords(levelCoords(p, level), level);
+    switch (level) {
+    case 0:  return texture(tsdf_tex[0], c).r;
+    case 1:  return texture(tsdf_tex[1], c).r;
+    case 2:  return texture(tsdf_tex[2], c).r;
+    default: return texture(tsdf_tex[3], c).r;
+    }
+}
+
+vec3 sampleColor(vec3 p, int level)
+{
+    vec3 c = wrapCoords(levelCoords(p, level), level);
+    switch (level) {
+    case 0:  return texture(color_tex[0], c).rgb;
+    case 1:  return texture(color_tex[1], c).rgb;
+    case 2:  return texture(color_tex[2], c).rgb;
+    default: return texture(color_tex[3], c).rgb;
+    }
+}
+#endif
+
+uvec2 brickOccupancy(vec3 p, int level)
+{
+    ivec3 v = ivec3(floor(levelCoords(p, level) * volume_dims));
+    ivec3 brick = wrapVoxel(v, level) / BRICK_SIZE;
+    switch (level) {
+    case 0:  return texelFetch(occupancy_tex[0], brick, 0).xy;
+    case 1:  return texelFetch(occupancy_tex[1], brick, 0).xy;
+    case 2:  return texelFetch(occupancy_tex[2], brick, 0).xy;
+    default: return texelFetch(occupancy_tex[3], brick, 0).xy;
+    }
+}
+
+bool brickOccupied(vec3 p, int level)
+{
+    return brickOccupancy(p, level).x != 0u;
+}
+
+// Distance along 'dir' to the first point past the brick that contains p.
+// Bricks are aligned to the texels, not to the voxels of a rolled volume.
+float brickExit(vec3 p, vec3 dir, int level)
+{
+    vec3 texel = levelCoords(p, level) * volume_dims + vec3(volume_wrap[level]);
+    vec3 local = mod(texel, float(BRICK_SIZE));
+    // Ray direction in texels
+    vec3 d = dir * volume_dims / float(1 << level);
+    vec3 bound = mix(vec3(0.0), vec3(BRICK_SIZE), greaterThan(d, vec3(0.0)));
+    vec3 t = (bound - local) / d;
+    // Step a hundredth of a texel into the next brick
+    return min(t.x, min(t.y, t.z)) + 0.01 / length(d);
+}
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * mix(vec2(-1.0), vec2(1.0),
+                                       greaterThanEqual(n.xy, vec2(0.0)));
+    return normalize(n);
+}
+
+vec3 fetchNormal(ivec3 v, int level)
+{
+    ivec3 t = wrapVoxel(v, level);
+    switch (level) {
+    case 0:  return octDecode(texelFetch(normal_tex[0], t, 0).xy);
+    case 1:  return octDecode(texelFetch(normal_tex[1], t, 0).xy);
+    case 2:  return octDecode(texelFetch(normal_tex[2], t, 0).xy);
+    default: return octDecode(texelFetch(normal_tex[3], t, 0).xy);
+    }
+}
+
+vec3 calculateNormal(vec3 p)
+{
+    int level = selectLevel(p);
+    ivec3 v = ivec3(floor(levelCoords(p, level) * volume_dims));
+    if (cached_normals)
+        return fetchNormal(v, level);
+
+    vec3 n;
+    n.x = fetchTsdf(ivec3(v.x + 1, v.yz), level)
+        - fetchTsdf(ivec3(v.x - 1, v.yz), level);
+    n.y = fetchTsdf(ivec3(v.x, v.y + 1, v.z), level)
+        - fetchTsdf(ivec3(v.x, v.y - 1, v.z), level);
+    n.z = fetchTsdf(ivec3(v.xy, v.z + 1), level)
+        - fetchTsdf(ivec3(v.xy, v.z - 1), level);
+    n = normalize(n);
+    return n;
+}
+
+vec2 rayVolumeIntersect(vec3 origin, vec3 dir)
+{
+    // The box of the outermost level
+    float extent = float(1 << (num_levels - 1));
+    vec3 box_min = vec3(0.5 - extent * 0.5);
+    vec3 box_max = vec3(0.5 + extent * 0.5);
+    vec3 inv_dir = 1.0 / dir;
+    vec3 tmin_tmp = (box_min - origin) * inv_dir;
+    vec3 tmax_tmp = (box_max - origin) * inv_dir;
+    vec3 tmin = min(tmin_tmp, tmax_tmp);
+    vec3 tmax = max(tmin_tmp, tmax_tmp);
+    float t0 = max(tmin.x, max(tmin.y, tmin.z));
+    float t1 = min(tmax.x, min(tmax.y, tmax.z));
+    return vec2(t0, t1);
+}
+
+// Advance t to the first brick along the ray that may contain a surface.
+// Returns false if there is none before t_end.
+bool skipEmptyBricks(vec3 origin, vec3 dir, inout float t, float t_end)
+{
+    while (t < t_end) {
+        vec3 p = origin + dir * t;
+        int level = selectLevel(p);
+        if (brickOccupied(p, level))
+            return true;
+        t += brickExit(p, dir, level);
+    }
+    return false;
+}
+
+// March a texture space ray from t1 to t2 and find the first zero crossing.
+// 'dir' must be normalized.
+bool marchInterval(vec3 origin, vec3 dir, float t1, float t2,
+                   out vec3 surface_point)
+{
+    float dt = step_size;
+    float prev_tsdf = 0.0;
+
+    for (float t = t1; t < t2; t += dt) {
+        vec3 p = origin + dir * t;
+        int level = selectLevel(p);
+
+        // Empty bricks can't hold a zero crossing. Jump to the last sample
+        // inside of them, which becomes the previous sample of the next
+        // brick.
+        float t_last = t + brickExit(p, dir, level) - dt;
+        if (t_last > t && !brickOccupied(p, level)) {
+            t = t_last;
+            p = origin + dir * t;
+            level = selectLevel(p);
+        }
+
+        float tsdf = sampleTsdf(p, level);
+        if (tsdf < 0.0) {
+            // Linearly interpolate the surface
+            float surface_t = mix(t, t - dt, prev_tsdf / (prev_tsdf - tsdf));
+            surface_point = origin + dir * surface_t;
+            return true;
+        }
+
+        prev_tsdf = tsdf;
+        // Coarser levels are marched with proportionally longer steps. dt is
+        // only updated here so 't - dt' above is always the previous sample.
+        dt = step_size * float(1 << level);
+    }
+    return false;
+}
+
+bool marchRay(vec3 origin, vec3 dir, out vec3 surface_point)
+{
+    vec2 intersection = rayVolumeIntersect(origin, dir);
+    // Do not sample voxels behind the camera
+    float t = max(intersection.x, 0.0);
+    if (!skipEmptyBricks(origin, dir, t, intersection.y))
+        return false;
+    return marchInterval(origin, dir, t, intersection.y, surface_point);
+}
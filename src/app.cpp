@@ -1,6 +1,5 @@
 #include "app.hpp"
 
-#include <fstream>
 #include <iostream>
 
 #include <glm/glm.hpp>
@@ -12,10 +11,17 @@
 #include "examples/imgui_impl_glfw.h"
 #include "examples/imgui_impl_opengl3.h"
 
-#include "stb_image.h"
-
+#include "block_store.hpp"
+#include "checkpoint_log.hpp"
+#include "dataset_source.hpp"
+#include "frame_cache.hpp"
+#include "point_cloud.hpp"
+#include "profiler.hpp"
 #include "shader.hpp"
+#include "socket_source.hpp"
+#include "submap_manager.hpp"
 #include "volume.hpp"
+#include "volume_readback.hpp"
 
 
 const glm::uvec2 SCREEN_SIZE        = {1280, 720};
@@ -24,17 +30,63 @@ const glm::uvec2 SCREEN_SIZE        = {1280, 720};
 const glm::uvec3 VOLUME_DIMS        = {512, 512, 512};
 // Size of each voxel in meters
 const float      VOLUME_RESOLUTION  = 0.02f;
+// Voxel memory layout, PACKED_VOXELS halves the memory transactions of the
+// integration shader at the cost of manual filtering in the raycaster.
+// SEPARATE_VOXELS_8BIT_WEIGHT halves the weight texture, capping the weight.
+const Volume::VoxelFormat VOLUME_FORMAT = Volume::SEPARATE_VOXELS;
+// Number of resolution levels. Each extra level doubles the voxel size and
+// the extent of the previous one, so distant geometry is kept at a coarser
+// resolution instead of being dropped.
+const int        VOLUME_LEVELS      = 1;
 
 const glm::uvec2 DATASET_FRAME_SIZE = {640, 480};
+const int        DATASET_FRAME_COUNT = 1000;
+// Frames received from a socket that can wait to be integrated
+const int        SOCKET_QUEUE_SIZE = 4;
+// Frames integrated per dispatch, up to MAX_BATCH_FRAMES. Larger batches
+// amortize the volume memory traffic when replaying a dataset offline, at the
+// cost of integrating several frames per displayed frame.
+const int        INTEGRATION_BATCH_SIZE = 1;
+
+// Voxel blocks that leave a rolling volume are kept in host memory up to this
+// many bytes, the rest is compressed and written to disk
+const size_t     BLOCK_STORE_BUDGET = size_t(1) << 30;
+const char      *BLOCK_STORE_PATH   = "sfm_blocks.tmp";
+
+// Host memory used by the voxel blocks waiting to be turned into points
+const size_t     EXPORT_MEMORY_BUDGET = size_t(256) << 20;
+
+// A new submap is started after this many frames or meters of camera travel,
+// zero disables either trigger. Both are off by default, so the volume is a
+// single map until enabled from the GUI.
+const int        SUBMAP_MAX_FRAMES   = 0;
+const float      SUBMAP_MAX_DISTANCE = 0.0f;
+// Host memory used by the blocks of a frozen submap waiting to be compressed
+const size_t     SUBMAP_MEMORY_BUDGET = size_t(512) << 20;
+
+// Pixel buffers for asynchronous volume readbacks, enough for a whole level
+// of the volume at 8 bytes per voxel
+const size_t     READBACK_MEMORY_BUDGET = size_t(1) << 30;
+
+// Log of the modified blocks, to recover the volume after a crash
+const char      *CHECKPOINT_PATH = "checkpoint.sfmc";
+
+// Host memory used by the recent frames kept to be de-integrated. A 640x480
+// frame takes a bit over 1 MB.
+const size_t     FRAME_CACHE_BUDGET = size_t(256) << 20;
+
+const char      *PROFILER_TRACE_PATH = "sfm_trace.json";
 
 
 App::App(int argc, char **argv) :
+    _frame_selector(DATASET_FRAME_SIZE),
     _fx(585.0f),
     _fy(585.0f),
     _cx(DATASET_FRAME_SIZE.x / 2.0f),
     _cy(DATASET_FRAME_SIZE.y / 2.0f)
 {
     processCmdArgs(argc, argv);
+    _batch.resize(INTEGRATION_BATCH_SIZE);
 }
 
 void
@@ -50,11 +102,24 @@ void
 App::processCmdArgs(int argc, char **argv)
 {
     if (argc < 2) {
-        std::cerr << "No dataset directory specified" << std::endl;
+        std::cerr << "No dataset directory or socket address specified"
+                  << std::endl;
         exit(0);
     }
 
-    _dataset_dir = argv[1];
+    std::string input = argv[1];
+    try {
+        if (input.compare(0, 4, "tcp:") == 0 ||
+            input.compare(0, 5, "unix:") == 0)
+            _source = new SocketFrameSource(input, DATASET_FRAME_SIZE,
+                                            SOCKET_QUEUE_SIZE);
+        else
+            _source = openDataset(input, DATASET_FRAME_SIZE,
+                                  DATASET_FRAME_COUNT);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
 }
 
 void
@@ -63,9 +128,25 @@ App::mainLoop()
     _volume = new Volume(VOLUME_DIMS,
                          VOLUME_RESOLUTION,
                          glm::vec3(0.0f, 0.0f, 0.0f),
-                         DATASET_FRAME_SIZE);
+                         DATASET_FRAME_SIZE,
+                         VOLUME_FORMAT,
+                         VOLUME_LEVELS);
+    _block_store = new BlockStore(BLOCK_STORE_PATH, BLOCK_STORE_BUDGET);
+    _volume->setBlockStore(_block_store);
+    _readback = new VolumeReadback(_volume, READBACK_MEMORY_BUDGET);
+    _submaps = new SubmapManager(_volume, _readback, SUBMAP_MAX_FRAMES,
+                                 SUBMAP_MAX_DISTANCE, SUBMAP_MEMORY_BUDGET);
+    _frame_cache = new FrameCache(DATASET_FRAME_SIZE, FRAME_CACHE_BUDGET);
+
+    Profiler::setThreadName("Main");
 
     while (!glfwWindowShouldClose(_window)) {
+        // The profiler panel shows the last complete iteration
+        uint64_t frame_start = Profiler::now();
+        _profiled_frame_start = _frame_start;
+        _profiled_frame_end = frame_start;
+        _frame_start = frame_start;
+
         float current_time = glfwGetTime();
         _delta_time = current_time - _last_time;
         _last_time = current_time;
@@ -85,32 +166,79 @@ App::mainLoop()
         glClear(GL_COLOR_BUFFER_BIT);
 
         if (!_paused) {
-            if (_current_frame < _total_frames) {
-                unsigned short *depth_data = nullptr;
-                unsigned char  *color_data = nullptr;
-                glm::mat4 extrinsic(1.0f);
-                glm::mat3 intrinsic(0.0f);
-                intrinsic[0][0] = _fx;
-                intrinsic[1][1] = _fy;
-                intrinsic[2][0] = _cx;
-                intrinsic[2][1] = _cy;
-                intrinsic[1][0] = _s;
-                intrinsic[2][2] = 1.0f;
-
-                bool data_received = loadDataFrame(_current_frame,
-                                                   &depth_data,
-                                                   &color_data,
-                                                   &extrinsic);
-                if (data_received) {
-                    _volume->integrate(depth_data, color_data, intrinsic, extrinsic);
-                    stbi_image_free(depth_data);
-                    stbi_image_free(color_data);
-                    ++_current_frame;
+            glm::mat3 intrinsic(0.0f);
+            intrinsic[0][0] = _fx;
+            intrinsic[1][1] = _fy;
+            intrinsic[2][0] = _cx;
+            intrinsic[2][1] = _cy;
+            intrinsic[1][0] = _s;
+            intrinsic[2][2] = 1.0f;
+
+            // Frames of a batch share the intrinsics. Sources that provide
+            // their own override the ones set in the GUI.
+            const unsigned short *depth_batch[MAX_BATCH_FRAMES];
+            const unsigned char  *color_batch[MAX_BATCH_FRAMES];
+            glm::mat4 extrinsic_batch[MAX_BATCH_FRAMES];
+            int count = 0;
+            for (; count < _deferred_frames; ++count) {
+                depth_batch[count] = _batch[count].depth.data();
+                color_batch[count] = _batch[count].color.data();
+                extrinsic_batch[count] = _batch[count].extrinsic;
+            }
+            while (count < INTEGRATION_BATCH_SIZE) {
+                Frame &frame = _batch[count];
+                if (!_source->read(&frame))
+                    break;
+                if (frame.has_intrinsic) {
+                    intrinsic = frame.intrinsic;
+                    // Show the intrinsics actually in use
+                    _fx = intrinsic[0][0];
+                    _fy = intrinsic[1][1];
+                    _cx = intrinsic[2][0];
+                    _cy = intrinsic[2][1];
+                    _s  = intrinsic[1][0];
                 }
+                if (!_frame_selector.select(frame.depth.data(),
+                                            intrinsic, frame.extrinsic))
+                    continue;
+                depth_batch[count] = frame.depth.data();
+                color_batch[count] = frame.color.data();
+                extrinsic_batch[count] = frame.extrinsic;
+                ++count;
+            }
+
+            // The frames wait while the active submap is being frozen
+            bool integrated = count > 0 &&
+                _submaps->integrateBatch(depth_batch, color_batch, intrinsic,
+                                         extrinsic_batch, count);
+            _deferred_frames = integrated ? 0 : count;
+            if (integrated) {
+                // Frames of a frozen submap are no longer in the volume
+                if (_submaps->getActiveSubmap() != _cached_submap) {
+                    _frame_cache->clear();
+                    _cached_submap = _submaps->getActiveSubmap();
+                }
+                for (int i = 0; i < count; ++i)
+                    _frame_cache->add(_volume, _next_frame_id++,
+                                      depth_batch[i], color_batch[i],
+                                      intrinsic, extrinsic_batch[i]);
             }
         }
 
         _volume->draw(&_camera);
+        if (_checkpoints &&
+            current_time - _last_checkpoint >= _checkpoint_interval) {
+            try {
+                _checkpoint_log->checkpoint();
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                _checkpoints = false;
+            }
+            _last_checkpoint = current_time;
+        }
+        if (_checkpoint_log)
+            _checkpoint_log->update();
+        _readback->poll();
 
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
@@ -118,7 +246,13 @@ App::mainLoop()
         glfwPollEvents();
     }
 
+    delete _checkpoint_log;
+    delete _readback;
+    delete _frame_cache;
+    delete _submaps;
     delete _volume;
+    delete _block_store;
+    delete _source;
 }
 
 void
@@ -170,6 +304,7 @@ App::initGUI()
 void
 App::processInput()
 {
+    PROFILE_SCOPE("App::processInput");
     if (ImGui::GetIO().WantCaptureKeyboard)
         return;
 
@@ -219,6 +354,7 @@ App::processInput()
 void
 App::drawGUI()
 {
+    PROFILE_SCOPE("App::drawGUI");
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
@@ -258,6 +394,131 @@ App::drawGUI()
         ImGui::RadioButton("Normals", &display_mode, 1);
         ImGui::RadioButton("Phong Shading", &display_mode, 2);
         _volume->setDisplayMode(display_mode);
+        bool cached_normals = _volume->getCachedNormals();
+        if (ImGui::Checkbox("Cached normals", &cached_normals))
+            _volume->setCachedNormals(cached_normals);
+        bool proxy_bounds = _volume->getProxyBounds();
+        if (ImGui::Checkbox("Brick proxy bounds", &proxy_bounds))
+            _volume->setProxyBounds(proxy_bounds);
+        bool reprojection = _volume->getReprojection();
+        if (ImGui::Checkbox("Reproject ray starts", &reprojection))
+            _volume->setReprojection(reprojection);
+    }
+    if (ImGui::CollapsingHeader("Volume Settings", ImGuiTreeNodeFlags_DefaultOpen)) {
+        ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
+        int max_weight = _volume->getMaxWeight();
+        if (ImGui::SliderInt("Max weight", &max_weight, 1,
+                             _volume->getMaxWeightLimit()))
+            _volume->setMaxWeight(max_weight);
+        bool depth_culling = _volume->getDepthCulling();
+        if (ImGui::Checkbox("Cull hidden bricks", &depth_culling))
+            _volume->setDepthCulling(depth_culling);
+        bool rolling = _volume->getRolling();
+        if (ImGui::Checkbox("Follow camera", &rolling))
+            _volume->setRolling(rolling);
+        float roll_threshold = _volume->getRollThreshold();
+        ImGui::SliderFloat("Roll threshold", &roll_threshold, 0.1f,
+                           VOLUME_DIMS.x * VOLUME_RESOLUTION / 2.0f, "%.2f m");
+        _volume->setRollThreshold(roll_threshold);
+        glm::ivec3 origin = _volume->getOrigin();
+        ImGui::Text("Origin: %i, %i, %i", origin.x, origin.y, origin.z);
+        int levels = _volume->getLevels();
+        ImGui::Text("Levels: %i (%.3f - %.3f m voxels)", levels,
+                    _volume->getResolution(), _volume->getResolution(levels - 1));
+
+        ImGui::Separator();
+        ImGui::Text("Block Streaming");
+        int budget_mb = int(_block_store->getMemoryBudget() >> 20);
+        if (ImGui::SliderInt("Host budget (MB)", &budget_mb, 64, 16384))
+            _block_store->setMemoryBudget(size_t(budget_mb) << 20);
+        BlockStore::Stats stats = _block_store->getStats();
+        ImGui::Text("Host: %zu blocks, %.1f MB",
+                    stats.host_blocks, stats.host_bytes / 1048576.0);
+        ImGui::Text("Disk: %zu blocks, %.1f MB",
+                    stats.disk_blocks, stats.disk_bytes / 1048576.0);
+        ImGui::PopItemWidth();
+    }
+    if (ImGui::CollapsingHeader("Submaps")) {
+        ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
+        int max_frames = _submaps->getMaxFrames();
+        if (ImGui::SliderInt("Max frames", &max_frames, 0, 2000))
+            _submaps->setMaxFrames(max_frames);
+        float max_distance = _submaps->getMaxDistance();
+        if (ImGui::SliderFloat("Max distance", &max_distance, 0.0f, 20.0f,
+                               "%.1f m"))
+            _submaps->setMaxDistance(max_distance);
+        SubmapManager::Stats stats = _submaps->getStats();
+        ImGui::Text("%i submaps, %zu frozen blocks, %.1f MB",
+                    stats.submaps, stats.frozen_blocks,
+                    stats.compressed_bytes / 1048576.0);
+        ImGui::Text("%zu pending jobs", stats.pending_jobs);
+        if (ImGui::Button("Start new submap", ImVec2(-1, 0)))
+            _submaps->startSubmap();
+        ImGui::PopItemWidth();
+        ImGui::PushItemWidth(-1);
+        bool path_changed = ImGui::InputText("##submap_export_path",
+                                             _submap_export_path,
+                                             sizeof(_submap_export_path));
+        ImGui::PopItemWidth();
+        path_changed |= ImGui::Checkbox("Export when frozen",
+                                        &_submap_auto_export);
+        if (path_changed)
+            _submaps->setExportPath(_submap_export_path, _submap_auto_export);
+        if (ImGui::Button("Export frozen submaps", ImVec2(-1, 0))) {
+            _submaps->setExportPath(_submap_export_path, _submap_auto_export);
+            _submaps->exportFrozen();
+        }
+    }
+    if (ImGui::CollapsingHeader("Checkpoints")) {
+        ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
+        // Enabling checkpoints starts a new log, restore the old one first
+        if (ImGui::Checkbox("Enabled", &_checkpoints) && _checkpoints &&
+            !_checkpoint_log) {
+            try {
+                _checkpoint_log = new CheckpointLog(CHECKPOINT_PATH, _volume,
+                                                    _readback);
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                _checkpoints = false;
+            }
+        }
+        ImGui::SliderFloat("Interval", &_checkpoint_interval, 1.0f, 60.0f,
+                           "%.0f s");
+        ImGui::PopItemWidth();
+        if (_checkpoint_log) {
+            CheckpointLog::Stats stats = _checkpoint_log->getStats();
+            ImGui::Text("%i checkpoints, %i compactions",
+                        stats.checkpoints, stats.compactions);
+            ImGui::Text("%zu blocks, %.1f of %.1f MB live", stats.blocks,
+                        stats.live_bytes / 1048576.0,
+                        stats.file_bytes / 1048576.0);
+        }
+        if (ImGui::Button("Restore from checkpoint log", ImVec2(-1, 0)))
+            restoreCheckpoint();
+    }
+    if (ImGui::CollapsingHeader("Frame Cache")) {
+        ImGui::Text("%i frames, %.1f MB", _frame_cache->getFrameCount(),
+                    _frame_cache->getMemoryUsage() / 1048576.0);
+        // Takes the cached frames back out of the volume, which should leave
+        // their voxels as they were before
+        if (ImGui::Button("De-integrate cached frames", ImVec2(-1, 0))) {
+            std::vector<int> ids = _frame_cache->getIds();
+            _frame_cache->remove(_volume, ids.data(), int(ids.size()));
+        }
+    }
+    if (ImGui::CollapsingHeader("Keyframe Selection",
+                                ImGuiTreeNodeFlags_DefaultOpen)) {
+        ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
+        ImGui::Checkbox("Skip redundant frames", &_frame_selector._enabled);
+        ImGui::SliderFloat("Min translation", &_frame_selector._min_translation,
+                           0.0f, 0.1f, "%.3f m");
+        ImGui::SliderFloat("Min rotation", &_frame_selector._min_rotation,
+                           0.0f, 10.0f, "%.1f deg");
+        ImGui::SliderFloat("Min depth overlap", &_frame_selector._min_overlap,
+                           0.0f, 1.0f, "%.2f");
+        ImGui::SliderInt("Max skipped frames", &_frame_selector._max_skipped,
+                         1, 120);
+        ImGui::PopItemWidth();
     }
     if (ImGui::CollapsingHeader("Intrinsic Parameters",
                                 ImGuiTreeNodeFlags_DefaultOpen)) {
@@ -299,93 +560,170 @@ App::drawGUI()
         ImGui::Text("Stopped");
     else
         ImGui::Text("Playing...");
-    ImGui::Text("Frame %i of %i", std::min(_current_frame + 1, _total_frames),
-                _total_frames);
+    if (_source->size() >= 0) {
+        ImGui::Text("Frame %i of %i",
+                    std::min(_source->position() + 1, _source->size()),
+                    _source->size());
+    } else if (_source->position() >= 0) {
+        ImGui::Text("Frame %i", _source->position());
+    } else if (auto *socket = dynamic_cast<SocketFrameSource *>(_source)) {
+        SocketFrameSource::Stats socket_stats = socket->getStats();
+        ImGui::Text("%s, %zu received, %zu pending",
+                    socket_stats.connected ? "Connected" : "Waiting for sender",
+                    socket_stats.received, socket_stats.pending);
+        ImGui::Text("%zu dropped, %zu rejected",
+                    socket_stats.dropped, socket_stats.rejected);
+        bool block = socket->getPolicy() == SocketFrameSource::BLOCK;
+        if (ImGui::Checkbox("Block sender when behind", &block))
+            socket->setPolicy(block ? SocketFrameSource::BLOCK
+                                    : SocketFrameSource::DROP_OLDEST);
+    }
     ImGui::Text("%.0f fps, %.2f ms",
                 ImGui::GetIO().Framerate,
                 1000.0f / ImGui::GetIO().Framerate);
+    ImGui::Text("Integration: %.2f ms (GPU)", _volume->getIntegrateTime());
     ImGui::Separator();
-    if (ImGui::Button("Return to first frame", ImVec2(-1, 0)))
-        _current_frame = 0;
-    if (ImGui::Button("Reset volume", ImVec2(-1, 0)))
-        _volume->reset();
+    FrameSelector::Stats stats = _frame_selector.getStats();
+    ImGui::Text("Integrated %i of %i frames (%.0f%% skipped)",
+                stats.integrated, stats.frames,
+                stats.frames ? 100.0f * (stats.frames - stats.integrated) /
+                               stats.frames : 0.0f);
+    ImGui::Separator();
+    if (ImGui::Button("Return to first frame", ImVec2(-1, 0))) {
+        _source->rewind();
+        _frame_selector.reset();
+    }
+    if (ImGui::Button("Reset volume", ImVec2(-1, 0))) {
+        _submaps->reset();
+        _frame_cache->clear();
+        _frame_selector.reset();
+    }
+    ImGui::Separator();
+    ImGui::PushItemWidth(-1);
+    ImGui::InputText("##export_path", _export_path, sizeof(_export_path));
+    ImGui::PopItemWidth();
+    if (ImGui::Button("Export point cloud (.ply/.las)", ImVec2(-1, 0)))
+        exportPointCloud();
+    // Hashed on the readback thread, the integration doesn't stall
+    if (ImGui::Button("Print volume checksum", ImVec2(-1, 0))) {
+        auto print = [](const VolumeReadback::Result &result) {
+            const VolumeReadback::Region &region = result.regions[0];
+            BrickedGrid<Voxel> grid(region.size);
+            Volume::decodeRegion(result.format, region.data, region.size,
+                                 &grid, glm::ivec3(0));
+            std::cout << "Volume checksum " << std::hex << checksumGrid(grid)
+                      << std::dec << std::endl;
+        };
+        if (!_readback->startLevel(0, print))
+            std::cerr << "The volume doesn't fit in the readback memory "
+                      << "budget" << std::endl;
+    }
     ImGui::End();
+
+    drawProfiler();
 }
 
-bool
-App::loadDataFrame(int n,
-                   unsigned short **depth,
-                   unsigned char **color,
-                   glm::mat4 *extrinsic)
+// Timeline of the scopes recorded during the last frame, one lane per thread
+// and one row per nesting level
+void
+App::drawProfiler()
 {
-    std::string base_filename(_dataset_dir + "/frame-");
-    char frame_number[7];
-    std::snprintf(frame_number, sizeof(frame_number), "%06d", n);
-    base_filename += frame_number;
-
-    int width = 0, height = 0, channels = 0;
-
-    std::string depth_filename(base_filename + ".depth.png");
-    *depth = stbi_load_16(
-        depth_filename.c_str(), &width, &height, &channels, 0);
-    if (!(*depth)) {
-        std::cerr << "Failed to read depth image from file '"
-                  << depth_filename << "'. Skipping frame..." << std::endl;
-        return false;
-    }
-    if (width != DATASET_FRAME_SIZE.x || height != DATASET_FRAME_SIZE.y) {
-        std::cerr << "Depth image '" << depth_filename << "' has size "
-                  << width << "x" << height
-                  << " but expected "
-                  << DATASET_FRAME_SIZE.x << "x" << DATASET_FRAME_SIZE.y
-                  << ". Skipping frame... " << std::endl;
-        return false;
-    }
-    if (channels != 1) {
-        std::cerr << "Depth image '" << depth_filename << "' has "
-                  << channels << " channel(s) but expected 1. Skipping frame..."
-                  << std::endl;
-        return false;
-    }
+    ImGui::SetNextWindowSize(ImVec2(600.0f, 200.0f), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Profiler");
+    bool enabled = Profiler::isEnabled();
+    if (ImGui::Checkbox("Enabled", &enabled))
+        Profiler::setEnabled(enabled);
+    ImGui::SameLine();
+    if (ImGui::Button("Export Chrome trace"))
+        Profiler::writeChromeTrace(PROFILER_TRACE_PATH);
 
-    std::string color_filename(base_filename + ".color.png");
-    *color = stbi_load(
-        color_filename.c_str(), &width, &height, &channels, 0);
-    if (!(*color)) {
-        std::cerr << "Failed to read color image from file '"
-                  << color_filename << "'. Skipping frame..." << std::endl;
-        return false;
+    uint64_t frame_start = _profiled_frame_start;
+    uint64_t frame_end = _profiled_frame_end;
+    if (!enabled || frame_end <= frame_start) {
+        ImGui::End();
+        return;
     }
-    if (width != DATASET_FRAME_SIZE.x || height != DATASET_FRAME_SIZE.y) {
-        std::cerr << "Color image '" << color_filename << "' has size "
-                  << width << "x" << height
-                  << " but expected "
-                  << DATASET_FRAME_SIZE.x << "x" << DATASET_FRAME_SIZE.y
-                  << ". Skipping frame... " << std::endl;
-        return false;
+    float frame_ms = (frame_end - frame_start) / 1e6f;
+    ImGui::Text("Last frame: %.2f ms", frame_ms);
+
+    const float row_height = ImGui::GetTextLineHeightWithSpacing();
+    const float label_width = 120.0f;
+    float width = ImGui::GetContentRegionAvail().x - label_width;
+    ImDrawList *draw_list = ImGui::GetWindowDrawList();
+
+    for (const Profiler::Thread &thread : Profiler::collect(frame_start)) {
+        int rows = 0;
+        for (const Profiler::Event &event : thread.events)
+            if (event.start < frame_end)
+                rows = std::max(rows, event.depth + 1);
+        if (rows == 0)
+            continue;
+
+        ImVec2 origin = ImGui::GetCursorScreenPos();
+        draw_list->AddText(origin, IM_COL32(0, 0, 0, 255), thread.name.c_str());
+        for (const Profiler::Event &event : thread.events) {
+            if (event.start >= frame_end)
+                continue;
+            float x0 = std::max(0.0f, float(event.start) - frame_start) /
+                (frame_end - frame_start) * width;
+            float x1 = std::min(float(frame_end - frame_start),
+                                float(event.end) - frame_start) /
+                (frame_end - frame_start) * width;
+            ImVec2 min(origin.x + label_width + x0,
+                       origin.y + event.depth * row_height);
+            ImVec2 max(origin.x + label_width + std::max(x1, x0 + 1.0f),
+                       min.y + row_height - 1.0f);
+            // Color by nesting level
+            ImU32 color = IM_COL32(90 + 40 * (event.depth % 4), 140, 210, 255);
+            draw_list->AddRectFilled(min, max, color);
+            draw_list->PushClipRect(min, max, true);
+            draw_list->AddText(ImVec2(min.x + 2.0f, min.y),
+                               IM_COL32(255, 255, 255, 255), event.name);
+            draw_list->PopClipRect();
+            if (ImGui::IsMouseHoveringRect(min, max))
+                ImGui::SetTooltip("%s: %.3f ms", event.name,
+                                  (event.end - event.start) / 1e6f);
+        }
+        ImGui::Dummy(ImVec2(label_width + width, rows * row_height));
     }
-    if (channels != 3) {
-        std::cerr << "Color image '" << color_filename << "' has "
-                  << channels << " channel(s) but expected 3. Skipping frame..."
-                  << std::endl;
-        ++_current_frame;
-        return false;
+    ImGui::End();
+}
+
+void
+App::exportPointCloud()
+{
+    PROFILE_SCOPE("App::exportPointCloud");
+    try {
+        PointCloudExporter exporter(EXPORT_MEMORY_BUDGET);
+        size_t points = exporter.exportFile(
+            _volume, _export_path,
+            PointCloudExporter::formatFromPath(_export_path));
+        std::cout << "Exported " << points << " points to '"
+                  << _export_path << "'" << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
     }
+}
 
-    std::string pose_filename(base_filename + ".pose.txt");
-    std::ifstream pose_ifs(pose_filename);
-    if (!pose_ifs) {
-        std::cerr << "Failed to read pose matrix from file '"
-                  << pose_filename << "'. Skipping frame..." << std::endl;
-        return false;
+// Replace the volume with the contents of the checkpoint log, which keeps
+// growing from there
+void
+App::restoreCheckpoint()
+{
+    PROFILE_SCOPE("App::restoreCheckpoint");
+    try {
+        _submaps->reset();
+        _frame_cache->clear();
+        _frame_selector.reset();
+        delete _checkpoint_log;
+        _checkpoint_log = nullptr;
+        _checkpoint_log = new CheckpointLog(CHECKPOINT_PATH, _volume,
+                                            _readback, true);
+        size_t blocks = _checkpoint_log->restore();
+        std::cout << "Restored " << blocks << " blocks from '"
+                  << CHECKPOINT_PATH << "'" << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        _checkpoints = false;
     }
-    float pose_floats[16];
-    for (int i = 0; i < 16; ++i)
-        pose_ifs >> pose_floats[i];
-    // Transpose because glm uses column major ordering
-    glm::mat4 pose_matrix = glm::transpose(glm::make_mat4(pose_floats));
-    // The extrinsic matrix is the inverse of the camera pose
-    *extrinsic = glm::inverse(pose_matrix);
-
-    return true;
 }
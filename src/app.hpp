@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -7,8 +8,15 @@
 #include <GLFW/glfw3.h>
 
 #include "camera.hpp"
+#include "frame_selector.hpp"
+#include "frame_source.hpp"
 
+class BlockStore;
+class CheckpointLog;
+class FrameCache;
+class SubmapManager;
 class Volume;
+class VolumeReadback;
 
 class App {
 public:
@@ -17,21 +25,47 @@ public:
 private:
     GLFWwindow *_window     = nullptr;
 
-    std::string _dataset_dir;
+    FrameSource *_source = nullptr;
+    // Frames of the batch being integrated, reused from one batch to the next
+    std::vector<Frame> _batch;
+    // Frames at the start of the batch refused while a submap was frozen
+    int         _deferred_frames = 0;
 
     float       _delta_time = 0.0f;
     float       _last_time  = 0.0f;
 
     Camera      _camera;
+    FrameSelector _frame_selector;
 
     Volume     *_volume;
+    BlockStore *_block_store;
+    SubmapManager *_submaps;
+    VolumeReadback *_readback;
+    // Created once checkpoints are enabled
+    CheckpointLog *_checkpoint_log = nullptr;
+    bool        _checkpoints = false;
+    float       _checkpoint_interval = 5.0f;
+    float       _last_checkpoint = 0.0f;
+    // Recently integrated frames, so they can be taken out of the volume
+    FrameCache *_frame_cache;
+    // Id of the next integrated frame and submap the cached frames belong to
+    int         _next_frame_id = 0;
+    int         _cached_submap = -1;
 
     bool        _paused = true;
-    int         _total_frames = 1000;
-    int         _current_frame = 0;
 
     float       _background_color[3] = {1.0f, 1.0f, 1.0f};
 
+    char        _export_path[256] = "points.ply";
+    char        _submap_export_path[256] = "submap.ply";
+    bool        _submap_auto_export = false;
+
+    // Start of the current frame and bounds of the last complete one, in
+    // profiler time
+    uint64_t    _frame_start = 0;
+    uint64_t    _profiled_frame_start = 0;
+    uint64_t    _profiled_frame_end = 0;
+
     float       _fx = 0.0f;
     float       _fy = 0.0f;
     float       _cx = 0.0f;
@@ -51,8 +85,7 @@ private:
 
     void processInput();
     void drawGUI();
-    bool loadDataFrame(int n,
-                       unsigned short **depth,
-                       unsigned char **color,
-                       glm::mat4 *extrinsic);
+    void drawProfiler();
+    void exportPointCloud();
+    void restoreCheckpoint();
 };
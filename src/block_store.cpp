@@ -0,0 +1,415 @@
+#include "block_store.hpp"
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "profiler.hpp"
+
+
+static uint64_t
+packKey(int level, glm::ivec3 block)
+{
+    // 4 bits for the volume level and 20 bits per axis, which is more than
+    // enough for any realistic trajectory
+    return (uint64_t(uint32_t(level) & 0xF) << 60) |
+           (uint64_t(uint32_t(block.x) & 0xFFFFF) << 40) |
+           (uint64_t(uint32_t(block.y) & 0xFFFFF) << 20) |
+            uint64_t(uint32_t(block.z) & 0xFFFFF);
+}
+
+
+static glm::ivec3
+unpackBlock(uint64_t key)
+{
+    // Sign extend each 20 bit coordinate
+    auto coord = [key](int shift) {
+        return int32_t(uint32_t(key >> shift) << 12) >> 12;
+    };
+    return glm::ivec3(coord(40), coord(20), coord(0));
+}
+
+
+BlockStore::BlockStore(const std::string &path, size_t memory_budget) :
+    _path(path),
+    _memory_budget(memory_budget)
+{
+    _file.open(_path, std::ios::in | std::ios::out |
+                      std::ios::binary | std::ios::trunc);
+    if (!_file)
+        throw std::runtime_error("Failed to create block store '" + _path + "'");
+
+    _worker = std::thread(&BlockStore::workerLoop, this);
+}
+
+BlockStore::~BlockStore()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_all();
+    _worker.join();
+
+    _file.close();
+    std::remove(_path.c_str());
+}
+
+void
+BlockStore::put(int level, glm::ivec3 block,
+                std::vector<unsigned char> &&data)
+{
+    uint64_t key = packKey(level, block);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Any previous copy of this block is now stale
+        auto host_it = _host.find(key);
+        if (host_it != _host.end())
+            eraseHost(host_it);
+        _spilling.erase(key);
+        auto disk_it = _disk.find(key);
+        if (disk_it != _disk.end()) {
+            _disk_bytes -= disk_it->second.compressed_size;
+            _disk.erase(disk_it);
+        }
+
+        insertHost(key, std::make_shared<std::vector<unsigned char>>(
+            std::move(data)));
+        enforceBudget();
+    }
+    _cond.notify_one();
+}
+
+bool
+BlockStore::take(int level, glm::ivec3 block,
+                 std::vector<unsigned char> *data)
+{
+    PROFILE_SCOPE("BlockStore::take");
+    uint64_t key = packKey(level, block);
+    DiskBlock disk_block;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto host_it = _host.find(key);
+        if (host_it != _host.end()) {
+            *data = std::move(*host_it->second.data);
+            eraseHost(host_it);
+            return true;
+        }
+
+        auto spill_it = _spilling.find(key);
+        if (spill_it != _spilling.end()) {
+            // The worker may be compressing it right now, so copy it
+            *data = *spill_it->second;
+            _spilling.erase(spill_it);
+            return true;
+        }
+
+        auto disk_it = _disk.find(key);
+        if (disk_it == _disk.end())
+            return false;
+        disk_block = disk_it->second;
+        _disk_bytes -= disk_block.compressed_size;
+        _disk.erase(disk_it);
+    }
+
+    // The block wasn't prefetched in time, read it synchronously
+    return readFromDisk(disk_block, data);
+}
+
+std::vector<glm::ivec3>
+BlockStore::list(int level) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::unordered_set<uint64_t> keys;
+    for (const auto &entry : _host)
+        keys.insert(entry.first);
+    for (const auto &entry : _spilling)
+        keys.insert(entry.first);
+    for (const auto &entry : _disk)
+        keys.insert(entry.first);
+
+    std::vector<glm::ivec3> blocks;
+    for (uint64_t key : keys)
+        if (int(key >> 60) == level)
+            blocks.push_back(unpackBlock(key));
+    return blocks;
+}
+
+bool
+BlockStore::get(int level, glm::ivec3 block, std::vector<unsigned char> *data)
+{
+    PROFILE_SCOPE("BlockStore::get");
+    uint64_t key = packKey(level, block);
+    DiskBlock disk_block;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto host_it = _host.find(key);
+        if (host_it != _host.end()) {
+            *data = *host_it->second.data;
+            return true;
+        }
+
+        auto spill_it = _spilling.find(key);
+        if (spill_it != _spilling.end()) {
+            *data = *spill_it->second;
+            return true;
+        }
+
+        auto disk_it = _disk.find(key);
+        if (disk_it == _disk.end())
+            return false;
+        disk_block = disk_it->second;
+    }
+
+    return readFromDisk(disk_block, data);
+}
+
+void
+BlockStore::prefetch(int level, glm::ivec3 block)
+{
+    uint64_t key = packKey(level, block);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto disk_it = _disk.find(key);
+        if (disk_it == _disk.end() || _loading.count(key))
+            return;
+        // Don't evict other blocks just to make room for a prefetch
+        if (_host_bytes + disk_it->second.size > _memory_budget)
+            return;
+        _loading.insert(key);
+        _jobs.push_back({LOAD, key});
+    }
+    _cond.notify_one();
+}
+
+void
+BlockStore::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _jobs.clear();
+    _host.clear();
+    _lru.clear();
+    _host_bytes = 0;
+    _spilling.clear();
+    _loading.clear();
+    _disk.clear();
+    _disk_bytes = 0;
+
+    std::lock_guard<std::mutex> file_lock(_file_mutex);
+    _file.close();
+    _file.open(_path, std::ios::in | std::ios::out |
+                      std::ios::binary | std::ios::trunc);
+    _file_size = 0;
+}
+
+void
+BlockStore::setMemoryBudget(size_t memory_budget)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _memory_budget = memory_budget;
+        enforceBudget();
+    }
+    _cond.notify_one();
+}
+
+size_t
+BlockStore::getMemoryBudget() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _memory_budget;
+}
+
+BlockStore::Stats
+BlockStore::getStats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Stats stats;
+    stats.host_blocks = _host.size() + _spilling.size();
+    stats.host_bytes = _host_bytes;
+    for (const auto &spilling : _spilling)
+        stats.host_bytes += spilling.second->size();
+    stats.disk_blocks = _disk.size();
+    stats.disk_bytes = _disk_bytes;
+    return stats;
+}
+
+void
+BlockStore::workerLoop()
+{
+    Profiler::setThreadName("Block store");
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _quit || !_jobs.empty(); });
+            if (_quit)
+                return;
+            job = _jobs.front();
+            _jobs.pop_front();
+        }
+
+        switch (job.type) {
+        case SPILL: spill(job.key); break;
+        case LOAD:  load(job.key);  break;
+        }
+    }
+}
+
+void
+BlockStore::spill(uint64_t key)
+{
+    PROFILE_SCOPE("BlockStore::spill");
+    BlockData data;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _spilling.find(key);
+        if (it == _spilling.end())
+            return;
+        data = it->second;
+    }
+
+    uint32_t compressed_size = 0;
+    uint64_t offset = writeToDisk(*data, &compressed_size);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _spilling.find(key);
+    // The block was taken back or replaced while we were writing it
+    if (it == _spilling.end() || it->second != data)
+        return;
+    _spilling.erase(it);
+    if (compressed_size == 0) {
+        // Keep the block over the budget rather than lose it. It's spilled
+        // again once it's the least recently used one.
+        insertHost(key, std::move(data));
+        return;
+    }
+    _disk[key] = {offset, compressed_size, uint32_t(data->size())};
+    _disk_bytes += compressed_size;
+}
+
+void
+BlockStore::load(uint64_t key)
+{
+    PROFILE_SCOPE("BlockStore::load");
+    DiskBlock disk_block;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _disk.find(key);
+        if (it == _disk.end()) {
+            _loading.erase(key);
+            return;
+        }
+        disk_block = it->second;
+    }
+
+    auto data = std::make_shared<std::vector<unsigned char>>();
+    bool ok = readFromDisk(disk_block, data.get());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _loading.erase(key);
+    auto it = _disk.find(key);
+    if (!ok || it == _disk.end() || it->second.offset != disk_block.offset)
+        return;
+    _disk_bytes -= disk_block.compressed_size;
+    _disk.erase(it);
+    insertHost(key, std::move(data));
+}
+
+// Must be called with _mutex locked
+void
+BlockStore::enforceBudget()
+{
+    while (_host_bytes > _memory_budget && !_lru.empty()) {
+        uint64_t key = _lru.front();
+        auto it = _host.find(key);
+        _spilling[key] = it->second.data;
+        eraseHost(it);
+        _jobs.push_back({SPILL, key});
+    }
+}
+
+// Add a block as the most recently used one. Must be called with _mutex
+// locked.
+void
+BlockStore::insertHost(uint64_t key, BlockData data)
+{
+    _host_bytes += data->size();
+    HostBlock host_block;
+    host_block.data = std::move(data);
+    host_block.lru = _lru.insert(_lru.end(), key);
+    _host.emplace(key, std::move(host_block));
+}
+
+// Must be called with _mutex locked
+void
+BlockStore::eraseHost(std::unordered_map<uint64_t, HostBlock>::iterator it)
+{
+    _host_bytes -= it->second.data->size();
+    _lru.erase(it->second.lru);
+    _host.erase(it);
+}
+
+uint64_t
+BlockStore::writeToDisk(const std::vector<unsigned char> &data,
+                        uint32_t *compressed_size)
+{
+    uLongf size = compressBound(data.size());
+    std::vector<unsigned char> compressed(size);
+    if (compress2(compressed.data(), &size,
+                  data.data(), data.size(), Z_BEST_SPEED) != Z_OK) {
+        std::cerr << "Failed to compress voxel block, keeping it in memory"
+                  << std::endl;
+        *compressed_size = 0;
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    uint64_t offset = _file_size;
+    _file.seekp(offset);
+    _file.write(reinterpret_cast<const char *>(compressed.data()), size);
+    if (!_file) {
+        std::cerr << "Failed to write voxel block to '" << _path
+                  << "', keeping it in memory" << std::endl;
+        _file.clear();
+        *compressed_size = 0;
+        return 0;
+    }
+    _file_size += size;
+    *compressed_size = uint32_t(size);
+    return offset;
+}
+
+bool
+BlockStore::readFromDisk(const DiskBlock &block,
+                         std::vector<unsigned char> *data)
+{
+    std::vector<unsigned char> compressed(block.compressed_size);
+    {
+        std::lock_guard<std::mutex> lock(_file_mutex);
+        _file.seekg(block.offset);
+        _file.read(reinterpret_cast<char *>(compressed.data()),
+                   block.compressed_size);
+        if (!_file) {
+            std::cerr << "Failed to read voxel block from '" << _path << "'"
+                      << std::endl;
+            _file.clear();
+            return false;
+        }
+    }
+
+    data->resize(block.size);
+    uLongf size = block.size;
+    if (uncompress(data->data(), &size,
+                   compressed.data(), block.compressed_size) != Z_OK ||
+        size != block.size) {
+        std::cerr << "Failed to decompress voxel block" << std::endl;
+        return false;
+    }
+    return true;
+}
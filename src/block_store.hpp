@@ -0,0 +1,107 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Host side storage for voxel blocks that have been evicted from the GPU.
+// Blocks are kept in RAM until the memory budget is exceeded, then the least
+// recently used ones are compressed and appended to a file on disk by a
+// background thread. A block that fails to be written stays in RAM. Blocks
+// on disk can be prefetched back into RAM before they are needed.
+class BlockStore {
+public:
+    struct Stats {
+        size_t host_blocks = 0;
+        size_t host_bytes  = 0;
+        size_t disk_blocks = 0;
+        size_t disk_bytes  = 0;
+    };
+
+    BlockStore(const std::string &path, size_t memory_budget);
+    ~BlockStore();
+
+    // Blocks are identified by their volume level and block coordinates
+    void put(int level, glm::ivec3 block, std::vector<unsigned char> &&data);
+    bool take(int level, glm::ivec3 block, std::vector<unsigned char> *data);
+    // Copy a block, leaving it in the store
+    bool get(int level, glm::ivec3 block, std::vector<unsigned char> *data);
+    void prefetch(int level, glm::ivec3 block);
+    // Every block of a level currently in the store
+    std::vector<glm::ivec3> list(int level) const;
+    void clear();
+
+    void setMemoryBudget(size_t memory_budget);
+    size_t getMemoryBudget() const;
+
+    Stats getStats() const;
+private:
+    typedef std::shared_ptr<std::vector<unsigned char>> BlockData;
+
+    struct HostBlock {
+        BlockData data;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    struct DiskBlock {
+        uint64_t offset;
+        uint32_t compressed_size;
+        uint32_t size;
+    };
+
+    enum JobType {
+        SPILL,
+        LOAD
+    };
+
+    struct Job {
+        JobType  type;
+        uint64_t key;
+    };
+
+    void workerLoop();
+    void spill(uint64_t key);
+    void load(uint64_t key);
+    void enforceBudget();
+    void insertHost(uint64_t key, BlockData data);
+    void eraseHost(std::unordered_map<uint64_t, HostBlock>::iterator it);
+
+    uint64_t writeToDisk(const std::vector<unsigned char> &data,
+                         uint32_t *compressed_size);
+    bool readFromDisk(const DiskBlock &block, std::vector<unsigned char> *data);
+
+    std::string _path;
+    size_t      _memory_budget;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Job> _jobs;
+    bool _quit = false;
+    std::thread _worker;
+
+    // Blocks resident in RAM, ordered from least to most recently used
+    std::unordered_map<uint64_t, HostBlock> _host;
+    std::list<uint64_t> _lru;
+    size_t _host_bytes = 0;
+    // Blocks waiting to be written to disk. They still count as resident.
+    std::unordered_map<uint64_t, BlockData> _spilling;
+    // Blocks being prefetched from disk
+    std::unordered_set<uint64_t> _loading;
+    std::unordered_map<uint64_t, DiskBlock> _disk;
+    size_t _disk_bytes = 0;
+
+    std::mutex _file_mutex;
+    std::fstream _file;
+    uint64_t _file_size = 0;
+};
@@ -0,0 +1,516 @@
+#include "checkpoint_log.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <zlib.h>
+
+#include "block_store.hpp"
+#include "profiler.hpp"
+#include "volume.hpp"
+#include "volume_readback.hpp"
+
+// Blocks read back by a single readback, 16 MB of pixel buffer
+const int    CHECKPOINT_CHUNK_BLOCKS = 64;
+// Logs smaller than this are never compacted
+const size_t COMPACTION_MIN_BYTES    = size_t(64) << 20;
+// Blocks decompressed and uploaded at once by restore()
+const int    RESTORE_BATCH_BLOCKS    = 256;
+
+const size_t BLOCK_BYTES = size_t(BLOCK_SIZE) * BLOCK_SIZE * BLOCK_SIZE * 8;
+
+
+// Whether any voxel of a raw block has been observed, see Volume::readBlock()
+static bool
+blockObserved(Volume::VoxelFormat format, const unsigned char *data)
+{
+    const size_t voxels = BLOCK_BYTES / 8;
+    if (format == Volume::PACKED_VOXELS) {
+        // The weight lives in the high half of the first word
+        const unsigned int *texels =
+            reinterpret_cast<const unsigned int *>(data);
+        for (size_t i = 0; i < voxels; ++i)
+            if (texels[i * 2] >> 16)
+                return true;
+        return false;
+    }
+    const unsigned short *weights =
+        reinterpret_cast<const unsigned short *>(data + voxels * 6);
+    return std::any_of(weights, weights + voxels,
+                       [](unsigned short w) { return w != 0; });
+}
+
+
+CheckpointLog::CheckpointLog(const std::string &path, Volume *volume,
+                             VolumeReadback *readback, bool append) :
+    _path(path),
+    _volume(volume),
+    _readback(readback),
+    _reset_count(volume->getResetCount())
+{
+    if (append && scan())
+        return;
+    truncate();
+}
+
+CheckpointLog::~CheckpointLog()
+{
+    // The pending readbacks call back into the log
+    finish();
+}
+
+bool
+CheckpointLog::checkpoint()
+{
+    PROFILE_SCOPE("CheckpointLog::checkpoint");
+    if (_in_progress)
+        return false;
+    bool reset = _volume->getResetCount() != _reset_count;
+    _reset_count = _volume->getResetCount();
+
+    // Readbacks without regions only order the work on the readback thread
+    if (reset) {
+        _readback->startRegions(nullptr, nullptr, 0, 0,
+            [this](const VolumeReadback::Result &) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                truncate();
+            });
+    }
+
+    // The flags of a level that can't be read back now stay set for the
+    // next checkpoint. The callbacks only run after the next poll(), once
+    // every level has been counted.
+    int reset_count = _reset_count;
+    auto callback = [this, reset_count](const VolumeReadback::Result &result) {
+        std::lock_guard<std::mutex> lock(_chunks_mutex);
+        for (size_t i = 0; i < result.blocks.size(); ++i) {
+            if (i % CHECKPOINT_CHUNK_BLOCKS == 0)
+                _chunks.push_back({result.level, reset_count, {}});
+            _chunks.back().blocks.push_back(result.blocks[i]);
+        }
+        --_pending_levels;
+    };
+    for (int level = 0; level < _volume->getLevels(); ++level) {
+        if (_readback->startModifiedBlocks(level, callback)) {
+            std::lock_guard<std::mutex> lock(_chunks_mutex);
+            ++_pending_levels;
+        }
+    }
+    _in_progress = true;
+    update();
+    return true;
+}
+
+void
+CheckpointLog::update()
+{
+    if (!_in_progress)
+        return;
+    PROFILE_SCOPE("CheckpointLog::update");
+    {
+        std::lock_guard<std::mutex> lock(_chunks_mutex);
+        while (!_chunks.empty()) {
+            // Blocks taken before a reset are gone, the next checkpoint
+            // starts the log over
+            const Chunk &chunk = _chunks.front();
+            if (chunk.reset_count == _volume->getResetCount() &&
+                !startChunk(chunk)) {
+                // Wait for the pending readbacks to free their buffers,
+                // unless there are none
+                if (_readback->getPending() > 0)
+                    return;
+                std::cerr << "Failed to checkpoint " << chunk.blocks.size()
+                          << " blocks to '" << _path << "'" << std::endl;
+            }
+            _chunks.pop_front();
+        }
+        if (_pending_levels > 0)
+            return;
+    }
+
+    _readback->startRegions(nullptr, nullptr, 0, 0,
+        [this](const VolumeReadback::Result &) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _file.flush();
+            ++_stats.checkpoints;
+            if (_file_size > COMPACTION_MIN_BYTES &&
+                _file_size > _compaction_ratio * _stats.live_bytes)
+                compact();
+            publishStats();
+        });
+    _in_progress = false;
+}
+
+// Queue the readback of a chunk, false if it doesn't fit in the memory
+// budget right now
+bool
+CheckpointLog::startChunk(const Chunk &chunk)
+{
+    // Blocks that left the volume since their flags were taken are copied
+    // from the block store. Checked only now, the volume may have rolled
+    // while the chunk was waiting.
+    std::vector<glm::ivec3> blocks;
+    std::shared_ptr<std::vector<Block>> host_blocks(new std::vector<Block>);
+    for (const glm::ivec3 &block : chunk.blocks) {
+        if (_volume->containsBlock(chunk.level, block))
+            blocks.push_back(block);
+        else
+            host_blocks->push_back({chunk.level, block, {}});
+    }
+
+    auto callback = [this, host_blocks](const VolumeReadback::Result &result) {
+        for (const Block &block : *host_blocks)
+            append(block.level, block.block, result.format,
+                   block.data.empty() ? nullptr : block.data.data());
+        for (const VolumeReadback::Region &region : result.regions)
+            append(result.level, region.first / BLOCK_SIZE,
+                   result.format, region.data);
+    };
+    if (!_readback->startBlocks(blocks, chunk.level, callback))
+        return false;
+
+    // The callback only runs after the next VolumeReadback::poll(), so the
+    // host blocks are only copied once the chunk has been accepted
+    BlockStore *block_store = _volume->getBlockStore();
+    if (block_store)
+        for (Block &block : *host_blocks)
+            block_store->get(block.level, block.block, &block.data);
+    return true;
+}
+
+// Wait until the checkpoint in progress is in the file
+void
+CheckpointLog::finish()
+{
+    while (_in_progress) {
+        _readback->finish();
+        update();
+    }
+    _readback->finish();
+}
+
+size_t
+CheckpointLog::restore(int threads)
+{
+    PROFILE_SCOPE("CheckpointLog::restore");
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Every pending checkpoint must be in the file first
+    finish();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _volume->reset();
+    _reset_count = _volume->getResetCount();
+
+    // Read the file in order
+    std::vector<const Entry *> entries;
+    for (const auto &it : _index)
+        if (it.second.record.size != 0 &&
+            it.second.record.level < _volume->getLevels())
+            entries.push_back(&it.second);
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry *a, const Entry *b) {
+                  return a->offset < b->offset;
+              });
+
+    BlockStore *block_store = _volume->getBlockStore();
+    std::vector<std::vector<unsigned char>> compressed(RESTORE_BATCH_BLOCKS);
+    std::vector<std::vector<unsigned char>> data(RESTORE_BATCH_BLOCKS);
+    size_t loaded = 0;
+    for (size_t first = 0; first < entries.size();
+         first += RESTORE_BATCH_BLOCKS) {
+        int count = int(std::min(entries.size() - first,
+                                 size_t(RESTORE_BATCH_BLOCKS)));
+        for (int i = 0; i < count; ++i) {
+            const Entry &entry = *entries[first + i];
+            compressed[i].resize(entry.record.compressed_size);
+            _file.seekg(entry.offset + sizeof(CheckpointRecord));
+            _file.read(reinterpret_cast<char *>(compressed[i].data()),
+                       compressed[i].size());
+        }
+        if (!_file) {
+            std::cerr << "Failed to read checkpoint log '" << _path << "'"
+                      << std::endl;
+            _file.clear();
+            break;
+        }
+
+        // Decompression is the bulk of the work
+        std::vector<char> valid(count);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&, t] {
+                for (int i = t; i < count; i += threads) {
+                    const CheckpointRecord &r = entries[first + i]->record;
+                    uLong checksum = adler32(adler32(0, Z_NULL, 0),
+                                             compressed[i].data(),
+                                             r.compressed_size);
+                    data[i].resize(r.size);
+                    uLongf size = r.size;
+                    valid[i] = checksum == r.checksum &&
+                               uncompress(data[i].data(), &size,
+                                          compressed[i].data(),
+                                          r.compressed_size) == Z_OK &&
+                               size == r.size;
+                }
+            });
+        for (std::thread &worker : workers)
+            worker.join();
+
+        for (int level = 0; level < _volume->getLevels(); ++level) {
+            std::vector<glm::ivec3> blocks;
+            std::vector<std::vector<unsigned char>> level_data;
+            for (int i = 0; i < count; ++i) {
+                const CheckpointRecord &r = entries[first + i]->record;
+                if (r.level != level)
+                    continue;
+                if (!valid[i]) {
+                    std::cerr << "Corrupt block in checkpoint log '" << _path
+                              << "'" << std::endl;
+                    continue;
+                }
+                glm::ivec3 block(r.block[0], r.block[1], r.block[2]);
+                if (_volume->containsBlock(level, block)) {
+                    blocks.push_back(block);
+                    level_data.push_back(std::move(data[i]));
+                } else if (block_store) {
+                    block_store->put(level, block, std::move(data[i]));
+                } else {
+                    continue;
+                }
+                ++loaded;
+            }
+            if (!blocks.empty())
+                _volume->uploadBlocks(level, blocks, level_data);
+        }
+    }
+    return loaded;
+}
+
+CheckpointLog::Stats
+CheckpointLog::getStats() const
+{
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    return _published_stats;
+}
+
+// Called with the mutex held, or before the readback thread can see the log
+void
+CheckpointLog::publishStats()
+{
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _published_stats = _stats;
+}
+
+// Open an existing log and index its records. Only the record headers are
+// read, a record cut short by a crash ends the log and is overwritten by the
+// next append. Corrupt data is caught when restoring.
+bool
+CheckpointLog::scan()
+{
+    PROFILE_SCOPE("CheckpointLog::scan");
+    _file.open(_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!_file)
+        return false;
+    _file.seekg(0, std::ios::end);
+    uint64_t file_length = uint64_t(_file.tellg());
+    _file.seekg(0);
+
+    CheckpointHeader header;
+    _file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!_file || header.magic != CHECKPOINT_MAGIC ||
+        header.version != CHECKPOINT_VERSION ||
+        header.format != _volume->getVoxelFormat() ||
+        header.block_size != uint32_t(BLOCK_SIZE)) {
+        std::cerr << "'" << _path << "' is not a checkpoint log of this "
+                  << "volume, starting a new one" << std::endl;
+        _file.close();
+        return false;
+    }
+
+    uint64_t offset = sizeof(header);
+    for (;;) {
+        CheckpointRecord record;
+        _file.seekg(offset);
+        _file.read(reinterpret_cast<char *>(&record), sizeof(record));
+        if (!_file || record.magic != CHECKPOINT_RECORD_MAGIC)
+            break;
+        uint64_t end = offset + sizeof(record) + record.compressed_size;
+        if (end > file_length)
+            break;
+        addEntry(offset, record);
+        offset = end;
+    }
+    _file.clear();
+    _file_size = offset;
+    _stats.file_bytes = _file_size;
+    publishStats();
+    return true;
+}
+
+// Start an empty log. Called with the mutex held, or before the readback
+// thread can see the log.
+void
+CheckpointLog::truncate()
+{
+    _file.close();
+    _file.clear();
+    _file.open(_path, std::ios::in | std::ios::out |
+                      std::ios::binary | std::ios::trunc);
+    if (!_file)
+        throw std::runtime_error("Failed to create checkpoint log '" +
+                                 _path + "'");
+
+    CheckpointHeader header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION,
+                               uint16_t(_volume->getVoxelFormat()),
+                               uint32_t(BLOCK_SIZE)};
+    _file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    _file.flush();
+    _file_size = sizeof(header);
+    _index.clear();
+    _stats.blocks = 0;
+    _stats.live_bytes = 0;
+    _stats.file_bytes = _file_size;
+    publishStats();
+}
+
+// Compress and write a block, without data for blocks with no observed
+// voxels. Runs on the readback thread.
+void
+CheckpointLog::append(int level, glm::ivec3 block, Volume::VoxelFormat format,
+                      const unsigned char *data)
+{
+    PROFILE_SCOPE("CheckpointLog::append");
+    CheckpointRecord record = {};
+    record.magic = CHECKPOINT_RECORD_MAGIC;
+    record.level = level;
+    record.block[0] = block.x;
+    record.block[1] = block.y;
+    record.block[2] = block.z;
+
+    std::vector<unsigned char> compressed;
+    if (data && blockObserved(format, data)) {
+        uLongf size = compressBound(BLOCK_BYTES);
+        compressed.resize(size);
+        if (compress2(compressed.data(), &size, data, BLOCK_BYTES,
+                      Z_BEST_SPEED) != Z_OK) {
+            std::cerr << "Failed to compress voxel block" << std::endl;
+            return;
+        }
+        compressed.resize(size);
+        record.size = uint32_t(BLOCK_BYTES);
+    }
+    record.compressed_size = uint32_t(compressed.size());
+    record.checksum = uint32_t(adler32(adler32(0, Z_NULL, 0),
+                                       compressed.data(),
+                                       uInt(compressed.size())));
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file.seekp(_file_size);
+    _file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    _file.write(reinterpret_cast<const char *>(compressed.data()),
+                compressed.size());
+    if (!_file) {
+        std::cerr << "Failed to write checkpoint log '" << _path << "'"
+                  << std::endl;
+        _file.clear();
+        return;
+    }
+    addEntry(_file_size, record);
+    _file_size += sizeof(record) + compressed.size();
+    _stats.file_bytes = _file_size;
+    publishStats();
+}
+
+void
+CheckpointLog::addEntry(uint64_t offset, const CheckpointRecord &record)
+{
+    BlockKey key(record.level, record.block[0], record.block[1],
+                 record.block[2]);
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        _stats.live_bytes -= sizeof(CheckpointRecord) +
+                             it->second.record.compressed_size;
+        if (it->second.record.size != 0)
+            --_stats.blocks;
+    }
+    _index[key] = {offset, record};
+    _stats.live_bytes += sizeof(CheckpointRecord) + record.compressed_size;
+    if (record.size != 0)
+        ++_stats.blocks;
+}
+
+// Rewrite the log with the last record of every block with observed voxels.
+// The new log replaces the old one only once it's complete. Called with the
+// mutex held.
+void
+CheckpointLog::compact()
+{
+    PROFILE_SCOPE("CheckpointLog::compact");
+    std::vector<const Entry *> entries;
+    for (const auto &it : _index)
+        if (it.second.record.size != 0)
+            entries.push_back(&it.second);
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry *a, const Entry *b) {
+                  return a->offset < b->offset;
+              });
+
+    std::string tmp_path = _path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    CheckpointHeader header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION,
+                               uint16_t(_volume->getVoxelFormat()),
+                               uint32_t(BLOCK_SIZE)};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    // Records are copied as they are, without recompressing them
+    std::vector<Entry> compacted;
+    std::vector<char> buffer;
+    uint64_t offset = sizeof(header);
+    for (const Entry *entry : entries) {
+        size_t size = sizeof(CheckpointRecord) + entry->record.compressed_size;
+        buffer.resize(size);
+        _file.seekg(entry->offset);
+        _file.read(buffer.data(), size);
+        out.write(buffer.data(), size);
+        compacted.push_back({offset, entry->record});
+        offset += size;
+    }
+    out.close();
+    if (!_file || !out) {
+        std::cerr << "Failed to compact checkpoint log '" << _path << "'"
+                  << std::endl;
+        _file.clear();
+        std::remove(tmp_path.c_str());
+        return;
+    }
+
+    _file.close();
+    bool replaced = std::rename(tmp_path.c_str(), _path.c_str()) == 0;
+    if (!replaced) {
+        std::cerr << "Failed to replace checkpoint log '" << _path << "'"
+                  << std::endl;
+        std::remove(tmp_path.c_str());
+    }
+    _file.open(_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!_file)
+        throw std::runtime_error("Failed to reopen checkpoint log '" +
+                                 _path + "'");
+    // Otherwise the old log and its index are still valid
+    if (!replaced)
+        return;
+
+    _index.clear();
+    _stats.blocks = 0;
+    _stats.live_bytes = 0;
+    for (const Entry &entry : compacted)
+        addEntry(entry.offset, entry.record);
+    _file_size = offset;
+    _stats.file_bytes = _file_size;
+    ++_stats.compactions;
+    publishStats();
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "volume.hpp"
+
+class VolumeReadback;
+
+const uint32_t CHECKPOINT_MAGIC        = 0x434D4653; // "SFMC"
+const uint16_t CHECKPOINT_VERSION      = 1;
+const uint32_t CHECKPOINT_RECORD_MAGIC = 0x4B4C4253; // "SBLK"
+
+#pragma pack(push, 1)
+struct CheckpointHeader {
+    uint32_t magic;
+    uint16_t version;
+    // Volume::VoxelFormat of the blocks
+    uint16_t format;
+    uint32_t block_size;
+};
+
+// Followed by 'compressed_size' bytes of zlib compressed block data
+struct CheckpointRecord {
+    uint32_t magic;
+    int32_t  level;
+    int32_t  block[3];
+    // Raw block size, 0 for a block without observed voxels
+    uint32_t size;
+    uint32_t compressed_size;
+    // adler32 of the compressed data, so a record cut short by a crash is
+    // told apart from a complete one
+    uint32_t checksum;
+};
+#pragma pack(pop)
+
+// Append-only log of the blocks of a volume, so a long capture can be
+// recovered after a crash. Every checkpoint() appends the blocks modified
+// since the previous one, read back asynchronously, compressed and written
+// by the readback thread. The main thread never waits for the GPU or the
+// file: the modified flags are read back like the blocks, and the chunks of
+// blocks that don't fit in the readback memory budget wait for the next
+// update(). A block may appear many times, the last record wins. Once the
+// records of overwritten blocks take too much of the file it is compacted to
+// the last record of every block.
+//
+// A reset of the volume starts the log over.
+class CheckpointLog {
+public:
+    struct Stats {
+        int    checkpoints = 0;
+        int    compactions = 0;
+        // Blocks in the log, not counting the ones without observed voxels
+        size_t blocks = 0;
+        size_t file_bytes = 0;
+        // Bytes of the last record of every block
+        size_t live_bytes = 0;
+    };
+
+    // Without 'append' the log starts empty, otherwise the records of an
+    // existing log are kept, e.g. to continue after restore(). Both the
+    // volume and the readback must outlive the log.
+    CheckpointLog(const std::string &path, Volume *volume,
+                  VolumeReadback *readback, bool append = false);
+    // Writes the pending checkpoints first
+    ~CheckpointLog();
+
+    CheckpointLog(const CheckpointLog &) = delete;
+    CheckpointLog &operator=(const CheckpointLog &) = delete;
+
+    // Start a checkpoint of the blocks of every level modified since the
+    // previous one. Returns false if the previous checkpoint is still in
+    // progress, the blocks are then left for the next one.
+    bool checkpoint();
+    // Issue the readbacks of the checkpoint in progress that fit in the
+    // readback memory budget. Call once per frame.
+    void update();
+    // Reset the volume and load the last record of every block. The blocks
+    // outside of the volume go to its block store, or are dropped without
+    // one. Returns the number of blocks loaded.
+    size_t restore(int threads = 0);
+
+    // Compact once the file is this many times larger than its live records
+    void setCompactionRatio(float ratio) { _compaction_ratio = ratio; }
+    float getCompactionRatio() const { return _compaction_ratio; }
+
+    const std::string &getPath() const { return _path; }
+    Stats getStats() const;
+private:
+    typedef std::tuple<int, int, int, int> BlockKey;
+
+    struct Entry {
+        uint64_t offset;
+        CheckpointRecord record;
+    };
+
+    // Block copied from the block store, empty if it had no observed voxels
+    struct Block {
+        int        level;
+        glm::ivec3 block;
+        std::vector<unsigned char> data;
+    };
+
+    // Modified blocks of a level read back together
+    struct Chunk {
+        int        level;
+        // Reset count of the volume when the blocks were taken
+        int        reset_count;
+        std::vector<glm::ivec3> blocks;
+    };
+
+    bool startChunk(const Chunk &chunk);
+    void finish();
+    void publishStats();
+    bool scan();
+    void truncate();
+    void append(int level, glm::ivec3 block, Volume::VoxelFormat format,
+                const unsigned char *data);
+    void addEntry(uint64_t offset, const CheckpointRecord &record);
+    void compact();
+
+    std::string     _path;
+    Volume         *_volume;
+    VolumeReadback *_readback;
+    float           _compaction_ratio = 2.0f;
+    int             _reset_count;
+    bool            _in_progress = false;
+
+    // Chunks of the checkpoint in progress, added by the readback thread as
+    // the modified flags of every level arrive
+    std::mutex      _chunks_mutex;
+    std::deque<Chunk> _chunks;
+    int             _pending_levels = 0;
+
+    // The file and everything below are used by the readback thread
+    std::mutex      _mutex;
+    std::fstream    _file;
+    uint64_t        _file_size = 0;
+    std::map<BlockKey, Entry> _index;
+    Stats           _stats;
+
+    // Copy of the stats for getStats(), which must not wait for compaction
+    mutable std::mutex _stats_mutex;
+    Stats           _published_stats;
+};
@@ -0,0 +1,204 @@
+#include "dataset_source.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "depth_codec.hpp"
+#include "profiler.hpp"
+#include "scannet_source.hpp"
+#include "stb_image.h"
+#include "tum_source.hpp"
+
+
+static bool
+fileExists(const std::string &filename)
+{
+    return std::ifstream(filename).good();
+}
+
+// Depth images store the sensor units, converted here to millimeters
+static void
+scaleDepth(float depth_scale, std::vector<unsigned short> *depth)
+{
+    if (depth_scale == 1.0f)
+        return;
+    for (unsigned short &d : *depth)
+        d = (unsigned short)std::min(std::lround(d * depth_scale), 65535L);
+}
+
+bool
+loadDepthImage(const std::string &filename, glm::uvec2 frame_size,
+               float depth_scale, std::vector<unsigned short> *depth)
+{
+    int width = 0, height = 0, channels = 0;
+    unsigned short *data = stbi_load_16(
+        filename.c_str(), &width, &height, &channels, 0);
+    if (!data) {
+        std::cerr << "Failed to read depth image from file '"
+                  << filename << "'. Skipping frame..." << std::endl;
+        return false;
+    }
+    if (width != int(frame_size.x) || height != int(frame_size.y)) {
+        std::cerr << "Depth image '" << filename << "' has size "
+                  << width << "x" << height
+                  << " but expected "
+                  << frame_size.x << "x" << frame_size.y
+                  << ". Skipping frame... " << std::endl;
+        stbi_image_free(data);
+        return false;
+    }
+    if (channels != 1) {
+        std::cerr << "Depth image '" << filename << "' has "
+                  << channels << " channel(s) but expected 1. Skipping frame..."
+                  << std::endl;
+        stbi_image_free(data);
+        return false;
+    }
+    depth->assign(data, data + width * height);
+    stbi_image_free(data);
+    scaleDepth(depth_scale, depth);
+    return true;
+}
+
+bool
+loadDepth(const std::string &png_filename, glm::uvec2 frame_size,
+          float depth_scale, std::vector<unsigned short> *depth,
+          std::vector<unsigned char> *buffer)
+{
+    const std::string png = ".png";
+    int width = 0, height = 0;
+    if (png_filename.size() < png.size() ||
+        png_filename.compare(png_filename.size() - png.size(), png.size(),
+                             png) != 0)
+        return loadDepthImage(png_filename, frame_size, depth_scale, depth);
+    std::string sfmd_filename =
+        png_filename.substr(0, png_filename.size() - png.size()) + ".sfmd";
+    if (!readDepthFile(sfmd_filename, &width, &height, depth, buffer))
+        return loadDepthImage(png_filename, frame_size, depth_scale, depth);
+
+    if (width != int(frame_size.x) || height != int(frame_size.y)) {
+        std::cerr << "Depth image '" << sfmd_filename << "' has size "
+                  << width << "x" << height
+                  << " but expected "
+                  << frame_size.x << "x" << frame_size.y
+                  << ". Skipping frame... " << std::endl;
+        return false;
+    }
+    scaleDepth(depth_scale, depth);
+    return true;
+}
+
+bool
+loadColorImage(const std::string &filename, glm::uvec2 frame_size,
+               std::vector<unsigned char> *color)
+{
+    int width = 0, height = 0, channels = 0;
+    unsigned char *data = stbi_load(
+        filename.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        std::cerr << "Failed to read color image from file '"
+                  << filename << "'. Skipping frame..." << std::endl;
+        return false;
+    }
+
+    color->resize(size_t(frame_size.x) * frame_size.y * 3);
+    if (width == int(frame_size.x) && height == int(frame_size.y)) {
+        std::copy(data, data + width * height * 3, color->begin());
+    } else {
+        // Some datasets capture color at a higher resolution than depth,
+        // nearest neighbor is enough to color the surface
+        for (unsigned y = 0; y < frame_size.y; ++y) {
+            unsigned sy = y * height / frame_size.y;
+            for (unsigned x = 0; x < frame_size.x; ++x) {
+                unsigned sx = x * width / frame_size.x;
+                const unsigned char *src = data + (sy * width + sx) * 3;
+                unsigned char *dst = color->data() +
+                                     (y * frame_size.x + x) * 3;
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+            }
+        }
+    }
+    stbi_image_free(data);
+    return true;
+}
+
+FrameSource *
+openDataset(const std::string &dir, glm::uvec2 frame_size, int frame_count)
+{
+    if (fileExists(dir + "/depth.txt")) {
+        std::cout << "Reading TUM RGB-D sequence '" << dir << "'" << std::endl;
+        return new TumFrameSource(dir, frame_size, TumFrameSource::TUM);
+    }
+    if (fileExists(dir + "/associations.txt")) {
+        std::cout << "Reading ICL-NUIM sequence '" << dir << "'" << std::endl;
+        return new TumFrameSource(dir, frame_size, TumFrameSource::ICL_NUIM);
+    }
+    if (fileExists(dir + "/intrinsic/intrinsic_depth.txt")) {
+        std::cout << "Reading ScanNet scene '" << dir << "'" << std::endl;
+        return new ScanNetFrameSource(dir, frame_size);
+    }
+    return new DatasetFrameSource(dir, frame_size, frame_count);
+}
+
+DatasetFrameSource::DatasetFrameSource(const std::string &dir,
+                                       glm::uvec2 frame_size,
+                                       int frame_count) :
+    _dir(dir),
+    _frame_size(frame_size),
+    _frame_count(frame_count)
+{
+}
+
+bool
+DatasetFrameSource::read(Frame *frame)
+{
+    // Frames that fail to load are skipped
+    while (_next < _frame_count) {
+        if (load(_next++, frame))
+            return true;
+    }
+    return false;
+}
+
+bool
+DatasetFrameSource::load(int n, Frame *frame) const
+{
+    PROFILE_SCOPE("DatasetFrameSource::load");
+    std::string base_filename(_dir + "/frame-");
+    char frame_number[7];
+    std::snprintf(frame_number, sizeof(frame_number), "%06d", n);
+    base_filename += frame_number;
+
+    if (!loadDepth(base_filename + ".depth.png", _frame_size, 1.0f,
+                   &frame->depth, &_depth_buffer))
+        return false;
+
+    if (!loadColorImage(base_filename + ".color.png", _frame_size,
+                        &frame->color))
+        return false;
+
+    std::string pose_filename(base_filename + ".pose.txt");
+    std::ifstream pose_ifs(pose_filename);
+    if (!pose_ifs) {
+        std::cerr << "Failed to read pose matrix from file '"
+                  << pose_filename << "'. Skipping frame..." << std::endl;
+        return false;
+    }
+    float pose_floats[16];
+    for (int i = 0; i < 16; ++i)
+        pose_ifs >> pose_floats[i];
+    // Transpose because glm uses column major ordering
+    glm::mat4 pose_matrix = glm::transpose(glm::make_mat4(pose_floats));
+    // The extrinsic matrix is the inverse of the camera pose
+    frame->extrinsic = glm::inverse(pose_matrix);
+    frame->has_intrinsic = false;
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+
+// Frames stored in a directory as frame-XXXXXX.depth.png (16-bit
+// millimeters), frame-XXXXXX.color.png (RGB8) and frame-XXXXXX.pose.txt
+// (row major camera to world matrix). Depth is read with loadDepth(), so a
+// frame-XXXXXX.depth.sfmd file takes the place of the PNG when present.
+class DatasetFrameSource : public FrameSource {
+public:
+    DatasetFrameSource(const std::string &dir, glm::uvec2 frame_size,
+                       int frame_count);
+
+    bool read(Frame *frame) override;
+    void rewind() override { _next = 0; }
+    int position() const override { return _next; }
+    int size() const override { return _frame_count; }
+
+    // Load a given frame without moving the read position
+    bool load(int n, Frame *frame) const;
+private:
+    std::string _dir;
+    glm::uvec2  _frame_size;
+    int         _frame_count;
+    int         _next = 0;
+    // File contents of the last encoded depth image, kept to reuse the memory
+    mutable std::vector<unsigned char> _depth_buffer;
+};
+
+// Depth images are 16-bit, multiplied by 'depth_scale' to get millimeters.
+// Color images are resampled to 'frame_size' if needed.
+bool loadDepthImage(const std::string &filename, glm::uvec2 frame_size,
+                    float depth_scale, std::vector<unsigned short> *depth);
+// Same, but a file written by sfm_transcode next to the PNG, with .sfmd in
+// place of .png, is read instead when present since it decodes much faster.
+// 'buffer' holds its contents and can be reused between calls.
+bool loadDepth(const std::string &png_filename, glm::uvec2 frame_size,
+               float depth_scale, std::vector<unsigned short> *depth,
+               std::vector<unsigned char> *buffer);
+bool loadColorImage(const std::string &filename, glm::uvec2 frame_size,
+                    std::vector<unsigned char> *color);
+
+// Reader for the dataset directory 'dir', chosen from the files it contains.
+// TUM RGB-D, ICL-NUIM and ScanNet layouts are recognized, anything else is
+// read as a DatasetFrameSource of 'frame_count' frames.
+FrameSource *openDataset(const std::string &dir, glm::uvec2 frame_size,
+                         int frame_count);
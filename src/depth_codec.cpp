@@ -0,0 +1,248 @@
+#include "depth_codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "profiler.hpp"
+
+
+// Samples of a block per lane
+const int LANE_SAMPLES = DEPTH_CODEC_BLOCK / 8;
+
+static inline uint16_t
+zigzag(uint16_t delta)
+{
+    return uint16_t((delta << 1) ^ (int16_t(delta) >> 15));
+}
+
+static inline uint16_t
+unzigzag(uint16_t value)
+{
+    return uint16_t((value >> 1) ^ -(value & 1));
+}
+
+static int
+bitWidth(uint16_t value)
+{
+    int bits = 0;
+    while (value) {
+        ++bits;
+        value >>= 1;
+    }
+    return bits;
+}
+
+static void
+packBlock(const uint16_t *values, int bits, uint16_t *out)
+{
+    std::memset(out, 0, bits * 16);
+    for (int j = 0; j < 8; ++j) {
+        int offset = 0;
+        for (int i = 0; i < LANE_SAMPLES; ++i) {
+            uint32_t value = values[i * 8 + j];
+            int word = offset / 16;
+            int shift = offset % 16;
+            out[word * 8 + j] |= uint16_t(value << shift);
+            if (shift + bits > 16)
+                out[(word + 1) * 8 + j] |= uint16_t(value >> (16 - shift));
+            offset += bits;
+        }
+    }
+}
+
+void
+encodeDepth(const unsigned short *depth, int width, int height,
+            std::vector<unsigned char> *data)
+{
+    const size_t samples = size_t(width) * height;
+    const size_t blocks = (samples + DEPTH_CODEC_BLOCK - 1) / DEPTH_CODEC_BLOCK;
+
+    DepthCodecHeader header = {};
+    header.magic   = DEPTH_CODEC_MAGIC;
+    header.version = DEPTH_CODEC_VERSION;
+    header.width   = width;
+    header.height  = height;
+
+    data->resize(sizeof(header) + blocks);
+    std::memcpy(data->data(), &header, sizeof(header));
+
+    uint16_t values[DEPTH_CODEC_BLOCK];
+    uint16_t packed[DEPTH_CODEC_BLOCK];
+    uint16_t previous = 0;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint16_t all = 0;
+        for (int i = 0; i < DEPTH_CODEC_BLOCK; ++i) {
+            // The last block is padded by repeating the last sample
+            size_t n = std::min(b * DEPTH_CODEC_BLOCK + i, samples - 1);
+            values[i] = zigzag(uint16_t(depth[n] - previous));
+            previous = depth[n];
+            all |= values[i];
+        }
+        int bits = bitWidth(all);
+        (*data)[sizeof(header) + b] = (unsigned char)bits;
+        packBlock(values, bits, packed);
+        const unsigned char *bytes = (const unsigned char *)packed;
+        data->insert(data->end(), bytes, bytes + bits * 16);
+    }
+}
+
+#ifdef __SSE2__
+static inline const unsigned char *
+decodeBlock(const unsigned char *in, int bits, uint16_t *out,
+            __m128i *previous)
+{
+    const __m128i mask = _mm_set1_epi16(short((1 << bits) - 1));
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    if (bits == 0) {
+        // Constant block, a common case in invalid regions
+        for (int i = 0; i < LANE_SAMPLES; ++i)
+            _mm_storeu_si128((__m128i *)(out + i * 8), *previous);
+        return in;
+    }
+
+    const __m128i *words = (const __m128i *)in;
+    __m128i word = _mm_loadu_si128(words);
+    int next = 1;
+    int offset = 0;
+    for (int i = 0; i < LANE_SAMPLES; ++i) {
+        __m128i v = _mm_srl_epi16(word, _mm_cvtsi32_si128(offset));
+        offset += bits;
+        if (offset >= 16) {
+            offset -= 16;
+            if (next < bits) {
+                word = _mm_loadu_si128(words + next++);
+                if (offset > 0)
+                    v = _mm_or_si128(v, _mm_sll_epi16(
+                        word, _mm_cvtsi32_si128(bits - offset)));
+            }
+        }
+        v = _mm_and_si128(v, mask);
+
+        // Undo the zigzag
+        v = _mm_xor_si128(_mm_srli_epi16(v, 1),
+                          _mm_sub_epi16(zero, _mm_and_si128(v, one)));
+
+        // Prefix sum of the 8 deltas, plus the last decoded sample
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi16(v, *previous);
+        _mm_storeu_si128((__m128i *)(out + i * 8), v);
+
+        // Broadcast the last sample
+        v = _mm_shufflehi_epi16(v, 0xFF);
+        *previous = _mm_unpackhi_epi64(v, v);
+    }
+    return in + bits * 16;
+}
+#else
+static inline const unsigned char *
+decodeBlock(const unsigned char *in, int bits, uint16_t *out,
+            uint16_t *previous)
+{
+    uint16_t words[16 * 8];
+    std::memcpy(words, in, bits * 16);
+    const uint32_t mask = (1u << bits) - 1;
+
+    for (int j = 0; j < 8; ++j) {
+        int offset = 0;
+        for (int i = 0; i < LANE_SAMPLES; ++i) {
+            int word = offset / 16;
+            int shift = offset % 16;
+            uint32_t value = words[word * 8 + j] >> shift;
+            if (shift + bits > 16)
+                value |= uint32_t(words[(word + 1) * 8 + j]) << (16 - shift);
+            out[i * 8 + j] = unzigzag(uint16_t(value & mask));
+            offset += bits;
+        }
+    }
+    for (int i = 0; i < DEPTH_CODEC_BLOCK; ++i) {
+        out[i] = uint16_t(out[i] + *previous);
+        *previous = out[i];
+    }
+    return in + bits * 16;
+}
+#endif
+
+bool
+decodeDepth(const unsigned char *data, size_t size,
+            int *width, int *height,
+            std::vector<unsigned short> *depth)
+{
+    PROFILE_SCOPE("decodeDepth");
+    DepthCodecHeader header;
+    if (size < sizeof(header))
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != DEPTH_CODEC_MAGIC ||
+        header.version != DEPTH_CODEC_VERSION)
+        return false;
+
+    const size_t samples = size_t(header.width) * header.height;
+    const size_t blocks = (samples + DEPTH_CODEC_BLOCK - 1) / DEPTH_CODEC_BLOCK;
+    if (samples == 0 || size < sizeof(header) + blocks)
+        return false;
+
+    // Validate the whole stream up front so the block loop doesn't need to
+    const unsigned char *bit_widths = data + sizeof(header);
+    size_t packed_size = 0;
+    for (size_t b = 0; b < blocks; ++b) {
+        if (bit_widths[b] > 16)
+            return false;
+        packed_size += bit_widths[b] * 16;
+    }
+    if (size != sizeof(header) + blocks + packed_size)
+        return false;
+
+    // Decode the padding of the last block too, then drop it
+    depth->resize(blocks * DEPTH_CODEC_BLOCK);
+    uint16_t *out = depth->data();
+    const unsigned char *in = bit_widths + blocks;
+#ifdef __SSE2__
+    __m128i previous = _mm_setzero_si128();
+#else
+    uint16_t previous = 0;
+#endif
+    for (size_t b = 0; b < blocks; ++b)
+        in = decodeBlock(in, bit_widths[b], out + b * DEPTH_CODEC_BLOCK,
+                         &previous);
+    depth->resize(samples);
+
+    *width = header.width;
+    *height = header.height;
+    return true;
+}
+
+bool
+writeDepthFile(const std::string &path, const unsigned short *depth,
+               int width, int height)
+{
+    std::vector<unsigned char> data;
+    encodeDepth(depth, width, height, &data);
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write((const char *)data.data(), data.size());
+    return bool(ofs);
+}
+
+bool
+readDepthFile(const std::string &path, int *width, int *height,
+              std::vector<unsigned short> *depth,
+              std::vector<unsigned char> *buffer)
+{
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs)
+        return false;
+    std::streamsize size = ifs.tellg();
+    ifs.seekg(0);
+    buffer->resize(size_t(size));
+    if (!ifs.read((char *)buffer->data(), size))
+        return false;
+    return decodeDepth(buffer->data(), buffer->size(), width, height, depth);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Lossless codec for 16-bit depth images, stored as .sfmd files next to the
+// dataset PNGs. Samples are delta coded in raster order, zigzag mapped and
+// bit packed in blocks of DEPTH_CODEC_BLOCK samples that share a bit width.
+// Each block is laid out as 8 interleaved 16-bit lanes so the decoder can
+// unpack, undo the zigzag and prefix sum 8 samples per SSE2 instruction.
+//
+// File layout: DepthCodecHeader, one bit width byte per block, then the
+// packed blocks. A block of width b takes b 16-byte words, and sample
+// i * 8 + j of the block is stored in lane j at bit offset i * b.
+
+const uint32_t DEPTH_CODEC_MAGIC   = 0x444D4653; // "SFMD"
+const uint16_t DEPTH_CODEC_VERSION = 1;
+const int      DEPTH_CODEC_BLOCK   = 128;
+
+#pragma pack(push, 1)
+struct DepthCodecHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t width;
+    uint32_t height;
+};
+#pragma pack(pop)
+
+void encodeDepth(const unsigned short *depth, int width, int height,
+                 std::vector<unsigned char> *data);
+// Returns false if 'data' is not a valid encoded image
+bool decodeDepth(const unsigned char *data, size_t size,
+                 int *width, int *height,
+                 std::vector<unsigned short> *depth);
+
+bool writeDepthFile(const std::string &path, const unsigned short *depth,
+                    int width, int height);
+// 'buffer' holds the file contents and can be reused between calls
+bool readDepthFile(const std::string &path, int *width, int *height,
+                   std::vector<unsigned short> *depth,
+                   std::vector<unsigned char> *buffer);
@@ -0,0 +1,263 @@
+#include "frame_cache.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "depth_codec.hpp"
+#include "profiler.hpp"
+#include "volume.hpp"
+
+FrameCache::FrameCache(glm::uvec2 frame_size, size_t memory_budget)
+    : _frame_size(frame_size), _memory_budget(memory_budget),
+      _depth(MAX_BATCH_FRAMES)
+{
+}
+
+void
+FrameCache::add(const Volume *volume, int id,
+                const unsigned short *depth_data,
+                const unsigned char  *color_data,
+                const glm::mat3 &intrinsic,
+                const glm::mat4 &extrinsic)
+{
+    PROFILE_SCOPE("FrameCache::add");
+    if (!_frames.empty() && id <= _frames.rbegin()->first)
+        throw std::runtime_error("Frame cache ids must grow");
+
+    CachedFrame &frame = _frames[id];
+    encodeDepth(depth_data, _frame_size.x, _frame_size.y, &frame.depth);
+    frame.color.assign(color_data,
+                       color_data + _frame_size.x * _frame_size.y * 3);
+    frame.intrinsic = intrinsic;
+    frame.extrinsic = extrinsic;
+    placeFrame(volume, depth_data, &frame);
+    _memory_usage += frameSize(frame);
+    dropBroken(volume);
+
+    // Always keep the newest frame, even if it alone exceeds the budget
+    while (_memory_usage > _memory_budget && _frames.size() > 1) {
+        _memory_usage -= frameSize(_frames.begin()->second);
+        _frames.erase(_frames.begin());
+    }
+}
+
+glm::mat4
+FrameCache::getExtrinsic(int id) const
+{
+    auto it = _frames.find(id);
+    if (it == _frames.end())
+        throw std::runtime_error("Frame " + std::to_string(id) +
+                                 " is not cached");
+    return it->second.extrinsic;
+}
+
+std::vector<int>
+FrameCache::getIds() const
+{
+    std::vector<int> ids;
+    ids.reserve(_frames.size());
+    for (const auto &entry : _frames)
+        ids.push_back(entry.first);
+    return ids;
+}
+
+int
+FrameCache::reintegrate(Volume *volume, const int *ids,
+                        const glm::mat4 *extrinsics, int count)
+{
+    PROFILE_SCOPE("FrameCache::reintegrate");
+    dropBroken(volume);
+    int updated = 0;
+    for (const std::vector<int> &batch : makeBatches(ids, count)) {
+        std::vector<int> batch_ids;
+        std::vector<glm::mat4> batch_extrinsics;
+        for (int i : batch) {
+            batch_ids.push_back(ids[i]);
+            batch_extrinsics.push_back(extrinsics[i]);
+        }
+        updateBatch(volume, batch_ids, batch_extrinsics.data());
+        updated += int(batch.size());
+    }
+    return updated;
+}
+
+int
+FrameCache::remove(Volume *volume, const int *ids, int count)
+{
+    PROFILE_SCOPE("FrameCache::remove");
+    dropBroken(volume);
+    int removed = 0;
+    for (const std::vector<int> &batch : makeBatches(ids, count)) {
+        std::vector<int> batch_ids;
+        for (int i : batch)
+            batch_ids.push_back(ids[i]);
+        updateBatch(volume, batch_ids, nullptr);
+        for (int id : batch_ids) {
+            _memory_usage -= frameSize(_frames[id]);
+            _frames.erase(id);
+        }
+        removed += int(batch.size());
+    }
+    return removed;
+}
+
+void
+FrameCache::clear()
+{
+    _frames.clear();
+    _memory_usage = 0;
+}
+
+void
+FrameCache::updateBatch(Volume *volume, const std::vector<int> &ids,
+                        const glm::mat4 *extrinsics)
+{
+    const unsigned short *depth_batch[MAX_BATCH_FRAMES];
+    const unsigned char  *color_batch[MAX_BATCH_FRAMES];
+    glm::mat4 old_extrinsics[MAX_BATCH_FRAMES];
+    int count = int(ids.size());
+    for (int i = 0; i < count; ++i) {
+        CachedFrame &frame = _frames[ids[i]];
+        int width, height;
+        if (!decodeDepth(frame.depth.data(), frame.depth.size(),
+                         &width, &height, &_depth[i]))
+            throw std::runtime_error("Corrupt depth of cached frame " +
+                                     std::to_string(ids[i]));
+        depth_batch[i] = _depth[i].data();
+        color_batch[i] = frame.color.data();
+        old_extrinsics[i] = frame.extrinsic;
+        if (extrinsics) {
+            // The volume doesn't roll, so the new footprint is held by the
+            // same voxels from now on
+            frame.extrinsic = extrinsics[i];
+            placeFrame(volume, depth_batch[i], &frame);
+        }
+    }
+
+    const glm::mat3 &intrinsic = _frames[ids[0]].intrinsic;
+    if (extrinsics)
+        volume->reintegrateBatch(depth_batch, color_batch, intrinsic,
+                                 old_extrinsics, extrinsics, count);
+    else
+        volume->deintegrateBatch(depth_batch, color_batch, intrinsic,
+                                 old_extrinsics, count);
+}
+
+// Split the cached frames among 'ids' into batches of frames that share the
+// intrinsics, as indices into 'ids'
+std::vector<std::vector<int>>
+FrameCache::makeBatches(const int *ids, int count) const
+{
+    std::vector<std::vector<int>> batches;
+    const glm::mat3 *intrinsic = nullptr;
+    for (int i = 0; i < count; ++i) {
+        auto it = _frames.find(ids[i]);
+        if (it == _frames.end())
+            continue;
+        if (batches.empty() ||
+            int(batches.back().size()) == MAX_BATCH_FRAMES ||
+            it->second.intrinsic != *intrinsic)
+            batches.emplace_back();
+        batches.back().push_back(i);
+        intrinsic = &it->second.intrinsic;
+    }
+    return batches;
+}
+
+// Record the footprint of a frame and the volume it was integrated into
+void
+FrameCache::placeFrame(const Volume *volume, const unsigned short *depth_data,
+                       CachedFrame *frame) const
+{
+    glm::mat3 inv_intrinsic = glm::inverse(frame->intrinsic);
+    glm::mat4 pose = glm::inverse(frame->extrinsic);
+    // Voxels between the camera and the surface are updated too
+    glm::vec3 lo = glm::vec3(pose[3]);
+    glm::vec3 hi = lo;
+    for (unsigned y = 0; y < _frame_size.y; ++y)
+    for (unsigned x = 0; x < _frame_size.x; ++x) {
+        unsigned short depth_mm = depth_data[y * _frame_size.x + x];
+        if (depth_mm == 0 || depth_mm == 65535)
+            continue;
+        glm::vec3 point = inv_intrinsic * glm::vec3(x, y, 1.0f) *
+                          (depth_mm / 1000.0f);
+        point = glm::vec3(pose * glm::vec4(point, 1.0f));
+        lo = glm::min(lo, point);
+        hi = glm::max(hi, point);
+    }
+    frame->footprint_min = lo;
+    frame->footprint_max = hi;
+
+    frame->reset_count = volume->getResetCount();
+    frame->origins.clear();
+    for (int l = 0; l < volume->getLevels(); ++l)
+        frame->origins.push_back(volume->getOrigin(l));
+}
+
+// Whether the part of the footprint of a frame inside every level is the
+// same as when it was integrated
+bool
+FrameCache::isIntact(const Volume *volume, const CachedFrame &frame) const
+{
+    if (frame.reset_count != volume->getResetCount() ||
+        int(frame.origins.size()) != volume->getLevels())
+        return false;
+
+    glm::ivec3 dims = volume->getDims();
+    for (int l = 0; l < volume->getLevels(); ++l) {
+        glm::ivec3 origin = volume->getOrigin(l);
+        if (origin == frame.origins[l])
+            continue;
+
+        // Voxels of the level the frame may have updated. The truncation
+        // margin is given in voxels, plus one for the projection rounding.
+        glm::mat4 model_to_voxel = glm::inverse(volume->getVoxelToModel(l));
+        const glm::vec3 &a = frame.footprint_min;
+        const glm::vec3 &b = frame.footprint_max;
+        glm::vec3 lo(1e30f), hi(-1e30f);
+        for (int c = 0; c < 8; ++c) {
+            glm::vec4 corner((c & 1) ? b.x : a.x, (c & 2) ? b.y : a.y,
+                             (c & 4) ? b.z : a.z, 1.0f);
+            glm::vec3 voxel = glm::vec3(model_to_voxel * corner);
+            lo = glm::min(lo, voxel);
+            hi = glm::max(hi, voxel);
+        }
+        float margin = volume->getTruncMargin() + 1.0f;
+        glm::ivec3 first = glm::ivec3(glm::floor(lo - margin));
+        glm::ivec3 last = glm::ivec3(glm::ceil(hi + margin));
+
+        glm::ivec3 then_first = glm::max(first, frame.origins[l]);
+        glm::ivec3 then_last = glm::min(last, frame.origins[l] + dims);
+        glm::ivec3 now_first = glm::max(first, origin);
+        glm::ivec3 now_last = glm::min(last, origin + dims);
+        bool then_empty = glm::any(glm::greaterThanEqual(then_first,
+                                                         then_last));
+        bool now_empty = glm::any(glm::greaterThanEqual(now_first, now_last));
+        if (then_empty != now_empty)
+            return false;
+        if (!now_empty && (then_first != now_first || then_last != now_last))
+            return false;
+    }
+    return true;
+}
+
+// Drop the frames that can no longer be taken out of the volume exactly
+void
+FrameCache::dropBroken(const Volume *volume)
+{
+    for (auto it = _frames.begin(); it != _frames.end(); ) {
+        if (isIntact(volume, it->second)) {
+            ++it;
+            continue;
+        }
+        _memory_usage -= frameSize(it->second);
+        it = _frames.erase(it);
+    }
+}
+
+size_t
+FrameCache::frameSize(const CachedFrame &frame) const
+{
+    return sizeof(CachedFrame) + frame.depth.size() + frame.color.size();
+}
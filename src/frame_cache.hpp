@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class Volume;
+
+// Keeps the most recently integrated frames, so their contribution to the
+// volume can be replaced when their poses are corrected instead of replaying
+// the whole sequence. Depth is stored with the lossless depth codec and color
+// as is. The oldest frames are dropped once the cache exceeds its memory
+// budget.
+//
+// A frame can only be taken back out of the volume while every voxel it
+// touched is still there, and no voxel it didn't touch came in. The cache
+// remembers the level origins each frame was integrated with and drops the
+// frames whose footprint has crossed the border of a level since, or that
+// belong to a volume that was reset.
+class FrameCache {
+public:
+    FrameCache(glm::uvec2 frame_size, size_t memory_budget);
+
+    // Add a frame right after integrating it into the volume, before the
+    // next integration, so every roll of the volume is seen. Ids must grow
+    // with every frame, the lowest one is dropped first.
+    void add(const Volume *volume, int id,
+             const unsigned short *depth_data,
+             const unsigned char  *color_data,
+             const glm::mat3 &intrinsic,
+             const glm::mat4 &extrinsic);
+    bool contains(int id) const { return _frames.count(id) != 0; }
+    // Extrinsic the frame is currently integrated with
+    glm::mat4 getExtrinsic(int id) const;
+    std::vector<int> getIds() const;
+
+    // Move the given frames to new extrinsics inside the volume, up to
+    // MAX_BATCH_FRAMES at a time. Frames that are no longer cached are
+    // skipped, including the ones the volume no longer holds whole. Returns
+    // how many frames were updated.
+    int reintegrate(Volume *volume, const int *ids,
+                    const glm::mat4 *extrinsics, int count);
+    // Remove the given frames from the volume and from the cache
+    int remove(Volume *volume, const int *ids, int count);
+    // Forget every frame without touching the volume, e.g. once the frames
+    // belong to a volume that was reset
+    void clear();
+
+    int getFrameCount() const { return int(_frames.size()); }
+    size_t getMemoryUsage() const { return _memory_usage; }
+private:
+    struct CachedFrame {
+        // See encodeDepth()
+        std::vector<unsigned char> depth;
+        std::vector<unsigned char> color;
+        glm::mat3 intrinsic;
+        glm::mat4 extrinsic;
+        // Box around the camera and the valid depth samples, in the space
+        // of the extrinsic
+        glm::vec3 footprint_min;
+        glm::vec3 footprint_max;
+        // Volume when the frame was integrated
+        int       reset_count;
+        std::vector<glm::ivec3> origins;
+    };
+
+    // Update a batch of frames that share the intrinsics. Without new
+    // extrinsics the frames are only de-integrated.
+    void updateBatch(Volume *volume, const std::vector<int> &ids,
+                     const glm::mat4 *extrinsics);
+    std::vector<std::vector<int>> makeBatches(const int *ids, int count) const;
+    void placeFrame(const Volume *volume, const unsigned short *depth_data,
+                    CachedFrame *frame) const;
+    bool isIntact(const Volume *volume, const CachedFrame &frame) const;
+    void dropBroken(const Volume *volume);
+    size_t frameSize(const CachedFrame &frame) const;
+
+    glm::uvec2 _frame_size;
+    size_t     _memory_budget;
+    size_t     _memory_usage = 0;
+    std::map<int, CachedFrame> _frames;
+
+    // Decoded depth of the batch being updated, reused between batches
+    std::vector<std::vector<unsigned short>> _depth;
+};
@@ -0,0 +1,156 @@
+#include "frame_protocol.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+static int
+openUnixSocket(const std::string &path, bool listen)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path '" << path << "' is too long" << std::endl;
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (listen) {
+        // Remove a socket left behind by a previous run
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+            ::listen(fd, 1) == 0)
+            return fd;
+    } else if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static int
+openTcpSocket(const std::string &host, const std::string &port, bool listen)
+{
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen ? AI_PASSIVE : 0;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                    &hints, &result) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        if (listen) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                ::listen(fd, 1) == 0)
+                break;
+        } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            // Frames are large, but the header shouldn't wait for them
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+int
+openFrameSocket(const std::string &address, bool listen)
+{
+    int fd = -1;
+    if (address.compare(0, 5, "unix:") == 0) {
+        fd = openUnixSocket(address.substr(5), listen);
+    } else if (address.compare(0, 4, "tcp:") == 0) {
+        size_t colon = address.rfind(':');
+        fd = openTcpSocket(address.substr(4, colon > 4 ? colon - 4 : 0),
+                           address.substr(colon + 1), listen);
+    } else {
+        std::cerr << "Unknown socket address '" << address
+                  << "', expected tcp:HOST:PORT or unix:PATH" << std::endl;
+        return -1;
+    }
+    if (fd < 0)
+        std::cerr << "Failed to open socket '" << address << "': "
+                  << std::strerror(errno) << std::endl;
+    return fd;
+}
+
+int
+acceptFrameSocket(int listen_fd)
+{
+    int fd;
+    do {
+        fd = accept(listen_fd, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+void
+interruptFrameSocket(int fd)
+{
+    if (fd >= 0)
+        shutdown(fd, SHUT_RDWR);
+}
+
+void
+closeFrameSocket(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool
+sendAll(int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool
+recvAll(int fd, void *data, size_t size)
+{
+    char *p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary framing used to stream RGB-D frames over a socket. Every frame is a
+// FrameHeader followed by the depth samples (uint16 millimeters) and the
+// color pixels (RGB8), all little endian.
+
+const uint32_t FRAME_MAGIC   = 0x464D4653; // "SFMF"
+const uint16_t FRAME_VERSION = 1;
+
+// FrameHeader::flags
+const uint16_t FRAME_HAS_INTRINSIC = 1 << 0;
+
+#pragma pack(push, 1)
+struct FrameHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t width;
+    uint32_t height;
+    // Size in bytes of the payloads that follow the header
+    uint32_t depth_bytes;
+    uint32_t color_bytes;
+    // Column major 3x3 camera matrix, only valid with FRAME_HAS_INTRINSIC
+    float    intrinsic[9];
+    // Row major camera to world matrix, like the dataset pose files
+    float    pose[16];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FrameHeader) == 124, "Unexpected FrameHeader size");
+
+// Addresses are either "tcp:HOST:PORT" or "unix:PATH". Returns a listening
+// socket when 'listen' is set, a connected one otherwise, or -1 on failure.
+int openFrameSocket(const std::string &address, bool listen);
+// Wait for a client on a listening socket. Returns -1 on failure.
+int acceptFrameSocket(int listen_fd);
+// Wake up any thread blocked on the socket, the socket must still be closed
+void interruptFrameSocket(int fd);
+void closeFrameSocket(int fd);
+
+// Blocking transfers of exactly 'size' bytes. Return false if the connection
+// was closed or failed.
+bool sendAll(int fd, const void *data, size_t size);
+bool recvAll(int fd, void *data, size_t size);
@@ -0,0 +1,108 @@
+#include "frame_selector.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Only one out of OVERLAP_STRIDE x OVERLAP_STRIDE pixels is checked
+const int   OVERLAP_STRIDE    = 8;
+// Depth difference, in millimeters, under which a sample agrees with the
+// keyframe
+const float OVERLAP_TOLERANCE = 30.0f;
+// Invalid depth values are either 0 or 65535
+const unsigned short INVALID_DEPTH = 65535;
+
+
+FrameSelector::FrameSelector(glm::uvec2 frame_size) :
+    _frame_size(frame_size)
+{
+}
+
+bool
+FrameSelector::select(const unsigned short *depth_data,
+                      const glm::mat3 &intrinsic,
+                      const glm::mat4 &extrinsic)
+{
+    ++_stats.frames;
+
+    bool integrate = !_enabled || !_has_keyframe || _skipped >= _max_skipped;
+    if (!integrate) {
+        // Motion of the sensor since the keyframe
+        glm::mat4 relative = extrinsic * glm::inverse(_key_extrinsic);
+        float translation = glm::length(glm::vec3(relative[3]));
+        float cos_angle = (relative[0][0] + relative[1][1] + relative[2][2]
+                           - 1.0f) * 0.5f;
+        float rotation = glm::degrees(
+            std::acos(std::min(1.0f, std::max(-1.0f, cos_angle))));
+
+        integrate = translation >= _min_translation ||
+                    rotation >= _min_rotation;
+        if (!integrate && _min_overlap > 0.0f)
+            integrate = depthOverlap(depth_data, intrinsic, extrinsic)
+                < _min_overlap;
+    }
+
+    if (!integrate) {
+        ++_skipped;
+        return false;
+    }
+
+    ++_stats.integrated;
+    setKeyframe(depth_data, extrinsic);
+    return true;
+}
+
+void
+FrameSelector::reset()
+{
+    _has_keyframe = false;
+    _skipped = 0;
+    _stats = Stats();
+}
+
+// Fraction of the valid depth samples of the frame that, once reprojected
+// into the keyframe, land on a keyframe pixel with about the same depth
+float
+FrameSelector::depthOverlap(const unsigned short *depth_data,
+                            const glm::mat3 &intrinsic,
+                            const glm::mat4 &extrinsic) const
+{
+    glm::mat3 inv_intrinsic = glm::inverse(intrinsic);
+    glm::mat4 to_key = _key_extrinsic * glm::inverse(extrinsic);
+
+    int samples = 0, consistent = 0;
+    for (unsigned int y = 0; y < _frame_size.y; y += OVERLAP_STRIDE)
+    for (unsigned int x = 0; x < _frame_size.x; x += OVERLAP_STRIDE) {
+        unsigned short depth_mm = depth_data[y * _frame_size.x + x];
+        if (depth_mm == 0 || depth_mm == INVALID_DEPTH)
+            continue;
+        ++samples;
+
+        float depth = depth_mm / 1000.0f;
+        glm::vec3 p = inv_intrinsic * glm::vec3(x * depth, y * depth, depth);
+        glm::vec3 q = glm::vec3(to_key * glm::vec4(p, 1.0f));
+        if (q.z <= 0.0f)
+            continue;
+        glm::vec3 uv = intrinsic * q;
+        int u = int(std::round(uv.x / uv.z));
+        int v = int(std::round(uv.y / uv.z));
+        if (u < 0 || v < 0 || u >= int(_frame_size.x) || v >= int(_frame_size.y))
+            continue;
+
+        unsigned short key_mm = _key_depth[v * _frame_size.x + u];
+        if (key_mm == 0 || key_mm == INVALID_DEPTH)
+            continue;
+        if (std::abs(q.z * 1000.0f - key_mm) < OVERLAP_TOLERANCE)
+            ++consistent;
+    }
+    return samples > 0 ? float(consistent) / samples : 1.0f;
+}
+
+void
+FrameSelector::setKeyframe(const unsigned short *depth_data,
+                           const glm::mat4 &extrinsic)
+{
+    _has_keyframe = true;
+    _key_extrinsic = extrinsic;
+    _skipped = 0;
+    _key_depth.assign(depth_data, depth_data + _frame_size.x * _frame_size.y);
+}
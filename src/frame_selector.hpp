@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Decides which frames are worth integrating. A frame is skipped when the
+// sensor barely moved since the last integrated frame (the keyframe) and,
+// optionally, when most of its depth samples agree with the keyframe depth.
+class FrameSelector {
+public:
+    struct Stats {
+        int frames     = 0;
+        int integrated = 0;
+    };
+
+    FrameSelector(glm::uvec2 frame_size);
+
+    // Returns true if the frame should be integrated, in which case it becomes
+    // the new keyframe
+    bool select(const unsigned short *depth_data,
+                const glm::mat3 &intrinsic,
+                const glm::mat4 &extrinsic);
+    void reset();
+
+    Stats getStats() const { return _stats; }
+
+    // Configurable parameters
+    bool  _enabled         = true;
+    // Minimum sensor motion, in meters and degrees, to integrate a frame
+    float _min_translation = 0.01f;
+    float _min_rotation    = 1.0f;
+    // Frames whose fraction of depth samples consistent with the keyframe is
+    // below this ratio are always integrated. Zero disables the test.
+    float _min_overlap     = 0.9f;
+    // Integrate at least one out of this many frames
+    int   _max_skipped     = 30;
+private:
+    float depthOverlap(const unsigned short *depth_data,
+                       const glm::mat3 &intrinsic,
+                       const glm::mat4 &extrinsic) const;
+    void setKeyframe(const unsigned short *depth_data,
+                     const glm::mat4 &extrinsic);
+
+    glm::uvec2 _frame_size;
+
+    bool       _has_keyframe = false;
+    glm::mat4  _key_extrinsic;
+    std::vector<unsigned short> _key_depth;
+    int        _skipped = 0;
+
+    Stats      _stats;
+};
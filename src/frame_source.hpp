@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// A single RGB-D frame
+struct Frame {
+    // Depth in millimeters, 0 and 65535 mark invalid samples
+    std::vector<unsigned short> depth;
+    // RGB8
+    std::vector<unsigned char>  color;
+    // World to camera transform
+    glm::mat4 extrinsic = glm::mat4(1.0f);
+    // Sources that know the camera intrinsics provide them with every frame
+    bool      has_intrinsic = false;
+    glm::mat3 intrinsic = glm::mat3(1.0f);
+};
+
+// Where the frames to integrate come from
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    // Fill 'frame' with the next frame. Returns false if no frame is
+    // available, either because the source is exhausted or because a live
+    // source hasn't received one yet. Vectors of 'frame' are reused.
+    virtual bool read(Frame *frame) = 0;
+
+    // Go back to the first frame, if the source supports it
+    virtual void rewind() {}
+
+    // Index of the next frame and total number of frames, or -1 for live
+    // sources
+    virtual int position() const { return -1; }
+    virtual int size() const { return -1; }
+};
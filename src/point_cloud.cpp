@@ -0,0 +1,371 @@
+#include "point_cloud.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+#include "profiler.hpp"
+#include "volume.hpp"
+
+// Width of the zero padded vertex count in the PLY header, so it can be
+// patched in place once all the points have been written
+const int PLY_COUNT_DIGITS = 12;
+// LAS coordinates are stored as integers in millimeters
+const double LAS_SCALE = 0.001;
+const int LAS_HEADER_SIZE = 227;
+const int LAS_POINT_SIZE = 26;
+
+
+PointCloudExporter::PointCloudExporter(size_t memory_budget, int threads) :
+    _memory_budget(memory_budget),
+    _threads(threads)
+{
+    if (_threads <= 0)
+        _threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+PointCloudExporter::Format
+PointCloudExporter::formatFromPath(const std::string &path)
+{
+    std::string ext = path.substr(std::min(path.size(), path.rfind('.') + 1));
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "las" ? LAS : PLY;
+}
+
+// Blocks are read back from the GPU on the calling thread, since it's the one
+// that owns the GL context
+size_t
+PointCloudExporter::exportFile(Volume *volume, const std::string &path,
+                               Format format, int level)
+{
+    glm::ivec3 volume_dims = volume->getDims();
+    glm::ivec3 origin = volume->getOrigin(level);
+    glm::ivec3 blocks = (volume_dims + (BLOCK_SIZE - 1)) / BLOCK_SIZE;
+    glm::ivec3 b(0);
+
+    auto source = [&](Block *block) {
+        if (b.z == blocks.z)
+            return false;
+        glm::ivec3 own_first = origin + b * BLOCK_SIZE;
+        glm::ivec3 own_last = glm::min(own_first + BLOCK_SIZE,
+                                       origin + volume_dims);
+        glm::ivec3 first = glm::max(own_first - 1, origin);
+        glm::ivec3 last = glm::min(own_last + 1, origin + volume_dims);
+
+        block->grid.reset(new BrickedGrid<Voxel>());
+        block->first = first;
+        block->own_begin = own_first - first;
+        block->own_end = own_last - first;
+        volume->readRegion(first, last - first, block->grid.get(), level);
+
+        if (++b.x == blocks.x) {
+            b.x = 0;
+            if (++b.y == blocks.y) {
+                b.y = 0;
+                ++b.z;
+            }
+        }
+        return true;
+    };
+    return exportBlocks(path, format, source, volume->getVoxelToModel(level));
+}
+
+size_t
+PointCloudExporter::exportBlocks(const std::string &path, Format format,
+                                 const BlockSource &source,
+                                 const glm::mat4 &voxel_to_model)
+{
+    _format = format;
+    _voxel_to_model = voxel_to_model;
+    _count = 0;
+    _min = glm::vec3(std::numeric_limits<float>::max());
+    _max = glm::vec3(std::numeric_limits<float>::lowest());
+    _done = false;
+
+    _file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!_file)
+        throw std::runtime_error("Failed to create point cloud '" + path + "'");
+    writeHeader();
+
+    // Number of blocks that fit in the memory budget. Each worker holds one
+    // more while it extracts its points.
+    const int padded = (BLOCK_SIZE + 2 + BrickedGrid<Voxel>::BRICK_SIZE - 1) /
+        BrickedGrid<Voxel>::BRICK_SIZE * BrickedGrid<Voxel>::BRICK_SIZE;
+    const size_t block_bytes = size_t(padded) * padded * padded * sizeof(Voxel);
+    const size_t capacity = std::max(size_t(1), _memory_budget / block_bytes);
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < _threads; ++i)
+        workers.emplace_back(&PointCloudExporter::workerLoop, this);
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [&] { return _in_flight < capacity; });
+            ++_in_flight;
+        }
+        Block block;
+        if (!source(&block)) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_in_flight;
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back(std::move(block));
+        }
+        _cond.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done = true;
+    }
+    _cond.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+
+    patchHeader();
+    _file.close();
+    if (!_file)
+        throw std::runtime_error("Failed to write point cloud '" + path + "'");
+    return _count;
+}
+
+void
+PointCloudExporter::workerLoop()
+{
+    Profiler::setThreadName("Point cloud export");
+    std::vector<Point> points;
+    for (;;) {
+        Block block;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _done || !_jobs.empty(); });
+            if (_jobs.empty())
+                return;
+            block = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+
+        points.clear();
+        extract(block, &points);
+        // Release the block before waiting on the file
+        block.grid.reset();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_in_flight;
+        }
+        _cond.notify_all();
+
+        if (!points.empty())
+            writePoints(points);
+    }
+}
+
+// Central differences, falling back to one sided differences next to
+// unobserved voxels or the border of the grid
+static glm::vec3
+gradient(const BrickedGrid<Voxel> &grid, glm::ivec3 p)
+{
+    static const Voxel outside = Voxel();
+    float center = grid.at(p).tsdf;
+    glm::vec3 g;
+    for (int axis = 0; axis < 3; ++axis) {
+        const Voxel &next = grid.neighbour(p, axis, 1, outside);
+        const Voxel &prev = grid.neighbour(p, axis, -1, outside);
+        float span = 0.0f;
+        float a = center, b = center;
+        if (next.weight) { a = next.tsdf; span += 1.0f; }
+        if (prev.weight) { b = prev.tsdf; span += 1.0f; }
+        g[axis] = span > 0.0f ? (a - b) / span : 0.0f;
+    }
+    return g;
+}
+
+// Every edge between two observed voxels whose tsdf changes sign yields a
+// point. Edges are owned by the voxel at their lower end, so blocks never
+// emit the same point twice.
+void
+PointCloudExporter::extract(const Block &block,
+                            std::vector<Point> *points) const
+{
+    PROFILE_SCOPE("PointCloudExporter::extract");
+    const BrickedGrid<Voxel> &grid = *block.grid;
+    static const Voxel outside = Voxel();
+
+    glm::ivec3 p;
+    for (p.z = block.own_begin.z; p.z < block.own_end.z; ++p.z)
+    for (p.y = block.own_begin.y; p.y < block.own_end.y; ++p.y)
+    for (p.x = block.own_begin.x; p.x < block.own_end.x; ++p.x) {
+        const Voxel &v = grid.at(p);
+        if (v.weight == 0)
+            continue;
+        for (int axis = 0; axis < 3; ++axis) {
+            const Voxel &n = grid.neighbour(p, axis, 1, outside);
+            if (n.weight == 0 || (v.tsdf < 0.0f) == (n.tsdf < 0.0f))
+                continue;
+            // Both sides truncated, this is the back of a surface and not a
+            // zero crossing
+            if (std::min(std::abs(v.tsdf), std::abs(n.tsdf)) >= 1.0f)
+                continue;
+
+            float t = v.tsdf / (v.tsdf - n.tsdf);
+            glm::vec3 offset(0.0f);
+            offset[axis] = t;
+            // Voxel centers lie at half integer coordinates
+            glm::vec3 voxel = glm::vec3(block.first + p) + 0.5f + offset;
+
+            glm::ivec3 q = p;
+            q[axis] += 1;
+            glm::vec3 g = glm::mix(gradient(grid, p), gradient(grid, q), t);
+
+            Point point;
+            point.position = glm::vec3(_voxel_to_model *
+                                       glm::vec4(voxel, 1.0f));
+            glm::vec3 normal = glm::vec3(_voxel_to_model *
+                                         glm::vec4(voxel + g, 1.0f)) -
+                               point.position;
+            float length = glm::length(normal);
+            point.normal = length > 0.0f ? normal / length : glm::vec3(0.0f);
+            for (int c = 0; c < 3; ++c)
+                point.color[c] = (unsigned char)std::lround(
+                    v.color[c] + (n.color[c] - v.color[c]) * t);
+            points->push_back(point);
+        }
+    }
+}
+
+template <typename T>
+static void
+put(std::vector<char> *buffer, size_t offset, T value)
+{
+    std::memcpy(buffer->data() + offset, &value, sizeof(T));
+}
+
+template <typename T>
+static void
+append(std::vector<char> *buffer, T value)
+{
+    buffer->resize(buffer->size() + sizeof(T));
+    put(buffer, buffer->size() - sizeof(T), value);
+}
+
+void
+PointCloudExporter::writePoints(const std::vector<Point> &points)
+{
+    PROFILE_SCOPE("PointCloudExporter::writePoints");
+    std::vector<char> buffer;
+    buffer.reserve(points.size() * std::max(27, LAS_POINT_SIZE));
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+
+    for (const Point &point : points) {
+        min = glm::min(min, point.position);
+        max = glm::max(max, point.position);
+        if (_format == PLY) {
+            for (int i = 0; i < 3; ++i)
+                append(&buffer, point.position[i]);
+            for (int i = 0; i < 3; ++i)
+                append(&buffer, point.normal[i]);
+            for (int i = 0; i < 3; ++i)
+                append(&buffer, point.color[i]);
+        } else {
+            for (int i = 0; i < 3; ++i)
+                append(&buffer,
+                       int32_t(std::lround(point.position[i] / LAS_SCALE)));
+            append(&buffer, uint16_t(0));   // intensity
+            append(&buffer, uint8_t(0x09)); // return 1 of 1
+            append(&buffer, uint8_t(0));    // classification
+            append(&buffer, int8_t(0));     // scan angle
+            append(&buffer, uint8_t(0));    // user data
+            append(&buffer, uint16_t(0));   // point source
+            // LAS colors are 16-bit
+            for (int i = 0; i < 3; ++i)
+                append(&buffer, uint16_t(point.color[i] * 257));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    _file.write(buffer.data(), buffer.size());
+    _count += points.size();
+    _min = glm::min(_min, min);
+    _max = glm::max(_max, max);
+}
+
+void
+PointCloudExporter::writeHeader()
+{
+    if (_format == PLY) {
+        char count[PLY_COUNT_DIGITS + 1];
+        std::snprintf(count, sizeof(count), "%0*d", PLY_COUNT_DIGITS, 0);
+        _file << "ply\n"
+              << "format binary_little_endian 1.0\n"
+              << "comment generated by sfm\n"
+              << "element vertex " << count << "\n"
+              << "property float x\n"
+              << "property float y\n"
+              << "property float z\n"
+              << "property float nx\n"
+              << "property float ny\n"
+              << "property float nz\n"
+              << "property uchar red\n"
+              << "property uchar green\n"
+              << "property uchar blue\n"
+              << "end_header\n";
+        return;
+    }
+
+    // Filled in by patchHeader()
+    std::vector<char> header(LAS_HEADER_SIZE, 0);
+    _file.write(header.data(), header.size());
+}
+
+void
+PointCloudExporter::patchHeader()
+{
+    if (_format == PLY) {
+        char count[PLY_COUNT_DIGITS + 1];
+        std::snprintf(count, sizeof(count), "%0*zu", PLY_COUNT_DIGITS, _count);
+        // Right after "ply\nformat ...\ncomment ...\nelement vertex "
+        const size_t offset = std::strlen("ply\n"
+                                          "format binary_little_endian 1.0\n"
+                                          "comment generated by sfm\n"
+                                          "element vertex ");
+        _file.seekp(offset);
+        _file.write(count, PLY_COUNT_DIGITS);
+        return;
+    }
+
+    if (_count == 0) {
+        _min = glm::vec3(0.0f);
+        _max = glm::vec3(0.0f);
+    }
+
+    std::vector<char> header(LAS_HEADER_SIZE, 0);
+    std::memcpy(header.data(), "LASF", 4);
+    put(&header, 24, uint8_t(1));                       // version 1.2
+    put(&header, 25, uint8_t(2));
+    std::strncpy(header.data() + 26, "sfm", 32);        // system identifier
+    std::strncpy(header.data() + 58, "sfm", 32);        // generating software
+    put(&header, 94, uint16_t(LAS_HEADER_SIZE));
+    put(&header, 96, uint32_t(LAS_HEADER_SIZE));        // offset to points
+    put(&header, 100, uint32_t(0));                     // no VLRs
+    put(&header, 104, uint8_t(2));                      // point format
+    put(&header, 105, uint16_t(LAS_POINT_SIZE));
+    put(&header, 107, uint32_t(_count));
+    put(&header, 111, uint32_t(_count));                // points by return
+    for (int i = 0; i < 3; ++i) {
+        put(&header, 131 + i * 8, LAS_SCALE);
+        put(&header, 155 + i * 8, 0.0);                 // offset
+        put(&header, 179 + i * 16, double(_max[i]));
+        put(&header, 187 + i * 16, double(_min[i]));
+    }
+    _file.seekp(0);
+    _file.write(header.data(), header.size());
+}
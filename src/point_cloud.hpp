@@ -0,0 +1,90 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "voxel_grid.hpp"
+
+class Volume;
+
+// Extracts the zero crossings of a volume as a colored point cloud with
+// normals. The volume is read back one block at a time and the blocks are
+// processed by a pool of worker threads, so the whole volume is never held in
+// host memory at once.
+class PointCloudExporter {
+public:
+    enum Format {
+        // Binary little endian PLY with positions, normals and colors
+        PLY,
+        // LAS 1.2, point format 2 (positions and colors, no normals)
+        LAS
+    };
+
+    struct Block {
+        // Grid covering the block plus a one voxel apron
+        std::unique_ptr<BrickedGrid<Voxel>> grid;
+        // Global voxel index of the first voxel of the grid
+        glm::ivec3 first;
+        // Range of the grid owned by the block
+        glm::ivec3 own_begin;
+        glm::ivec3 own_end;
+    };
+
+    // Fills the next block to export, or returns false when there are no
+    // more. Called from the thread that calls exportBlocks().
+    typedef std::function<bool(Block *block)> BlockSource;
+
+    // 'memory_budget' bounds the host memory used by blocks waiting to be
+    // processed. Zero threads uses one per hardware thread.
+    PointCloudExporter(size_t memory_budget, int threads = 0);
+
+    // Must be called from the thread that owns the GL context. Returns the
+    // number of points written.
+    size_t exportFile(Volume *volume, const std::string &path, Format format,
+                      int level = 0);
+    // Same for blocks that are already on the host, so it can run on any
+    // thread. 'voxel_to_model' maps global voxel coordinates to the points.
+    size_t exportBlocks(const std::string &path, Format format,
+                        const BlockSource &source,
+                        const glm::mat4 &voxel_to_model);
+
+    static Format formatFromPath(const std::string &path);
+private:
+    struct Point {
+        glm::vec3     position;
+        glm::vec3     normal;
+        unsigned char color[3];
+    };
+
+    void workerLoop();
+    void extract(const Block &block, std::vector<Point> *points) const;
+    void writePoints(const std::vector<Point> &points);
+    void writeHeader();
+    void patchHeader();
+
+    size_t  _memory_budget;
+    int     _threads;
+
+    Format  _format;
+    glm::mat4 _voxel_to_model;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Block> _jobs;
+    size_t _in_flight = 0;
+    bool   _done = false;
+
+    std::mutex _file_mutex;
+    std::ofstream _file;
+    size_t _count = 0;
+    glm::vec3 _min;
+    glm::vec3 _max;
+};
@@ -0,0 +1,220 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+// Capacity of the ring buffer of each thread
+const size_t EVENTS_PER_THREAD = 1 << 16;
+// Events close to being overwritten are not collected, since the owning
+// thread may be writing them while they are copied
+const size_t COLLECT_EVENTS = EVENTS_PER_THREAD * 3 / 4;
+// Buffers of exited threads kept for reuse, the older ones are freed
+const int    POOLED_BUFFERS = 4;
+
+
+namespace {
+
+struct ThreadBuffer {
+    int         id;
+    std::string name;
+    std::unique_ptr<Profiler::Event[]> events;
+    // Number of events ever written, published after the event itself.
+    // Only the owning thread writes it.
+    std::atomic<uint64_t> head{0};
+    int         depth = 0;
+    // First event of the current thread and whether the thread has exited,
+    // guarded by the registry mutex
+    uint64_t    first = 0;
+    bool        exited = false;
+};
+
+std::atomic<bool> enabled{true};
+const std::chrono::steady_clock::time_point epoch =
+    std::chrono::steady_clock::now();
+
+// Every buffer alive. The ones of exited threads stay registered so their
+// events can still be collected, until another thread reuses them.
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<ThreadBuffer>> registry;
+int next_id = 0;
+
+// Hands the buffer of the thread back to the pool when the thread exits
+struct LocalBuffer {
+    std::shared_ptr<ThreadBuffer> buffer;
+
+    ~LocalBuffer() {
+        if (!buffer)
+            return;
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffer->exited = true;
+        int pooled = 0;
+        for (const auto &b : registry)
+            pooled += b->exited;
+        for (auto it = registry.begin(); pooled > POOLED_BUFFERS; ) {
+            if ((*it)->exited) {
+                it = registry.erase(it);
+                --pooled;
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+thread_local LocalBuffer local_buffer;
+
+ThreadBuffer *
+threadBuffer()
+{
+    if (!local_buffer.buffer) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::shared_ptr<ThreadBuffer> buffer;
+        for (const auto &b : registry) {
+            if (b->exited) {
+                buffer = b;
+                break;
+            }
+        }
+        if (buffer) {
+            // The events of the previous thread are no longer collected
+            buffer->exited = false;
+            buffer->first = buffer->head.load(std::memory_order_relaxed);
+            buffer->depth = 0;
+        } else {
+            buffer = std::make_shared<ThreadBuffer>();
+            buffer->events.reset(new Profiler::Event[EVENTS_PER_THREAD]);
+            buffer->id = next_id++;
+            registry.push_back(buffer);
+        }
+        buffer->name = "Thread " + std::to_string(buffer->id);
+        local_buffer.buffer = std::move(buffer);
+    }
+    return local_buffer.buffer.get();
+}
+
+} // namespace
+
+
+void
+Profiler::setEnabled(bool value)
+{
+    enabled.store(value, std::memory_order_relaxed);
+}
+
+bool
+Profiler::isEnabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void
+Profiler::setThreadName(const std::string &name)
+{
+    ThreadBuffer *buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    buffer->name = name;
+}
+
+uint64_t
+Profiler::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+int
+Profiler::enterScope()
+{
+    return threadBuffer()->depth++;
+}
+
+void
+Profiler::leaveScope(const char *name, uint64_t start, int depth)
+{
+    ThreadBuffer *buffer = threadBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head % EVENTS_PER_THREAD] = {name, start, now(), depth};
+    buffer->head.store(head + 1, std::memory_order_release);
+    buffer->depth = depth;
+}
+
+std::vector<Profiler::Thread>
+Profiler::collect(uint64_t since)
+{
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::vector<uint64_t> firsts;
+    std::vector<Thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffers = registry;
+        for (const auto &buffer : buffers) {
+            firsts.push_back(buffer->first);
+            threads.push_back({buffer->id, buffer->name, {}});
+        }
+    }
+
+    std::vector<Event> events;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        const ThreadBuffer &buffer = *buffers[i];
+        uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t first = head > COLLECT_EVENTS ? head - COLLECT_EVENTS : 0;
+        first = std::max(first, firsts[i]);
+        events.clear();
+        for (uint64_t j = first; j < head; ++j)
+            events.push_back(buffer.events[j % EVENTS_PER_THREAD]);
+
+        // The owning thread kept going while the events were copied. Drop
+        // the ones it may have overwritten, including the slot it may be
+        // writing right now.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t last = buffer.head.load(std::memory_order_relaxed);
+        uint64_t valid = last >= EVENTS_PER_THREAD
+                       ? last - EVENTS_PER_THREAD + 1 : 0;
+        for (uint64_t j = std::max(first, valid); j < head; ++j) {
+            const Event &event = events[j - first];
+            if (event.end >= since)
+                threads[i].events.push_back(event);
+        }
+    }
+    return threads;
+}
+
+bool
+Profiler::writeChromeTrace(const std::string &path)
+{
+    std::ofstream file(path);
+    if (!file) {
+        std::cerr << "Failed to create trace '" << path << "'" << std::endl;
+        return false;
+    }
+
+    file << std::fixed << std::setprecision(3);
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (const Thread &thread : collect()) {
+        file << (first ? "" : ",\n")
+             << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"
+             << thread.id << ",\"args\":{\"name\":\"" << thread.name << "\"}}";
+        first = false;
+        for (const Event &event : thread.events) {
+            // Timestamps are in microseconds
+            file << ",\n{\"name\":\"" << event.name
+                 << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread.id
+                 << ",\"ts\":" << event.start / 1000.0
+                 << ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+        }
+    }
+    file << "\n]}\n";
+
+    if (!file) {
+        std::cerr << "Failed to write trace '" << path << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Lightweight CPU profiler. Every thread records its scopes into a ring buffer
+// of its own, so recording an event never takes a lock and costs two clock
+// reads. Older events are overwritten once the buffer is full. The buffer of
+// a thread that exits goes back to a small pool, along with its id, and is
+// reused by the next thread that records an event.
+class Profiler {
+public:
+    struct Event {
+        // Must outlive the profiler, usually a string literal
+        const char *name;
+        // Nanoseconds since the profiler started
+        uint64_t    start;
+        uint64_t    end;
+        // Nesting level of the scope in its thread
+        int         depth;
+    };
+
+    struct Thread {
+        int                id;
+        std::string        name;
+        std::vector<Event> events;
+    };
+
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+    // Name shown for the calling thread
+    static void setThreadName(const std::string &name);
+
+    static uint64_t now();
+
+    // Copy the events of every thread that ended at or after 'since'
+    static std::vector<Thread> collect(uint64_t since = 0);
+
+    // Write every recorded event in the Chrome trace event format, viewable in
+    // chrome://tracing or Perfetto
+    static bool writeChromeTrace(const std::string &path);
+
+    static int enterScope();
+    static void leaveScope(const char *name, uint64_t start, int depth);
+};
+
+// Records the time spent between its construction and destruction
+class ProfileScope {
+public:
+    explicit ProfileScope(const char *name) : _name(name) {
+        if (Profiler::isEnabled()) {
+            _depth = Profiler::enterScope();
+            _start = Profiler::now();
+        }
+    }
+    ~ProfileScope() {
+        if (_depth >= 0)
+            Profiler::leaveScope(_name, _start, _depth);
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+private:
+    const char *_name;
+    uint64_t    _start = 0;
+    int         _depth = -1;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) \
+    ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
@@ -0,0 +1,185 @@
+#include "reference_integrator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "profiler.hpp"
+
+
+// Closest half float value, like a store to an R16F image
+static float
+roundToHalf(float value)
+{
+    if (value == 0.0f || !std::isfinite(value))
+        return value;
+    int exponent;
+    std::frexp(value, &exponent);
+    // 11 significant bits, subnormals below 2^-14
+    float ulp = std::ldexp(1.0f, std::max(exponent, -13) - 11);
+    return std::nearbyint(value / ulp) * ulp;
+}
+
+// Like packSnorm2x16() followed by the readback in Volume::readTexels()
+static float
+roundToSnorm16(float value)
+{
+    float s = std::round(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+    return std::max(s / 32767.0f, -1.0f);
+}
+
+static unsigned char
+roundToUnorm8(float value)
+{
+    return (unsigned char)std::round(
+        std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+}
+
+ReferenceIntegrator::ReferenceIntegrator(glm::ivec3 dims, float resolution,
+                                         glm::uvec2 frame_size,
+                                         Volume::VoxelFormat format,
+                                         int max_weight) :
+    _dims(dims),
+    _resolution(resolution),
+    _frame_size(frame_size),
+    _format(format),
+    _max_weight(max_weight)
+{
+    // Same as level 0 of a Volume
+    _texture_to_model = glm::scale(glm::mat4(1.0f),
+                                   glm::vec3(_dims) * _resolution);
+    _texture_to_model = glm::translate(_texture_to_model,
+                                       glm::vec3(-0.5f, -0.5f, -0.5f));
+    reset();
+}
+
+void
+ReferenceIntegrator::reset()
+{
+    _grid.resize(_dims);
+}
+
+void
+ReferenceIntegrator::integrateBatch(const unsigned short *const *depth_data,
+                                    const unsigned char  *const *color_data,
+                                    const glm::mat3 &intrinsic,
+                                    const glm::mat4 *extrinsics,
+                                    int count)
+{
+    PROFILE_SCOPE("ReferenceIntegrator::integrateBatch");
+    glm::ivec3 voxel;
+    for (voxel.z = 0; voxel.z < _dims.z; ++voxel.z)
+    for (voxel.y = 0; voxel.y < _dims.y; ++voxel.y)
+    for (voxel.x = 0; voxel.x < _dims.x; ++voxel.x)
+        integrateVoxel(voxel, depth_data, color_data, intrinsic,
+                       extrinsics, count);
+}
+
+// Line by line port of tsdf.glsl
+void
+ReferenceIntegrator::integrateVoxel(glm::ivec3 voxel,
+                                    const unsigned short *const *depth_data,
+                                    const unsigned char  *const *color_data,
+                                    const glm::mat3 &intrinsic,
+                                    const glm::mat4 *extrinsics,
+                                    int count)
+{
+    glm::vec3 norm_coords = (glm::vec3(voxel) + 0.5f) / glm::vec3(_dims);
+    norm_coords.y = 1.0f - norm_coords.y;
+    norm_coords.z = 1.0f - norm_coords.z;
+    glm::vec4 voxel_pos_model = _texture_to_model * glm::vec4(norm_coords, 1.0f);
+    const float trunc_margin = _resolution * _trunc_margin;
+
+    Voxel &stored = _grid.at(voxel);
+    bool loaded = false;
+    unsigned int weight = 0;
+    float tsdf = 0.0f;
+    glm::vec3 color(0.0f);
+
+    for (int i = 0; i < count; ++i) {
+        glm::vec4 voxel_pos_camera = extrinsics[i] * voxel_pos_model;
+        glm::vec3 voxel_pos_image = intrinsic * glm::vec3(voxel_pos_camera);
+        voxel_pos_image.x /= voxel_pos_image.z;
+        voxel_pos_image.y /= voxel_pos_image.z;
+        voxel_pos_image.x = std::round(voxel_pos_image.x);
+        voxel_pos_image.y = std::round(voxel_pos_image.y);
+
+        if (!(voxel_pos_camera.z > 0.0f &&
+              voxel_pos_image.x > 0.0f && voxel_pos_image.y > 0.0f &&
+              voxel_pos_image.x < _frame_size.x &&
+              voxel_pos_image.y < _frame_size.y))
+            continue;
+        size_t texel = size_t(voxel_pos_image.y) * _frame_size.x +
+                       size_t(voxel_pos_image.x);
+
+        unsigned int depth_mm = depth_data[i][texel];
+        if (depth_mm == 65535 || depth_mm == 0)
+            continue;
+
+        float depth = float(depth_mm) / 1000.0f;
+        float sdf = depth - voxel_pos_camera.z;
+        if (sdf < -trunc_margin)
+            continue;
+        float dist = std::min(1.0f, sdf / trunc_margin);
+
+        if (!loaded) {
+            weight = stored.weight;
+            tsdf = stored.tsdf;
+            color = glm::vec3(stored.color[0],
+                              stored.color[1],
+                              stored.color[2]) / 255.0f;
+            loaded = true;
+        }
+
+        float n = float(weight + 1);
+        tsdf = (tsdf * weight + dist) / n;
+        const unsigned char *c = color_data[i] + texel * 3;
+        glm::vec3 frame_color = glm::vec3(c[0], c[1], c[2]) / 255.0f;
+        color = (color * float(weight) + frame_color) / n;
+        weight = std::min(weight + 1, unsigned(_max_weight));
+    }
+
+    if (!loaded)
+        return;
+
+    stored.tsdf = _format == Volume::PACKED_VOXELS ? roundToSnorm16(tsdf)
+                                                   : roundToHalf(tsdf);
+    stored.weight = (unsigned short)weight;
+    stored.color[0] = roundToUnorm8(color.x);
+    stored.color[1] = roundToUnorm8(color.y);
+    stored.color[2] = roundToUnorm8(color.z);
+}
+
+GridDifference
+compareGrids(const BrickedGrid<Voxel> &a, const BrickedGrid<Voxel> &b,
+             float tsdf_tolerance, int color_tolerance)
+{
+    GridDifference diff;
+    glm::ivec3 dims = a.dims(), p;
+    for (p.z = 0; p.z < dims.z; ++p.z)
+    for (p.y = 0; p.y < dims.y; ++p.y)
+    for (p.x = 0; p.x < dims.x; ++p.x) {
+        const Voxel &va = a.at(p);
+        const Voxel &vb = b.at(p);
+        float tsdf_error = std::fabs(va.tsdf - vb.tsdf);
+        int weight_error = std::abs(int(va.weight) - int(vb.weight));
+        int color_error = 0;
+        for (int c = 0; c < 3; ++c)
+            color_error = std::max(color_error,
+                                   std::abs(int(va.color[c]) -
+                                            int(vb.color[c])));
+
+        ++diff.voxels;
+        if (va.weight > 0 || vb.weight > 0)
+            ++diff.observed;
+        if (weight_error > 0 || tsdf_error > tsdf_tolerance ||
+            color_error > color_tolerance)
+            ++diff.mismatched;
+        diff.max_tsdf_error = std::max(diff.max_tsdf_error, tsdf_error);
+        diff.max_color_error = std::max(diff.max_color_error, color_error);
+        diff.max_weight_error = std::max(diff.max_weight_error, weight_error);
+    }
+    return diff;
+}
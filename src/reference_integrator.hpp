@@ -0,0 +1,64 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "volume.hpp"
+#include "voxel_grid.hpp"
+
+// Scalar CPU implementation of the per-voxel update of tsdf.glsl, used to
+// check the GPU integrator and any optimized path against it. It covers a
+// single level that hasn't been rolled, and rounds the voxels to the storage
+// precision of the given format after every batch, like the GPU does.
+class ReferenceIntegrator {
+public:
+    ReferenceIntegrator(glm::ivec3 dims, float resolution,
+                        glm::uvec2 frame_size,
+                        Volume::VoxelFormat format, int max_weight);
+
+    // Same arguments as Volume::integrateBatch()
+    void integrateBatch(const unsigned short *const *depth_data,
+                        const unsigned char  *const *color_data,
+                        const glm::mat3 &intrinsic,
+                        const glm::mat4 *extrinsics,
+                        int count);
+    void reset();
+
+    void setTruncMargin(float trunc_margin) { _trunc_margin = trunc_margin; }
+
+    const BrickedGrid<Voxel> &getGrid() const { return _grid; }
+private:
+    void integrateVoxel(glm::ivec3 voxel,
+                        const unsigned short *const *depth_data,
+                        const unsigned char  *const *color_data,
+                        const glm::mat3 &intrinsic,
+                        const glm::mat4 *extrinsics,
+                        int count);
+
+    glm::ivec3 _dims;
+    float      _resolution;
+    glm::uvec2 _frame_size;
+    Volume::VoxelFormat _format;
+    int        _max_weight;
+    float      _trunc_margin = 2.0f;
+
+    glm::mat4  _texture_to_model;
+
+    BrickedGrid<Voxel> _grid;
+};
+
+struct GridDifference {
+    size_t voxels = 0;
+    // Voxels with a weight in either grid
+    size_t observed = 0;
+    // Voxels whose weight differs, or whose tsdf or color differ by more
+    // than the tolerances
+    size_t mismatched = 0;
+    float  max_tsdf_error = 0.0f;
+    int    max_color_error = 0;
+    int    max_weight_error = 0;
+};
+
+// Both grids must have the same dimensions
+GridDifference compareGrids(const BrickedGrid<Voxel> &a,
+                            const BrickedGrid<Voxel> &b,
+                            float tsdf_tolerance, int color_tolerance);
@@ -0,0 +1,157 @@
+#include "render_target.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "profiler.hpp"
+
+// Bytes per pixel of each map as it's read back
+const size_t COLOR_PIXEL_SIZE  = 4;
+const size_t DEPTH_PIXEL_SIZE  = sizeof(float);
+const size_t NORMAL_PIXEL_SIZE = 3 * sizeof(float);
+
+RenderTarget::RenderTarget(glm::uvec2 size, int layers) :
+    _size(size),
+    _layers(layers)
+{
+    if (layers < 1)
+        throw std::runtime_error("A render target needs at least one layer");
+
+    _color_tex = createTexture(GL_RGBA8);
+    _depth_tex = createTexture(GL_R32F);
+    _normal_tex = createTexture(GL_RGBA16F);
+
+    // Every slot can hold all the layers
+    size_t pixels = size_t(_size.x) * _size.y * _layers;
+    for (Readback &r : _readbacks) {
+        GLuint *pbos[] = {&r.color_pbo, &r.depth_pbo, &r.normal_pbo};
+        size_t sizes[] = {COLOR_PIXEL_SIZE, DEPTH_PIXEL_SIZE, NORMAL_PIXEL_SIZE};
+        for (int i = 0; i < 3; ++i) {
+            glGenBuffers(1, pbos[i]);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, *pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, pixels * sizes[i], nullptr,
+                         GL_STREAM_READ);
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+RenderTarget::~RenderTarget()
+{
+    for (Readback &r : _readbacks) {
+        if (r.fence)
+            glDeleteSync(r.fence);
+        GLuint pbos[] = {r.color_pbo, r.depth_pbo, r.normal_pbo};
+        glDeleteBuffers(3, pbos);
+    }
+    GLuint textures[] = {_color_tex, _depth_tex, _normal_tex};
+    glDeleteTextures(3, textures);
+}
+
+GLuint
+RenderTarget::createTexture(GLenum internal_format)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    // Immutable storage, required to bind the texture as an image
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, internal_format,
+                   _size.x, _size.y, _layers);
+    return texture;
+}
+
+bool
+RenderTarget::startReadback(int count)
+{
+    PROFILE_SCOPE("RenderTarget::startReadback");
+    if (_pending == MAX_PENDING_READBACKS || count < 1 || count > _layers)
+        return false;
+
+    Readback &r = _readbacks[(_first + _pending) % MAX_PENDING_READBACKS];
+    r.count = count;
+
+    // Make sure the rendering shader writes are visible to the copy
+    glMemoryBarrier(GL_PIXEL_BUFFER_BARRIER_BIT |
+                    GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    size_t pixels = size_t(_size.x) * _size.y * count;
+    struct {
+        GLuint texture, pbo;
+        GLenum format, type;
+        size_t pixel_size;
+    } copies[] = {
+        {_color_tex,  r.color_pbo,  GL_RGBA, GL_UNSIGNED_BYTE, COLOR_PIXEL_SIZE},
+        {_depth_tex,  r.depth_pbo,  GL_RED,  GL_FLOAT,         DEPTH_PIXEL_SIZE},
+        {_normal_tex, r.normal_pbo, GL_RGB,  GL_FLOAT,         NORMAL_PIXEL_SIZE},
+    };
+    for (const auto &c : copies) {
+        // With a pack buffer bound the pointer is an offset into it, and the
+        // copy is queued instead of stalling
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbo);
+        glGetTextureSubImage(c.texture, 0,
+                             0, 0, 0,
+                             _size.x, _size.y, count,
+                             c.format, c.type,
+                             GLsizei(pixels * c.pixel_size), (void*)0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++_pending;
+    return true;
+}
+
+bool
+RenderTarget::finishReadback(Maps *maps, bool wait)
+{
+    if (_pending == 0)
+        return false;
+
+    Readback &r = _readbacks[_first];
+    // Flush on the first check, otherwise the fence may never be signaled
+    GLuint64 timeout = wait ? GL_TIMEOUT_IGNORED : 0;
+    GLenum status = glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                     timeout);
+    if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+        return false;
+
+    PROFILE_SCOPE("RenderTarget::finishReadback");
+    glDeleteSync(r.fence);
+    r.fence = 0;
+
+    size_t pixels = size_t(_size.x) * _size.y * r.count;
+    maps->count = r.count;
+    maps->size = _size;
+    maps->color.resize(pixels * 4);
+    maps->depth.resize(pixels);
+    maps->normal.resize(pixels * 3);
+
+    struct {
+        GLuint pbo;
+        void *data;
+        size_t size;
+    } copies[] = {
+        {r.color_pbo,  maps->color.data(),  pixels * COLOR_PIXEL_SIZE},
+        {r.depth_pbo,  maps->depth.data(),  pixels * DEPTH_PIXEL_SIZE},
+        {r.normal_pbo, maps->normal.data(), pixels * NORMAL_PIXEL_SIZE},
+    };
+    for (const auto &c : copies) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbo);
+        void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, c.size,
+                                        GL_MAP_READ_BIT);
+        if (mapped) {
+            std::memcpy(c.data, mapped, c.size);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    _first = (_first + 1) % MAX_PENDING_READBACKS;
+    --_pending;
+    return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+
+#include "glad/glad.h"
+#include <glm/glm.hpp>
+
+// Maximum number of views raycast by a single dispatch. Must match the
+// rendering shader.
+const int MAX_RENDER_VIEWS = 16;
+
+// A camera to render the volume from. Same conventions as the frames that
+// are integrated: the extrinsic maps world to camera space and the intrinsic
+// camera space to pixels.
+struct RenderView {
+    glm::mat4 extrinsic;
+    glm::mat3 intrinsic;
+};
+
+// Offscreen maps rendered by Volume::renderViews(), one view per layer of
+// a set of 2D array textures:
+//   color:  RGBA8, alpha is 0 where no surface was hit
+//   depth:  R32F camera space z in meters, 0 where no surface was hit
+//   normal: RGBA16F world space normal in xyz
+//
+// The maps can be read back asynchronously. startReadback() queues a copy to
+// pixel buffers and returns immediately, finishReadback() hands out the
+// oldest copy once the GPU is done with it, so rendering and reading back
+// can overlap.
+class RenderTarget {
+public:
+    struct Maps {
+        int        count = 0;
+        glm::uvec2 size = glm::uvec2(0);
+        // count * size.x * size.y pixels each, layer after layer
+        std::vector<unsigned char> color;  // RGBA
+        std::vector<float>         depth;
+        std::vector<float>         normal; // xyz
+    };
+
+    // Number of readbacks that can be in flight at once
+    static const int MAX_PENDING_READBACKS = 3;
+
+    RenderTarget(glm::uvec2 size, int layers);
+    ~RenderTarget();
+
+    RenderTarget(const RenderTarget &) = delete;
+    RenderTarget &operator=(const RenderTarget &) = delete;
+
+    glm::uvec2 getSize() const { return _size; }
+    int getLayers() const { return _layers; }
+
+    GLuint getColorTexture() const { return _color_tex; }
+    GLuint getDepthTexture() const { return _depth_tex; }
+    GLuint getNormalTexture() const { return _normal_tex; }
+
+    // Queue a copy of the first 'count' layers. Fails if too many readbacks
+    // are already in flight.
+    bool startReadback(int count);
+    // Fetch the oldest queued readback. Returns false if there is none, or
+    // if it hasn't finished yet and 'wait' is false.
+    bool finishReadback(Maps *maps, bool wait = false);
+    int getPendingReadbacks() const { return _pending; }
+
+private:
+    struct Readback {
+        GLuint color_pbo = 0;
+        GLuint depth_pbo = 0;
+        GLuint normal_pbo = 0;
+        GLsync fence = 0;
+        int    count = 0;
+    };
+
+    GLuint createTexture(GLenum internal_format);
+
+    glm::uvec2 _size;
+    int        _layers;
+
+    GLuint     _color_tex;
+    GLuint     _depth_tex;
+    GLuint     _normal_tex;
+
+    // Ring of readback slots, _first is the oldest pending one
+    Readback   _readbacks[MAX_PENDING_READBACKS];
+    int        _first = 0;
+    int        _pending = 0;
+};
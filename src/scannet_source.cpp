@@ -0,0 +1,95 @@
+#include "scannet_source.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <dirent.h>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "dataset_source.hpp"
+#include "profiler.hpp"
+
+
+// Reads a row major 4x4 matrix
+static bool
+readMatrix(const std::string &filename, glm::mat4 *matrix)
+{
+    std::ifstream ifs(filename);
+    float floats[16];
+    for (int i = 0; i < 16; ++i) {
+        if (!(ifs >> floats[i]))
+            return false;
+    }
+    // Transpose because glm uses column major ordering
+    *matrix = glm::transpose(glm::make_mat4(floats));
+    return true;
+}
+
+ScanNetFrameSource::ScanNetFrameSource(const std::string &dir,
+                                       glm::uvec2 frame_size) :
+    _dir(dir),
+    _frame_size(frame_size),
+    _intrinsic(1.0f)
+{
+    std::string intrinsic_filename = _dir + "/intrinsic/intrinsic_depth.txt";
+    glm::mat4 intrinsic;
+    if (!readMatrix(intrinsic_filename, &intrinsic))
+        throw std::runtime_error("Failed to read intrinsics from file '" +
+                                 intrinsic_filename + "'");
+    _intrinsic = glm::mat3(intrinsic);
+
+    // Frames dropped by the exporter leave gaps in the numbering
+    std::string depth_dir = _dir + "/depth";
+    DIR *d = opendir(depth_dir.c_str());
+    if (!d)
+        throw std::runtime_error("Failed to open '" + depth_dir + "'");
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        size_t dot = name.find('.');
+        if (dot == 0 || dot == std::string::npos ||
+            name.substr(dot) != ".png" ||
+            name.find_first_not_of("0123456789") != dot)
+            continue;
+        _frames.push_back(std::atoi(name.c_str()));
+    }
+    closedir(d);
+    std::sort(_frames.begin(), _frames.end());
+}
+
+bool
+ScanNetFrameSource::read(Frame *frame)
+{
+    PROFILE_SCOPE("ScanNetFrameSource::read");
+    while (_next < int(_frames.size())) {
+        std::string n = std::to_string(_frames[_next]);
+        std::string depth_filename = _dir + "/depth/" + n + ".png";
+        ++_next;
+
+        glm::mat4 pose;
+        if (!readMatrix(_dir + "/pose/" + n + ".txt", &pose)) {
+            std::cerr << "Failed to read pose matrix of frame " << n
+                      << ". Skipping frame..." << std::endl;
+            continue;
+        }
+        // Frames where tracking was lost have infinite poses
+        if (!std::isfinite(pose[3][0]) || !std::isfinite(pose[0][0]))
+            continue;
+
+        if (!loadDepth(depth_filename, _frame_size, 1.0f, &frame->depth,
+                       &_depth_buffer) ||
+            !loadColorImage(_dir + "/color/" + n + ".jpg", _frame_size,
+                            &frame->color))
+            continue;
+
+        frame->extrinsic = glm::inverse(pose);
+        frame->has_intrinsic = true;
+        frame->intrinsic = _intrinsic;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+
+// Scenes exported by the ScanNet SensReader: depth/N.png (16-bit
+// millimeters), color/N.jpg, pose/N.txt (row major camera to world matrix)
+// and intrinsic/intrinsic_depth.txt. Color images are captured at a higher
+// resolution and are resampled to the depth size. The frames are the depth
+// images found in the scene, in order, so gaps in the numbering are skipped.
+// Transcoded depth/N.sfmd files are read in place of the PNGs, see
+// loadDepth().
+class ScanNetFrameSource : public FrameSource {
+public:
+    ScanNetFrameSource(const std::string &dir, glm::uvec2 frame_size);
+
+    bool read(Frame *frame) override;
+    void rewind() override { _next = 0; }
+    int position() const override { return _next; }
+    int size() const override { return int(_frames.size()); }
+private:
+    std::string _dir;
+    glm::uvec2  _frame_size;
+    glm::mat3   _intrinsic;
+    // Numbers of the frames with a depth image, sorted
+    std::vector<int> _frames;
+    int         _next = 0;
+    // File contents of the last transcoded depth image, see loadDepth()
+    std::vector<unsigned char> _depth_buffer;
+};
@@ -4,11 +4,57 @@
 #include <iostream>
 
 
-Shader::Shader(const GLchar *compute_path)
+// Read a shader source, replacing every '#include "file"' line with the
+// contents of that file, relative to the including one
+static std::string
+loadSource(const std::string &path)
 {
-    std::ifstream compute_ifs(compute_path);
-    std::string compute_code((std::istreambuf_iterator<char>(compute_ifs)),
-                             (std::istreambuf_iterator<char>()));
+    std::ifstream ifs(path);
+    if (!ifs)
+        std::cerr << "Failed to read shader source '" << path << "'"
+                  << std::endl;
+
+    std::string dir;
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos)
+        dir = path.substr(0, slash + 1);
+
+    std::string code, line;
+    while (std::getline(ifs, line)) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos &&
+            line.compare(start, 8, "#include") == 0) {
+            size_t open = line.find('"', start);
+            size_t close = line.find('"', open + 1);
+            if (open != std::string::npos && close != std::string::npos) {
+                code += loadSource(dir + line.substr(open + 1,
+                                                     close - open - 1));
+                continue;
+            }
+        }
+        code += line + "\n";
+    }
+    return code;
+}
+
+static std::string
+insertDefines(const std::string &code, const std::string &defines)
+{
+    if (defines.empty())
+        return code;
+    size_t version = code.find("#version");
+    if (version == std::string::npos)
+        return defines + code;
+    size_t line_end = code.find('\n', version);
+    if (line_end == std::string::npos)
+        return code + "\n" + defines;
+    return code.substr(0, line_end + 1) + defines + code.substr(line_end + 1);
+}
+
+Shader::Shader(const GLchar *compute_path, const std::string &defines)
+{
+    std::string compute_code = insertDefines(loadSource(compute_path),
+                                             defines);
     const GLchar *compute_code_cstr = compute_code.c_str();
 
     GLuint compute_shader;
@@ -25,16 +71,14 @@ Shader::Shader(const GLchar *compute_path)
     glDeleteShader(compute_shader);
 }
 
-Shader::Shader(const GLchar *vertex_path, const GLchar *fragment_path)
+Shader::Shader(const GLchar *vertex_path, const GLchar *fragment_path,
+               const std::string &defines)
 {
-    std::ifstream vertex_ifs(vertex_path);
-    std::string vertex_code((std::istreambuf_iterator<char>(vertex_ifs)),
-                            (std::istreambuf_iterator<char>()));
+    std::string vertex_code = insertDefines(loadSource(vertex_path), defines);
     const GLchar *vertex_code_cstr = vertex_code.c_str();
 
-    std::ifstream fragment_ifs(fragment_path);
-    std::string fragment_code((std::istreambuf_iterator<char>(fragment_ifs)),
-                              (std::istreambuf_iterator<char>()));
+    std::string fragment_code = insertDefines(loadSource(fragment_path),
+                                              defines);
     const GLchar *fragment_code_cstr = fragment_code.c_str();
 
     GLuint vertex_shader, fragment_shader;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <string>
 
 #include "glad/glad.h"
 #include "glm/glm.hpp"
@@ -9,8 +10,12 @@ class Shader {
 public:
     GLuint _program;
 
-    Shader(const GLchar *compute_path);
-    Shader(const GLchar *vertex_path, const GLchar *fragment_path);
+    // Optional preprocessor definitions are inserted right after the #version
+    // directive of every stage. Sources can pull in shared code with
+    // #include "file", resolved relative to the including file.
+    Shader(const GLchar *compute_path, const std::string &defines = "");
+    Shader(const GLchar *vertex_path, const GLchar *fragment_path,
+           const std::string &defines = "");
     void use();
     void setBool(const std::string &name, bool value) const {
         glUniform1i(glGetUniformLocation(_program, name.c_str()), (int)value);
@@ -18,6 +23,9 @@ public:
     void setInt(const std::string &name, int value) const {
         glUniform1i(glGetUniformLocation(_program, name.c_str()), value);
     }
+    void setUInt(const std::string &name, unsigned int value) const {
+        glUniform1ui(glGetUniformLocation(_program, name.c_str()), value);
+    }
     void setFloat(const std::string &name, float value) const {
         glUniform1f(glGetUniformLocation(_program, name.c_str()), value);
     }
@@ -33,6 +41,12 @@ public:
     void setVec3(const std::string &name, float x, float y, float z) const {
         glUniform3f(glGetUniformLocation(_program, name.c_str()), x, y, z);
     }
+    void setIVec2(const std::string &name, const glm::ivec2 &value) const {
+        glUniform2iv(glGetUniformLocation(_program, name.c_str()), 1, &value[0]);
+    }
+    void setIVec3(const std::string &name, const glm::ivec3 &value) const {
+        glUniform3iv(glGetUniformLocation(_program, name.c_str()), 1, &value[0]);
+    }
     void setVec4(const std::string &name, const glm::vec4 &value) const {
         glUniform4fv(glGetUniformLocation(_program, name.c_str()), 1, &value[0]);
     }
@@ -0,0 +1,229 @@
+#include "socket_source.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "frame_protocol.hpp"
+#include "profiler.hpp"
+
+
+SocketFrameSource::SocketFrameSource(const std::string &address,
+                                     glm::uvec2 frame_size,
+                                     int queue_size, Policy policy) :
+    _address(address),
+    _frame_size(frame_size),
+    _policy(policy)
+{
+    _listen_fd = openFrameSocket(_address, true);
+    if (_listen_fd < 0)
+        throw std::runtime_error("Failed to listen on '" + _address + "'");
+
+    // All the frame memory is allocated up front
+    _buffers.resize(std::max(1, queue_size));
+    for (Frame &buffer : _buffers) {
+        buffer.depth.resize(size_t(_frame_size.x) * _frame_size.y);
+        buffer.color.resize(size_t(_frame_size.x) * _frame_size.y * 3);
+        _free.push_back(&buffer);
+    }
+
+    _thread = std::thread(&SocketFrameSource::receiveLoop, this);
+}
+
+SocketFrameSource::~SocketFrameSource()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+        interruptFrameSocket(_client_fd);
+    }
+    interruptFrameSocket(_listen_fd);
+    _cond.notify_all();
+    _thread.join();
+    closeFrameSocket(_listen_fd);
+}
+
+bool
+SocketFrameSource::read(Frame *frame)
+{
+    Frame *buffer;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_ready.empty())
+            return false;
+        buffer = _ready.front();
+        _ready.pop_front();
+    }
+
+    // Swap instead of copying. The caller's vectors become the buffer's, and
+    // keep their capacity for the next frames.
+    std::swap(frame->depth, buffer->depth);
+    std::swap(frame->color, buffer->color);
+    frame->extrinsic = buffer->extrinsic;
+    frame->has_intrinsic = buffer->has_intrinsic;
+    frame->intrinsic = buffer->intrinsic;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free.push_back(buffer);
+    }
+    _cond.notify_all();
+    return true;
+}
+
+void
+SocketFrameSource::setPolicy(Policy policy)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _policy = policy;
+    }
+    _cond.notify_all();
+}
+
+SocketFrameSource::Policy
+SocketFrameSource::getPolicy() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _policy;
+}
+
+SocketFrameSource::Stats
+SocketFrameSource::getStats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Stats stats = _stats;
+    stats.pending = _ready.size();
+    return stats;
+}
+
+void
+SocketFrameSource::receiveLoop()
+{
+    Profiler::setThreadName("Frame receiver");
+
+    for (;;) {
+        int fd = acceptFrameSocket(_listen_fd);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_quit) {
+                closeFrameSocket(fd);
+                return;
+            }
+            if (fd >= 0) {
+                _client_fd = fd;
+                _stats.connected = true;
+            }
+        }
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        for (;;) {
+            Frame *buffer = acquireBuffer();
+            if (!buffer)
+                break;
+
+            bool valid = false;
+            bool ok = receiveFrame(fd, buffer, &valid);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (ok && valid) {
+                _ready.push_back(buffer);
+                ++_stats.received;
+            } else {
+                _free.push_back(buffer);
+            }
+            if (!ok)
+                break;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        closeFrameSocket(fd);
+        _client_fd = -1;
+        _stats.connected = false;
+        if (_quit)
+            return;
+    }
+}
+
+// Returns nullptr when the source is being destroyed
+Frame *
+SocketFrameSource::acquireBuffer()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        if (_quit)
+            return nullptr;
+        if (!_free.empty()) {
+            Frame *buffer = _free.back();
+            _free.pop_back();
+            return buffer;
+        }
+        if (_policy == DROP_OLDEST && !_ready.empty()) {
+            Frame *buffer = _ready.front();
+            _ready.pop_front();
+            ++_stats.dropped;
+            return buffer;
+        }
+        _cond.wait(lock);
+    }
+}
+
+// Returns false if the connection must be dropped. Frames that are
+// well-formed but can't be integrated are consumed and flagged as invalid.
+bool
+SocketFrameSource::receiveFrame(int fd, Frame *frame, bool *valid)
+{
+    FrameHeader header;
+    if (!recvAll(fd, &header, sizeof(header)))
+        return false;
+    if (header.magic != FRAME_MAGIC || header.version != FRAME_VERSION) {
+        std::cerr << "Invalid frame header received on '" << _address
+                  << "', dropping connection" << std::endl;
+        return false;
+    }
+
+    PROFILE_SCOPE("SocketFrameSource::receiveFrame");
+    const size_t pixels = size_t(_frame_size.x) * _frame_size.y;
+    if (header.width != _frame_size.x || header.height != _frame_size.y ||
+        header.depth_bytes != pixels * 2 || header.color_bytes != pixels * 3) {
+        std::cerr << "Frame of size " << header.width << "x" << header.height
+                  << " received but expected "
+                  << _frame_size.x << "x" << _frame_size.y
+                  << ". Skipping frame..." << std::endl;
+        // Discard the payload to stay in sync with the stream
+        std::vector<char> discard(65536);
+        size_t remaining = size_t(header.depth_bytes) + header.color_bytes;
+        while (remaining > 0) {
+            size_t n = std::min(remaining, discard.size());
+            if (!recvAll(fd, discard.data(), n))
+                return false;
+            remaining -= n;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.rejected;
+        return true;
+    }
+
+    frame->depth.resize(pixels);
+    frame->color.resize(pixels * 3);
+    if (!recvAll(fd, frame->depth.data(), header.depth_bytes) ||
+        !recvAll(fd, frame->color.data(), header.color_bytes))
+        return false;
+
+    frame->has_intrinsic = (header.flags & FRAME_HAS_INTRINSIC) != 0;
+    if (frame->has_intrinsic)
+        frame->intrinsic = glm::make_mat3(header.intrinsic);
+    // Same convention as the dataset pose files
+    glm::mat4 pose = glm::transpose(glm::make_mat4(header.pose));
+    frame->extrinsic = glm::inverse(pose);
+
+    *valid = true;
+    return true;
+}
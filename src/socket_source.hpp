@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_source.hpp"
+
+// Live frames streamed by a capture rig over a TCP or Unix domain socket using
+// the framing in frame_protocol.hpp. A receive thread writes every frame
+// straight into one of a fixed set of preallocated buffers, which are handed
+// to the reader in arrival order.
+class SocketFrameSource : public FrameSource {
+public:
+    enum Policy {
+        // Reuse the oldest pending frame when all buffers are full, so the
+        // volume always integrates the most recent data
+        DROP_OLDEST,
+        // Stop reading from the socket until a buffer is free, which pushes
+        // back on the sender
+        BLOCK
+    };
+
+    struct Stats {
+        size_t received = 0;
+        size_t dropped  = 0;
+        // Frames with a size that doesn't match the volume
+        size_t rejected = 0;
+        size_t pending  = 0;
+        bool   connected = false;
+    };
+
+    // Listens on 'address', see openFrameSocket()
+    SocketFrameSource(const std::string &address, glm::uvec2 frame_size,
+                      int queue_size = 4, Policy policy = DROP_OLDEST);
+    ~SocketFrameSource();
+
+    bool read(Frame *frame) override;
+
+    void setPolicy(Policy policy);
+    Policy getPolicy() const;
+
+    Stats getStats() const;
+private:
+    void receiveLoop();
+    Frame *acquireBuffer();
+    bool receiveFrame(int fd, Frame *frame, bool *valid);
+
+    std::string _address;
+    glm::uvec2  _frame_size;
+    Policy      _policy;
+
+    int _listen_fd = -1;
+    int _client_fd = -1;
+
+    std::vector<Frame> _buffers;
+    std::vector<Frame *> _free;
+    // Received frames, oldest first
+    std::deque<Frame *> _ready;
+    Stats _stats;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _quit = false;
+    std::thread _thread;
+};
@@ -0,0 +1,595 @@
+#include "submap_manager.hpp"
+
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+#include "block_store.hpp"
+#include "point_cloud.hpp"
+#include "profiler.hpp"
+#include "volume.hpp"
+#include "volume_readback.hpp"
+
+// Blocks read back by a single readback, 16 MB of pixel buffer
+const int    FREEZE_CHUNK_BLOCKS = 64;
+// Bytes per voxel of a frozen block before compression: tsdf as a float,
+// weight as uint16 and RGB8 color
+const size_t FROZEN_VOXEL_SIZE = 4 + 2 + 3;
+const size_t FROZEN_BLOCK_SIZE =
+    size_t(BLOCK_SIZE) * BLOCK_SIZE * BLOCK_SIZE * FROZEN_VOXEL_SIZE;
+
+
+static int
+floorDiv(int a, int b)
+{
+    return (a >= 0 ? a : a - b + 1) / b;
+}
+
+SubmapManager::SubmapManager(Volume *volume, VolumeReadback *readback,
+                             int max_frames, float max_distance,
+                             size_t memory_budget) :
+    _volume(volume),
+    _readback(readback),
+    _max_frames(max_frames),
+    _max_distance(max_distance),
+    _memory_budget(memory_budget)
+{
+    _base_model = _volume->getModel();
+    for (int level = 0; level < _volume->getLevels(); ++level)
+        _voxel_to_submap.push_back(glm::inverse(_base_model) *
+                                   _volume->getVoxelToModel(level));
+    _worker = std::thread(&SubmapManager::workerLoop, this);
+}
+
+SubmapManager::~SubmapManager()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_all();
+    _worker.join();
+}
+
+bool
+SubmapManager::integrateBatch(const unsigned short *const *depth_data,
+                              const unsigned char  *const *color_data,
+                              const glm::mat3 &intrinsic,
+                              const glm::mat4 *extrinsics,
+                              int count)
+{
+    if (count <= 0)
+        return true;
+
+    // New submaps keep the same placement relative to the camera that the
+    // first one had, so the volume always starts around the sensor
+    glm::mat4 camera = glm::inverse(extrinsics[0]);
+    if (_submaps.empty()) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _submaps.emplace_back();
+        _submaps.back().pose = _base_model;
+        _submaps.back().anchor = camera;
+        _submaps.back().levels.resize(_volume->getLevels());
+        _start_pending = false;
+    } else {
+        const Submap &active = _submaps.back();
+        float distance = glm::distance(glm::vec3(camera[3]),
+                                       glm::vec3(active.anchor[3]));
+        if (!_freezing &&
+            (_start_pending ||
+             (_max_frames > 0 && active.frames >= _max_frames) ||
+             (_max_distance > 0.0f && distance >= _max_distance))) {
+            _freezing = true;
+            _next_level = 0;
+        }
+        if (_freezing) {
+            if (!continueFreeze())
+                return false;
+            finishFreeze();
+            // The copies of the old blocks were issued before the reset
+            _volume->reset();
+            std::lock_guard<std::mutex> lock(_mutex);
+            glm::mat4 pose = camera * glm::inverse(active.anchor) *
+                             active.pose;
+            _submaps.emplace_back();
+            _submaps.back().pose = pose;
+            _submaps.back().anchor = camera;
+            _submaps.back().levels.resize(_volume->getLevels());
+            _start_pending = false;
+        }
+    }
+    _volume->setModel(_submaps.back().pose);
+
+    _volume->integrateBatch(depth_data, color_data, intrinsic, extrinsics,
+                            count);
+    _submaps.back().frames += count;
+    return true;
+}
+
+// Start reading back which blocks of a level hold observed voxels. Returns
+// false if it doesn't fit in the readback memory budget right now.
+bool
+SubmapManager::startLevel(int level)
+{
+    int generation = _generation;
+    glm::ivec3 origin = _volume->getOrigin(level);
+    if (glm::any(glm::notEqual(origin % BLOCK_SIZE, glm::ivec3(0)))) {
+        // Without a block store the volume rolls by less than a block and
+        // its observed blocks aren't tracked. Every block is read back, the
+        // empty ones are dropped when compressing them.
+        glm::ivec3 dims = _volume->getDims();
+        glm::ivec3 begin, end, b;
+        for (int i = 0; i < 3; ++i) {
+            begin[i] = floorDiv(origin[i], BLOCK_SIZE);
+            end[i] = floorDiv(origin[i] + dims[i] - 1, BLOCK_SIZE) + 1;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (b.z = begin.z; b.z < end.z; ++b.z)
+        for (b.y = begin.y; b.y < end.y; ++b.y)
+        for (b.x = begin.x; b.x < end.x; ++b.x) {
+            if (_chunks.empty() || _chunks.back().level != level ||
+                int(_chunks.back().blocks.size()) == FREEZE_CHUNK_BLOCKS)
+                _chunks.push_back({level, {}});
+            _chunks.back().blocks.push_back(b);
+        }
+        return true;
+    }
+
+    // The callback only runs after the next poll(), once the level has been
+    // counted
+    auto callback = [this, generation](const VolumeReadback::Result &result) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (generation != _generation)
+            return;
+        for (size_t i = 0; i < result.blocks.size(); ++i) {
+            if (i % FREEZE_CHUNK_BLOCKS == 0)
+                _chunks.push_back({result.level, {}});
+            _chunks.back().blocks.push_back(result.blocks[i]);
+        }
+        --_pending_levels;
+    };
+    if (!_readback->startObservedBlocks(level, callback))
+        return false;
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_pending_levels;
+    return true;
+}
+
+// Issue the readbacks of the active submap that fit in the memory budget.
+// Returns true once every one of them has been issued.
+bool
+SubmapManager::continueFreeze()
+{
+    PROFILE_SCOPE("SubmapManager::continueFreeze");
+    for (; _next_level < _volume->getLevels(); ++_next_level)
+        if (!startLevel(_next_level))
+            return false;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_chunks.empty()) {
+        Chunk chunk = std::move(_chunks.front());
+        _chunks.pop_front();
+        lock.unlock();
+        bool started = startChunk(chunk);
+        lock.lock();
+        if (started)
+            continue;
+        // Wait for the pending readbacks to free their buffers, unless
+        // there are none
+        if (_readback->getPending() > 0) {
+            _chunks.push_front(std::move(chunk));
+            return false;
+        }
+        std::cerr << "Failed to freeze " << chunk.blocks.size()
+                  << " blocks of submap " << _submaps.size() - 1 << std::endl;
+    }
+    return _pending_levels == 0;
+}
+
+// The blocks are clipped to the volume, which only matters when it isn't
+// aligned to them
+bool
+SubmapManager::startChunk(const Chunk &chunk)
+{
+    glm::ivec3 dims = _volume->getDims();
+    glm::ivec3 origin = _volume->getOrigin(chunk.level);
+    std::vector<glm::ivec3> firsts, sizes;
+    for (const glm::ivec3 &block : chunk.blocks) {
+        glm::ivec3 first = glm::max(block * BLOCK_SIZE, origin);
+        glm::ivec3 last = glm::min(block * BLOCK_SIZE + BLOCK_SIZE,
+                                   origin + dims);
+        firsts.push_back(first);
+        sizes.push_back(last - first);
+    }
+
+    int submap = int(_submaps.size()) - 1;
+    int generation = _generation;
+    auto callback = [this, submap, generation]
+                    (const VolumeReadback::Result &result) {
+        for (const VolumeReadback::Region &region : result.regions) {
+            Job job;
+            job.type = COMPRESS;
+            job.submap = submap;
+            job.generation = generation;
+            job.level = result.level;
+            for (int i = 0; i < 3; ++i)
+                job.block[i] = floorDiv(region.first[i], BLOCK_SIZE);
+            job.offset = region.first - job.block * BLOCK_SIZE;
+            job.size = region.size;
+            job.format = result.format;
+            job.data.assign(region.data, region.data +
+                            size_t(region.size.x) * region.size.y *
+                            region.size.z * 8);
+            queueBlock(std::move(job), false);
+        }
+    };
+    return _readback->startRegions(firsts.data(), sizes.data(),
+                                   int(firsts.size()), chunk.level, callback);
+}
+
+// Hand the blocks evicted to the block store over to the worker, they have
+// to be taken before the volume is reset
+void
+SubmapManager::finishFreeze()
+{
+    PROFILE_SCOPE("SubmapManager::finishFreeze");
+    int submap = int(_submaps.size()) - 1;
+    int generation = _generation;
+    BlockStore *block_store = _volume->getBlockStore();
+    if (block_store) {
+        for (int level = 0; level < _volume->getLevels(); ++level) {
+            for (const glm::ivec3 &block : block_store->list(level)) {
+                Job job;
+                job.type = COMPRESS;
+                job.submap = submap;
+                job.generation = generation;
+                job.level = level;
+                job.block = block;
+                job.offset = glm::ivec3(0);
+                job.size = glm::ivec3(BLOCK_SIZE);
+                job.format = _volume->getVoxelFormat();
+                // Already in host memory, so they are queued regardless of
+                // the budget
+                if (block_store->take(level, block, &job.data))
+                    queueBlock(std::move(job), true);
+            }
+        }
+    }
+
+    // Runs after the callbacks of every chunk
+    _readback->startRegions(nullptr, nullptr, 0, 0,
+        [this, submap, generation](const VolumeReadback::Result &) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (generation != _generation)
+                    return;
+                _submaps[submap].frozen = true;
+                if (_auto_export) {
+                    Job job;
+                    job.type = EXPORT;
+                    job.submap = submap;
+                    job.generation = generation;
+                    _jobs.push_back(std::move(job));
+                }
+            }
+            _cond.notify_all();
+        });
+    _freezing = false;
+}
+
+// Never waits for the worker: once the queued blocks exceed the memory
+// budget the caller compresses the block itself, unless 'force' is set
+void
+SubmapManager::queueBlock(Job job, bool force)
+{
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (job.generation != _generation)
+            return;
+        if (force || _queued_bytes + job.data.size() <= _memory_budget) {
+            _queued_bytes += job.data.size();
+            _jobs.push_back(std::move(job));
+            queued = true;
+        }
+    }
+    if (queued)
+        _cond.notify_all();
+    else
+        compress(job);
+}
+
+void
+SubmapManager::reset()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _jobs.clear();
+        _cond.wait(lock, [this] { return !_busy; });
+        _queued_bytes = 0;
+        ++_generation;
+        _chunks.clear();
+        _pending_levels = 0;
+        _submaps.clear();
+        _frozen_blocks = 0;
+        _compressed_bytes = 0;
+        _start_pending = false;
+    }
+    _cond.notify_all();
+    _freezing = false;
+    _volume->reset();
+    _volume->setModel(_base_model);
+}
+
+int
+SubmapManager::getSubmapCount() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return int(_submaps.size());
+}
+
+void
+SubmapManager::setPose(int submap, const glm::mat4 &pose)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _submaps.at(submap).pose = pose;
+    if (submap == int(_submaps.size()) - 1)
+        _volume->setModel(pose);
+}
+
+glm::mat4
+SubmapManager::getPose(int submap) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _submaps.at(submap).pose;
+}
+
+void
+SubmapManager::setExportPath(const std::string &path, bool auto_export)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _export_path = path;
+    _auto_export = auto_export;
+}
+
+void
+SubmapManager::exportFrozen()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (int i = 0; i < int(_submaps.size()); ++i) {
+            if (!_submaps[i].frozen)
+                continue;
+            Job job;
+            job.type = EXPORT;
+            job.submap = i;
+            job.generation = _generation;
+            _jobs.push_back(std::move(job));
+        }
+    }
+    _cond.notify_all();
+}
+
+SubmapManager::Stats
+SubmapManager::getStats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Stats stats;
+    stats.submaps = int(_submaps.size());
+    stats.frozen_blocks = _frozen_blocks;
+    stats.compressed_bytes = _compressed_bytes;
+    stats.pending_jobs = _jobs.size() + (_busy ? 1 : 0);
+    return stats;
+}
+
+void
+SubmapManager::workerLoop()
+{
+    Profiler::setThreadName("Submaps");
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _quit || !_jobs.empty(); });
+            if (_quit)
+                return;
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+            _busy = true;
+        }
+
+        switch (job.type) {
+        case COMPRESS: compress(job);           break;
+        case EXPORT:   exportSubmap(job.submap); break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (job.type == COMPRESS)
+                _queued_bytes -= job.data.size();
+            _busy = false;
+        }
+        _cond.notify_all();
+    }
+}
+
+void
+SubmapManager::compress(const Job &job)
+{
+    PROFILE_SCOPE("SubmapManager::compress");
+    BrickedGrid<Voxel> grid;
+    grid.resize(glm::ivec3(BLOCK_SIZE));
+    Volume::decodeRegion(job.format, job.data.data(), job.size, &grid,
+                         job.offset);
+    bool observed = false;
+    for (const Voxel &voxel : grid)
+        observed = observed || voxel.weight;
+    if (!observed)
+        return;
+
+    std::vector<unsigned char> data(FROZEN_BLOCK_SIZE);
+    unsigned char *out = data.data();
+    glm::ivec3 p;
+    for (p.z = 0; p.z < BLOCK_SIZE; ++p.z)
+    for (p.y = 0; p.y < BLOCK_SIZE; ++p.y)
+    for (p.x = 0; p.x < BLOCK_SIZE; ++p.x) {
+        const Voxel &voxel = grid.at(p);
+        std::memcpy(out, &voxel.tsdf, 4);
+        std::memcpy(out + 4, &voxel.weight, 2);
+        std::memcpy(out + 6, voxel.color, 3);
+        out += FROZEN_VOXEL_SIZE;
+    }
+
+    uLongf size = compressBound(data.size());
+    std::vector<unsigned char> compressed(size);
+    if (compress2(compressed.data(), &size,
+                  data.data(), data.size(), Z_BEST_SPEED) != Z_OK) {
+        std::cerr << "Failed to compress submap block" << std::endl;
+        return;
+    }
+    compressed.resize(size);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (job.generation != _generation)
+        return;
+    _submaps[job.submap].levels[job.level][BlockKey(job.block.z, job.block.y,
+                                                    job.block.x)] =
+        std::move(compressed);
+    ++_frozen_blocks;
+    _compressed_bytes += size;
+}
+
+static bool
+decompress(const std::vector<unsigned char> &compressed,
+           BrickedGrid<Voxel> *grid)
+{
+    std::vector<unsigned char> data(FROZEN_BLOCK_SIZE);
+    uLongf size = data.size();
+    if (uncompress(data.data(), &size,
+                   compressed.data(), compressed.size()) != Z_OK ||
+        size != data.size())
+        return false;
+
+    grid->resize(glm::ivec3(BLOCK_SIZE));
+    const unsigned char *in = data.data();
+    glm::ivec3 p;
+    for (p.z = 0; p.z < BLOCK_SIZE; ++p.z)
+    for (p.y = 0; p.y < BLOCK_SIZE; ++p.y)
+    for (p.x = 0; p.x < BLOCK_SIZE; ++p.x) {
+        Voxel &voxel = grid->at(p);
+        std::memcpy(&voxel.tsdf, in, 4);
+        std::memcpy(&voxel.weight, in + 4, 2);
+        std::memcpy(voxel.color, in + 6, 3);
+        in += FROZEN_VOXEL_SIZE;
+    }
+    return true;
+}
+
+// The blocks of a frozen submap are only written before its export is
+// queued, so they can be read here without holding the lock
+void
+SubmapManager::exportSubmap(int submap)
+{
+    PROFILE_SCOPE("SubmapManager::exportSubmap");
+    std::string base, extension;
+    glm::mat4 pose;
+    const std::vector<FrozenBlocks> *frozen;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_export_path.empty())
+            return;
+        size_t dot = _export_path.rfind('.');
+        if (dot == std::string::npos)
+            dot = _export_path.size();
+        base = _export_path.substr(0, dot) + "_" + std::to_string(submap);
+        extension = _export_path.substr(dot);
+        pose = _submaps[submap].pose;
+        frozen = &_submaps[submap].levels;
+    }
+
+    // Coarser levels go to "<path>_<submap>_level<level>.<extension>"
+    for (int level = 0; level < int(frozen->size()); ++level) {
+        if ((*frozen)[level].empty())
+            continue;
+        std::string path = base;
+        if (level > 0)
+            path += "_level" + std::to_string(level);
+        exportLevel(path + extension, pose * _voxel_to_submap[level],
+                    (*frozen)[level]);
+    }
+}
+
+void
+SubmapManager::exportLevel(const std::string &path,
+                           const glm::mat4 &voxel_to_world,
+                           const FrozenBlocks &blocks)
+{
+    // Decoded blocks of the slices around the current one, so every block
+    // is decompressed once while its neighbours provide the apron
+    std::map<BlockKey, std::unique_ptr<BrickedGrid<Voxel>>> window;
+    auto decoded = [&](glm::ivec3 b) -> const BrickedGrid<Voxel> * {
+        BlockKey key(b.z, b.y, b.x);
+        auto it = window.find(key);
+        if (it != window.end())
+            return it->second.get();
+        auto block_it = blocks.find(key);
+        std::unique_ptr<BrickedGrid<Voxel>> grid;
+        if (block_it != blocks.end()) {
+            grid.reset(new BrickedGrid<Voxel>());
+            if (!decompress(block_it->second, grid.get())) {
+                std::cerr << "Failed to decompress submap block" << std::endl;
+                grid.reset();
+            }
+        }
+        return window.emplace(key, std::move(grid)).first->second.get();
+    };
+
+    auto next = blocks.begin();
+    auto source = [&](PointCloudExporter::Block *block) {
+        if (next == blocks.end())
+            return false;
+        glm::ivec3 b(std::get<2>(next->first), std::get<1>(next->first),
+                     std::get<0>(next->first));
+        ++next;
+        window.erase(window.begin(),
+                     window.lower_bound(BlockKey(b.z - 1, INT_MIN, INT_MIN)));
+
+        glm::ivec3 first = b * BLOCK_SIZE - 1;
+        glm::ivec3 size(BLOCK_SIZE + 2);
+        block->grid.reset(new BrickedGrid<Voxel>(size));
+        block->first = first;
+        block->own_begin = glm::ivec3(1);
+        block->own_end = glm::ivec3(BLOCK_SIZE + 1);
+
+        glm::ivec3 n;
+        for (n.z = -1; n.z <= 1; ++n.z)
+        for (n.y = -1; n.y <= 1; ++n.y)
+        for (n.x = -1; n.x <= 1; ++n.x) {
+            const BrickedGrid<Voxel> *grid = decoded(b + n);
+            if (!grid)
+                continue;
+            glm::ivec3 grid_first = (b + n) * BLOCK_SIZE;
+            glm::ivec3 lo = glm::max(grid_first, first);
+            glm::ivec3 hi = glm::min(grid_first + BLOCK_SIZE, first + size);
+            glm::ivec3 p;
+            for (p.z = lo.z; p.z < hi.z; ++p.z)
+            for (p.y = lo.y; p.y < hi.y; ++p.y)
+            for (p.x = lo.x; p.x < hi.x; ++p.x)
+                block->grid->at(p - first) = grid->at(p - grid_first);
+        }
+        return true;
+    };
+
+    try {
+        PointCloudExporter exporter(_memory_budget);
+        size_t points = exporter.exportBlocks(
+            path, PointCloudExporter::formatFromPath(path), source,
+            voxel_to_world);
+        std::cout << "Exported " << points << " points to '" << path << "'"
+                  << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "volume.hpp"
+
+class VolumeReadback;
+
+// Splits the reconstruction into submaps, each one a volume anchored to the
+// camera pose at the time it was started. Only the active submap lives on the
+// GPU: every so many frames or meters its blocks are read back and the volume
+// starts over as a new submap. Only the blocks with observed voxels are read
+// back, asynchronously and over as many frames as the readback memory budget
+// needs. The blocks of the frozen submap are compressed, and optionally
+// exported as a point cloud, by a background thread. Once that thread falls
+// behind the readback thread compresses the blocks itself, nothing ever
+// waits for it.
+//
+// The pose of a submap maps its own model space to the world. Correcting the
+// trajectory only moves the submaps, their voxels are never touched. Every
+// level of the volume is frozen, each level is exported on its own since the
+// coarser ones hold what the finer ones don't reach.
+class SubmapManager {
+public:
+    struct Stats {
+        int    submaps = 0;
+        size_t frozen_blocks = 0;
+        size_t compressed_bytes = 0;
+        // Blocks waiting to be compressed and submaps waiting to be exported
+        size_t pending_jobs = 0;
+    };
+
+    // 'max_frames' and 'max_distance' (camera travel in meters since the
+    // submap was started) trigger a new submap, zero disables either one.
+    // 'memory_budget' bounds the blocks waiting for the background thread.
+    // The volume and the readback must outlive the manager.
+    SubmapManager(Volume *volume, VolumeReadback *readback, int max_frames,
+                  float max_distance, size_t memory_budget);
+    ~SubmapManager();
+
+    SubmapManager(const SubmapManager &) = delete;
+    SubmapManager &operator=(const SubmapManager &) = delete;
+
+    // Same as Volume::integrateBatch(), the extrinsics map the world to the
+    // camera. Starts a new submap first if the active one is full. Returns
+    // false without integrating anything while the blocks of the active
+    // submap are still being read back, the batch must be passed again
+    // after the next VolumeReadback::poll().
+    bool integrateBatch(const unsigned short *const *depth_data,
+                        const unsigned char  *const *color_data,
+                        const glm::mat3 &intrinsic,
+                        const glm::mat4 *extrinsics,
+                        int count);
+    // Freeze the active submap with the next batch
+    void startSubmap() { _start_pending = true; }
+    // Drop every submap and start over with an empty volume
+    void reset();
+
+    int getSubmapCount() const;
+    // -1 before the first batch
+    int getActiveSubmap() const { return getSubmapCount() - 1; }
+    // Re-anchor a submap after a trajectory correction
+    void setPose(int submap, const glm::mat4 &pose);
+    glm::mat4 getPose(int submap) const;
+
+    void setMaxFrames(int max_frames) { _max_frames = max_frames; }
+    int getMaxFrames() const { return _max_frames; }
+    void setMaxDistance(float max_distance) { _max_distance = max_distance; }
+    float getMaxDistance() const { return _max_distance; }
+
+    // Frozen submaps are exported to "<path>_<submap>.<extension>", where
+    // the extension picks the format, see PointCloudExporter. With auto
+    // export every submap is exported as soon as it's frozen.
+    void setExportPath(const std::string &path, bool auto_export);
+    // Export every frozen submap again, with their current poses. Submaps
+    // still being frozen are skipped.
+    void exportFrozen();
+
+    Stats getStats() const;
+private:
+    // Block coordinates, z first so the blocks are walked slice by slice
+    typedef std::tuple<int, int, int> BlockKey;
+
+    typedef std::map<BlockKey, std::vector<unsigned char>> FrozenBlocks;
+
+    struct Submap {
+        glm::mat4 pose;
+        // Camera to world when the submap was started
+        glm::mat4 anchor;
+        int       frames = 0;
+        // Set once every block has been compressed or queued
+        bool      frozen = false;
+        // zlib compressed blocks of every level with at least one observed
+        // voxel, empty until the submap is frozen
+        std::vector<FrozenBlocks> levels;
+    };
+
+    enum JobType {
+        COMPRESS,
+        EXPORT
+    };
+
+    struct Job {
+        JobType    type;
+        int        submap;
+        // See _generation
+        int        generation;
+        // Raw block data for COMPRESS jobs, see Volume::decodeRegion(). Only
+        // the blocks on the border of a volume not aligned to them are
+        // partial, 'size' voxels starting at 'offset' inside the block.
+        int        level;
+        glm::ivec3 block;
+        glm::ivec3 offset;
+        glm::ivec3 size;
+        Volume::VoxelFormat format;
+        std::vector<unsigned char> data;
+    };
+
+    // Blocks of a level read back together
+    struct Chunk {
+        int        level;
+        std::vector<glm::ivec3> blocks;
+    };
+
+    bool startLevel(int level);
+    bool continueFreeze();
+    bool startChunk(const Chunk &chunk);
+    void finishFreeze();
+    void queueBlock(Job job, bool force);
+    void workerLoop();
+    void compress(const Job &job);
+    void exportSubmap(int submap);
+    void exportLevel(const std::string &path, const glm::mat4 &voxel_to_world,
+                     const FrozenBlocks &blocks);
+
+    Volume   *_volume;
+    VolumeReadback *_readback;
+    int       _max_frames;
+    float     _max_distance;
+    size_t    _memory_budget;
+    bool      _start_pending = false;
+
+    // Placement of the volume before any submap was started, and the map
+    // from global voxel coordinates of every level to the model space of a
+    // submap
+    glm::mat4 _base_model;
+    std::vector<glm::mat4> _voxel_to_submap;
+
+    // Freeze in progress and the next level whose observed blocks have to
+    // be read back
+    bool      _freezing = false;
+    int       _next_level = 0;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Job> _jobs;
+    bool   _busy = false;
+    bool   _quit = false;
+    size_t _queued_bytes = 0;
+    // Incremented by reset(), so the readbacks and jobs of the dropped
+    // submaps are ignored
+    int    _generation = 0;
+    // Chunks of the freeze in progress, added by the readback thread as the
+    // observed blocks of every level arrive
+    std::deque<Chunk> _chunks;
+    int    _pending_levels = 0;
+    std::thread _worker;
+
+    // Only appended to while the worker runs, so references stay valid
+    std::deque<Submap> _submaps;
+    size_t _frozen_blocks = 0;
+    size_t _compressed_bytes = 0;
+    std::string _export_path;
+    bool   _auto_export = false;
+};
@@ -0,0 +1,246 @@
+// Times the host voxel access patterns of the readback path on a BrickedGrid
+// against a plain x-fastest array of the same voxels: a sweep of every voxel,
+// central difference gradients and the 26-neighbour zero-crossing test of
+// surface extraction. The bricked grid is walked both with x, y, z loops and
+// in storage order. Every pattern runs a few times and the best time is
+// reported.
+//
+// Usage: sfm_bench_layout [size] [repeats]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../voxel_grid.hpp"
+
+
+// Same interface as BrickedGrid for the accesses below, x-fastest
+template <typename T>
+class LinearGrid {
+public:
+    explicit LinearGrid(glm::ivec3 dims) :
+        _dims(dims),
+        _data(size_t(dims.x) * dims.y * dims.z)
+    {
+    }
+
+    glm::ivec3 dims() const { return _dims; }
+    T &at(glm::ivec3 p) { return _data[index(p)]; }
+    const T &at(glm::ivec3 p) const { return _data[index(p)]; }
+
+    size_t index(glm::ivec3 p) const {
+        return (size_t(p.z) * _dims.y + p.y) * _dims.x + p.x;
+    }
+private:
+    glm::ivec3     _dims;
+    std::vector<T> _data;
+};
+
+// Sphere filling most of the grid, truncated like the integrator does
+template <typename Grid>
+static void
+fillSphere(Grid *grid)
+{
+    glm::ivec3 dims = grid->dims();
+    glm::vec3 center = glm::vec3(dims) * 0.5f;
+    float radius = dims.x * 0.35f;
+    float trunc_margin = 4.0f;
+    for (int z = 0; z < dims.z; ++z)
+    for (int y = 0; y < dims.y; ++y)
+    for (int x = 0; x < dims.x; ++x) {
+        glm::vec3 p(x, y, z);
+        float sdf = radius - glm::length(p - center);
+        Voxel &voxel = grid->at(glm::ivec3(x, y, z));
+        voxel.tsdf = glm::clamp(sdf / trunc_margin, -1.0f, 1.0f);
+        voxel.weight = sdf > -trunc_margin ? 1 : 0;
+    }
+}
+
+template <typename Grid>
+static double
+sweep(const Grid &grid)
+{
+    glm::ivec3 dims = grid.dims();
+    double sum = 0.0;
+    for (int z = 0; z < dims.z; ++z)
+    for (int y = 0; y < dims.y; ++y)
+    for (int x = 0; x < dims.x; ++x)
+        sum += grid.at(glm::ivec3(x, y, z)).tsdf;
+    return sum;
+}
+
+template <typename Grid>
+static double
+gradientAt(const Grid &grid, glm::ivec3 p)
+{
+    glm::vec3 g;
+    for (int axis = 0; axis < 3; ++axis) {
+        glm::ivec3 a = p, b = p;
+        a[axis] -= 1;
+        b[axis] += 1;
+        g[axis] = grid.at(b).tsdf - grid.at(a).tsdf;
+    }
+    return glm::length(g);
+}
+
+template <typename Grid>
+static double
+gradients(const Grid &grid)
+{
+    glm::ivec3 dims = grid.dims();
+    double sum = 0.0;
+    for (int z = 1; z < dims.z - 1; ++z)
+    for (int y = 1; y < dims.y - 1; ++y)
+    for (int x = 1; x < dims.x - 1; ++x)
+        sum += gradientAt(grid, glm::ivec3(x, y, z));
+    return sum;
+}
+
+template <typename Grid>
+static bool
+crossesSurface(const Grid &grid, glm::ivec3 p)
+{
+    const Voxel &voxel = grid.at(p);
+    if (voxel.weight == 0)
+        return false;
+    for (int dz = -1; dz <= 1; ++dz)
+    for (int dy = -1; dy <= 1; ++dy)
+    for (int dx = -1; dx <= 1; ++dx) {
+        const Voxel &n = grid.at(p + glm::ivec3(dx, dy, dz));
+        if (n.weight != 0 && (n.tsdf < 0.0f) != (voxel.tsdf < 0.0f))
+            return true;
+    }
+    return false;
+}
+
+template <typename Grid>
+static double
+zeroCrossings(const Grid &grid)
+{
+    glm::ivec3 dims = grid.dims();
+    double count = 0.0;
+    for (int z = 1; z < dims.z - 1; ++z)
+    for (int y = 1; y < dims.y - 1; ++y)
+    for (int x = 1; x < dims.x - 1; ++x)
+        count += crossesSurface(grid, glm::ivec3(x, y, z));
+    return count;
+}
+
+// The same patterns following the storage order of the bricked grid
+static double
+sweepStorage(const BrickedGrid<Voxel> &grid)
+{
+    double sum = 0.0;
+    for (const Voxel &voxel : grid)
+        sum += voxel.tsdf;
+    return sum;
+}
+
+static bool
+isInterior(const BrickedGrid<Voxel> &grid, glm::ivec3 p)
+{
+    return glm::all(glm::greaterThan(p, glm::ivec3(0))) &&
+           glm::all(glm::lessThan(p, grid.dims() - 1));
+}
+
+static double
+gradientsStorage(const BrickedGrid<Voxel> &grid)
+{
+    double sum = 0.0;
+    for (auto it = grid.begin(); it != grid.end(); ++it)
+        if (isInterior(grid, it.coord()))
+            sum += gradientAt(grid, it.coord());
+    return sum;
+}
+
+static double
+zeroCrossingsStorage(const BrickedGrid<Voxel> &grid)
+{
+    double count = 0.0;
+    for (auto it = grid.begin(); it != grid.end(); ++it)
+        if (isInterior(grid, it.coord()))
+            count += crossesSurface(grid, it.coord());
+    return count;
+}
+
+// Best time of 'repeats' runs, in seconds. The result is checked against the
+// other layouts, so no layout can skip work.
+static double
+timeRuns(const std::function<double()> &run, int repeats, double *result)
+{
+    using Clock = std::chrono::steady_clock;
+    double best = 1e30;
+    for (int i = 0; i < repeats; ++i) {
+        Clock::time_point start = Clock::now();
+        *result = run();
+        best = std::min(best, std::chrono::duration<double>(
+            Clock::now() - start).count());
+    }
+    return best;
+}
+
+int
+main(int argc, char **argv)
+{
+    int size = argc > 1 ? std::atoi(argv[1]) : 256;
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 5;
+    if (size < 3 || repeats < 1) {
+        std::cerr << "Usage: " << argv[0] << " [size] [repeats]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    glm::ivec3 dims(size);
+    LinearGrid<Voxel> linear(dims);
+    BrickedGrid<Voxel> bricked(dims);
+    fillSphere(&linear);
+    fillSphere(&bricked);
+    double voxels = double(size) * size * size;
+    std::printf("%d^3 voxels, %zu bytes each, best of %d runs\n",
+                size, sizeof(Voxel), repeats);
+
+    struct Pattern {
+        const char *name;
+        std::function<double()> linear;
+        std::function<double()> bricked;
+        std::function<double()> storage;
+    } patterns[] = {
+        {"sweep",
+         [&] { return sweep(linear); },
+         [&] { return sweep(bricked); },
+         [&] { return sweepStorage(bricked); }},
+        {"gradients",
+         [&] { return gradients(linear); },
+         [&] { return gradients(bricked); },
+         [&] { return gradientsStorage(bricked); }},
+        {"zero crossings",
+         [&] { return zeroCrossings(linear); },
+         [&] { return zeroCrossings(bricked); },
+         [&] { return zeroCrossingsStorage(bricked); }},
+    };
+
+    bool ok = true;
+    std::printf("%-16s %14s %14s %14s\n", "ns per voxel", "linear",
+                "bricked xyz", "bricked order");
+    for (const Pattern &p : patterns) {
+        double a, b, c;
+        double ta = timeRuns(p.linear, repeats, &a);
+        double tb = timeRuns(p.bricked, repeats, &b);
+        double tc = timeRuns(p.storage, repeats, &c);
+        // Sums in a different order round differently
+        double tolerance = 1e-6 * std::max(1.0, std::fabs(a));
+        bool same = std::fabs(a - b) <= tolerance &&
+                    std::fabs(a - c) <= tolerance;
+        ok &= same;
+        std::printf("%-16s %14.3f %14.3f %14.3f%s\n", p.name,
+                    ta * 1e9 / voxels, tb * 1e9 / voxels, tc * 1e9 / voxels,
+                    same ? "" : "  RESULTS DIFFER");
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
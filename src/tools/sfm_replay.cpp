@@ -0,0 +1,96 @@
+// Replays a dataset directory, in any layout known to openDataset(), over a
+// socket as if it came from a live capture rig, to exercise the socket ingest
+// path of the viewer.
+//
+// Usage: sfm_replay <dataset_dir> <address> [fps] [frame_count]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <glm/glm.hpp>
+
+#include "../dataset_source.hpp"
+#include "../frame_protocol.hpp"
+
+
+const glm::uvec2 FRAME_SIZE = {640, 480};
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <dataset_dir> <address> [fps] [frame_count]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string address = argv[2];
+    float fps = argc > 3 ? std::atof(argv[3]) : 30.0f;
+    int frame_count = argc > 4 ? std::atoi(argv[4]) : 1000;
+
+    FrameSource *dataset;
+    try {
+        dataset = openDataset(argv[1], FRAME_SIZE, frame_count);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int fd = openFrameSocket(address, false);
+    if (fd < 0) {
+        delete dataset;
+        return EXIT_FAILURE;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration interval = fps > 0.0f ?
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<float>(1.0f / fps)) :
+        Clock::duration::zero();
+    Clock::time_point next = Clock::now();
+
+    Frame frame;
+    int sent = 0;
+    while (sent < frame_count && dataset->read(&frame)) {
+
+        FrameHeader header = {};
+        header.magic       = FRAME_MAGIC;
+        header.version     = FRAME_VERSION;
+        header.flags       = frame.has_intrinsic ? FRAME_HAS_INTRINSIC : 0;
+        header.width       = FRAME_SIZE.x;
+        header.height      = FRAME_SIZE.y;
+        header.depth_bytes = uint32_t(frame.depth.size() * 2);
+        header.color_bytes = uint32_t(frame.color.size());
+        // Back to the row major camera to world matrix of the pose files
+        glm::mat4 pose = glm::transpose(glm::inverse(frame.extrinsic));
+        for (int i = 0; i < 16; ++i)
+            header.pose[i] = pose[i / 4][i % 4];
+        for (int i = 0; i < 9; ++i)
+            header.intrinsic[i] = frame.intrinsic[i / 3][i % 3];
+
+        std::this_thread::sleep_until(next);
+        next += interval;
+
+        if (!sendAll(fd, &header, sizeof(header)) ||
+            !sendAll(fd, frame.depth.data(), header.depth_bytes) ||
+            !sendAll(fd, frame.color.data(), header.color_bytes)) {
+            std::cerr << "Connection to '" << address << "' lost after "
+                      << sent << " frames" << std::endl;
+            closeFrameSocket(fd);
+            delete dataset;
+            return EXIT_FAILURE;
+        }
+        ++sent;
+    }
+
+    std::cout << "Sent " << sent << " frames to '" << address << "'"
+              << std::endl;
+    closeFrameSocket(fd);
+    delete dataset;
+    return EXIT_SUCCESS;
+}
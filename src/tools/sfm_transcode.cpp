@@ -0,0 +1,133 @@
+// Transcodes the depth PNGs of a dataset directory to the .sfmd format of
+// depth_codec.hpp, which the viewer loads in their place, see loadDepth().
+// Every image is decoded back and compared before it's written next to its
+// PNG, which is left untouched. The PNGs are frame-XXXXXX.depth.png for
+// directory datasets, or every PNG in the depth subdirectory of TUM RGB-D,
+// ICL-NUIM and ScanNet sequences.
+//
+// Usage: sfm_transcode <dataset_dir> [frame_count]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+#include "../depth_codec.hpp"
+#include "../stb_image.h"
+
+
+// Depth PNGs of the dataset, 'frame_count' bounds the directory datasets
+static std::vector<std::string>
+listDepthImages(const std::string &dir, int frame_count)
+{
+    std::vector<std::string> filenames;
+    std::string depth_dir = dir + "/depth";
+    if (DIR *d = opendir(depth_dir.c_str())) {
+        while (dirent *entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 &&
+                name.compare(name.size() - 4, 4, ".png") == 0)
+                filenames.push_back(depth_dir + "/" + name);
+        }
+        closedir(d);
+        std::sort(filenames.begin(), filenames.end());
+        return filenames;
+    }
+
+    for (int n = 0; n < frame_count; ++n) {
+        char frame_number[7];
+        std::snprintf(frame_number, sizeof(frame_number), "%06d", n);
+        filenames.push_back(dir + "/frame-" + frame_number + ".depth.png");
+    }
+    return filenames;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <dataset_dir> [frame_count]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string dir = argv[1];
+    int frame_count = argc > 2 ? std::atoi(argv[2]) : 1000;
+
+    using Clock = std::chrono::steady_clock;
+    double png_seconds = 0.0, decode_seconds = 0.0;
+    size_t raw_bytes = 0, png_bytes = 0, encoded_bytes = 0;
+    int transcoded = 0;
+
+    std::vector<unsigned char> encoded;
+    std::vector<unsigned short> decoded;
+    for (const std::string &png_filename : listDepthImages(dir, frame_count)) {
+        FILE *png_file = std::fopen(png_filename.c_str(), "rb");
+        if (!png_file)
+            continue;
+        std::fseek(png_file, 0, SEEK_END);
+        png_bytes += std::ftell(png_file);
+        std::fclose(png_file);
+
+        int width = 0, height = 0, channels = 0;
+        Clock::time_point start = Clock::now();
+        unsigned short *depth = stbi_load_16(
+            png_filename.c_str(), &width, &height, &channels, 0);
+        png_seconds += std::chrono::duration<double>(
+            Clock::now() - start).count();
+        if (!depth || channels != 1) {
+            std::cerr << "Failed to read depth image from file '"
+                      << png_filename << "'. Skipping frame..." << std::endl;
+            stbi_image_free(depth);
+            continue;
+        }
+
+        encodeDepth(depth, width, height, &encoded);
+
+        int decoded_width = 0, decoded_height = 0;
+        start = Clock::now();
+        bool ok = decodeDepth(encoded.data(), encoded.size(),
+                              &decoded_width, &decoded_height, &decoded);
+        decode_seconds += std::chrono::duration<double>(
+            Clock::now() - start).count();
+        ok = ok && decoded_width == width && decoded_height == height &&
+             std::equal(decoded.begin(), decoded.end(), depth);
+        if (!ok) {
+            std::cerr << "Round trip of '" << png_filename
+                      << "' doesn't match, not transcoded" << std::endl;
+            stbi_image_free(depth);
+            continue;
+        }
+
+        std::string sfmd_filename =
+            png_filename.substr(0, png_filename.size() - 4) + ".sfmd";
+        if (!writeDepthFile(sfmd_filename, depth, width, height)) {
+            std::cerr << "Failed to write '" << sfmd_filename << "'"
+                      << std::endl;
+            stbi_image_free(depth);
+            return EXIT_FAILURE;
+        }
+        stbi_image_free(depth);
+
+        raw_bytes += size_t(width) * height * 2;
+        encoded_bytes += encoded.size();
+        ++transcoded;
+    }
+
+    if (transcoded == 0) {
+        std::cerr << "No depth images found in '" << dir << "'" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::printf("Transcoded %d depth images\n", transcoded);
+    std::printf("PNG:  %.1f MB, %.0f MB/s decode\n",
+                png_bytes / 1e6, raw_bytes / png_seconds / 1e6);
+    std::printf("SFMD: %.1f MB, %.0f MB/s decode\n",
+                encoded_bytes / 1e6, raw_bytes / decode_seconds / 1e6);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+// Integrates a synthetic scene with the GPU integrator and with the CPU
+// reference, then compares the volumes voxel by voxel. Every voxel format is
+// checked with single frames and with batches, and every GPU run is repeated
+// to check that it's deterministic, and without depth culling to check that
+// culling leaves the volume bit for bit the same. The rendered depth maps of
+// the volume are also compared against the depth of the frames, and frames
+// are taken back out of the volume and moved to new poses through the frame
+// cache. Exits with a failure status if any check fails, so it can gate
+// changes to the integrator.
+//
+// Must run from the build directory so the shaders are found. A software
+// OpenGL 4.5 implementation is enough, e.g. LIBGL_ALWAYS_SOFTWARE=1 with
+// Mesa's llvmpipe.
+//
+// Usage: sfm_verify
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../frame_cache.hpp"
+#include "../reference_integrator.hpp"
+#include "../render_target.hpp"
+#include "../volume.hpp"
+
+
+const glm::ivec3 VOLUME_DIMS       = {128, 128, 128};
+const float      VOLUME_RESOLUTION = 0.02f;
+const glm::uvec2 FRAME_SIZE        = {320, 240};
+const int        FRAME_COUNT       = 12;
+
+// Sphere in the middle of the volume, resting on a floor
+const glm::vec3  SPHERE_CENTER     = {0.0f, 0.0f, 0.0f};
+const float      SPHERE_RADIUS     = 0.5f;
+const float      FLOOR_HEIGHT      = -0.5f;
+
+// Voxels are allowed to differ by a few units in the last place of their
+// storage format, and a small fraction of them may project to a neighbouring
+// pixel when the projection lands right between two pixels
+const float      HALF_TOLERANCE    = 4.0f / 1024.0f;
+const float      SNORM_TOLERANCE   = 4.0f / 32767.0f;
+const int        COLOR_TOLERANCE   = 2;
+const double     MAX_MISMATCHED    = 1e-3;
+
+// Rendered depth must be within two voxels of the frame depth for most of the
+// pixels where both have a surface
+const float      DEPTH_TOLERANCE   = 2.0f * VOLUME_RESOLUTION;
+const double     MIN_DEPTH_MATCHED = 0.95;
+
+struct SyntheticFrame {
+    std::vector<unsigned short> depth;
+    std::vector<unsigned char>  color;
+    glm::mat4 extrinsic;
+};
+
+static glm::mat3
+syntheticIntrinsic()
+{
+    glm::mat3 intrinsic(0.0f);
+    intrinsic[0][0] = 280.0f;
+    intrinsic[1][1] = 285.0f;
+    intrinsic[2][0] = FRAME_SIZE.x / 2.0f - 0.3f;
+    intrinsic[2][1] = FRAME_SIZE.y / 2.0f + 0.7f;
+    intrinsic[2][2] = 1.0f;
+    return intrinsic;
+}
+
+// Distance along 'dir' to the closest surface, or 0 if there is none
+static float
+traceScene(glm::vec3 origin, glm::vec3 dir)
+{
+    float t_min = 0.0f;
+
+    glm::vec3 oc = origin - SPHERE_CENTER;
+    float b = glm::dot(oc, dir);
+    float c = glm::dot(oc, oc) - SPHERE_RADIUS * SPHERE_RADIUS;
+    float disc = b * b - glm::dot(dir, dir) * c;
+    if (disc >= 0.0f) {
+        float t = (-b - std::sqrt(disc)) / glm::dot(dir, dir);
+        if (t > 0.0f)
+            t_min = t;
+    }
+
+    if (dir.y < 0.0f) {
+        float t = (FLOOR_HEIGHT - origin.y) / dir.y;
+        if (t > 0.0f && (t_min == 0.0f || t < t_min))
+            t_min = t;
+    }
+    return t_min;
+}
+
+// Camera on a circle around the sphere, looking at it
+static SyntheticFrame
+renderFrame(int n)
+{
+    float angle = 2.0f * float(M_PI) * n / FRAME_COUNT;
+    glm::vec3 eye(2.0f * std::sin(angle), 0.6f, 2.0f * std::cos(angle));
+    glm::vec3 forward = glm::normalize(SPHERE_CENTER - eye);
+    // Camera y points down and x right, like the datasets
+    glm::vec3 down = glm::normalize(glm::vec3(0.0f, -1.0f, 0.0f) -
+                                    forward * -forward.y);
+    glm::vec3 right = glm::cross(down, forward);
+
+    glm::mat4 pose(1.0f);
+    pose[0] = glm::vec4(right, 0.0f);
+    pose[1] = glm::vec4(down, 0.0f);
+    pose[2] = glm::vec4(forward, 0.0f);
+    pose[3] = glm::vec4(eye, 1.0f);
+
+    SyntheticFrame frame;
+    frame.extrinsic = glm::inverse(pose);
+    frame.depth.resize(FRAME_SIZE.x * FRAME_SIZE.y);
+    frame.color.resize(FRAME_SIZE.x * FRAME_SIZE.y * 3);
+
+    glm::mat3 inv_intrinsic = glm::inverse(syntheticIntrinsic());
+    for (unsigned y = 0; y < FRAME_SIZE.y; ++y)
+    for (unsigned x = 0; x < FRAME_SIZE.x; ++x) {
+        size_t i = y * FRAME_SIZE.x + x;
+        // Camera space ray with z = 1, so the distance is the depth
+        glm::vec3 ray = inv_intrinsic * glm::vec3(x, y, 1.0f);
+        glm::vec3 dir = glm::mat3(pose) * ray;
+        float depth = traceScene(eye, dir);
+        glm::vec3 hit = eye + dir * depth;
+
+        // Sprinkle both kinds of invalid samples
+        if (depth == 0.0f || (i * 7919) % 997 == 0)
+            frame.depth[i] = 0;
+        else if ((i * 104729) % 991 == 0)
+            frame.depth[i] = 65535;
+        else
+            frame.depth[i] = (unsigned short)std::lround(depth * 1000.0f);
+
+        glm::vec3 color = glm::clamp(hit * 0.5f + 0.5f, 0.0f, 1.0f);
+        frame.color[i * 3 + 0] = (unsigned char)(color.x * 255.0f);
+        frame.color[i * 3 + 1] = (unsigned char)(color.y * 255.0f);
+        frame.color[i * 3 + 2] = (unsigned char)(color.z * 255.0f);
+    }
+    return frame;
+}
+
+static void
+integrate(Volume *volume, ReferenceIntegrator *reference,
+          const std::vector<SyntheticFrame> &frames, int batch_size)
+{
+    glm::mat3 intrinsic = syntheticIntrinsic();
+    for (size_t first = 0; first < frames.size(); first += batch_size) {
+        int count = int(std::min(frames.size() - first, size_t(batch_size)));
+        const unsigned short *depth[MAX_BATCH_FRAMES];
+        const unsigned char  *color[MAX_BATCH_FRAMES];
+        glm::mat4 extrinsics[MAX_BATCH_FRAMES];
+        for (int i = 0; i < count; ++i) {
+            depth[i] = frames[first + i].depth.data();
+            color[i] = frames[first + i].color.data();
+            extrinsics[i] = frames[first + i].extrinsic;
+        }
+        if (volume)
+            volume->integrateBatch(depth, color, intrinsic, extrinsics, count);
+        if (reference)
+            reference->integrateBatch(depth, color, intrinsic, extrinsics,
+                                      count);
+    }
+}
+
+static void
+deintegrate(Volume *volume, const std::vector<SyntheticFrame> &frames,
+            int batch_size)
+{
+    glm::mat3 intrinsic = syntheticIntrinsic();
+    for (size_t first = 0; first < frames.size(); first += batch_size) {
+        int count = int(std::min(frames.size() - first, size_t(batch_size)));
+        const unsigned short *depth[MAX_BATCH_FRAMES];
+        const unsigned char  *color[MAX_BATCH_FRAMES];
+        glm::mat4 extrinsics[MAX_BATCH_FRAMES];
+        for (int i = 0; i < count; ++i) {
+            depth[i] = frames[first + i].depth.data();
+            color[i] = frames[first + i].color.data();
+            extrinsics[i] = frames[first + i].extrinsic;
+        }
+        volume->deintegrateBatch(depth, color, intrinsic, extrinsics, count);
+    }
+}
+
+static bool
+verify(Volume::VoxelFormat format, const char *name, int batch_size,
+       int max_weight, const std::vector<SyntheticFrame> &frames)
+{
+    Volume volume(glm::vec3(VOLUME_DIMS), VOLUME_RESOLUTION, glm::vec3(0.0f),
+                  glm::vec2(FRAME_SIZE), format);
+    volume.setMaxWeight(max_weight);
+    ReferenceIntegrator reference(VOLUME_DIMS, VOLUME_RESOLUTION, FRAME_SIZE,
+                                  format, volume.getMaxWeight());
+    reference.setTruncMargin(volume.getTruncMargin());
+
+    integrate(&volume, &reference, frames, batch_size);
+    BrickedGrid<Voxel> grid;
+    volume.readRegion(glm::ivec3(0), VOLUME_DIMS, &grid);
+    uint64_t checksum = checksumGrid(grid);
+
+    // The same input must always produce the same volume
+    volume.reset();
+    integrate(&volume, nullptr, frames, batch_size);
+    bool deterministic = volume.checksum() == checksum;
+
+    // Culling may only skip the bricks no frame updates, so the run without
+    // it must match bit for bit, and both match the CPU reference alike
+    volume.reset();
+    volume.setDepthCulling(false);
+    integrate(&volume, nullptr, frames, batch_size);
+    uint64_t unculled = volume.checksum();
+    volume.setDepthCulling(true);
+
+    float tsdf_tolerance = format == Volume::PACKED_VOXELS ? SNORM_TOLERANCE
+                                                           : HALF_TOLERANCE;
+    GridDifference diff = compareGrids(grid, reference.getGrid(),
+                                       tsdf_tolerance, COLOR_TOLERANCE);
+    double mismatched = double(diff.mismatched) /
+                        std::max(diff.observed, size_t(1));
+    bool ok = deterministic && unculled == checksum && diff.observed > 0 &&
+              mismatched <= MAX_MISMATCHED;
+
+    std::printf("%-9s batch %d, max weight %5d: %s\n"
+                "    %zu of %zu observed voxels mismatched (%.4f%%), max errors: "
+                "tsdf %.6f, color %d, weight %d\n"
+                "    checksum %016llx, without culling %016llx, "
+                "reference %016llx%s\n",
+                name, batch_size, volume.getMaxWeight(),
+                ok ? "ok" : "FAILED",
+                diff.mismatched, diff.observed, mismatched * 100.0,
+                diff.max_tsdf_error, diff.max_color_error,
+                diff.max_weight_error,
+                (unsigned long long)checksum,
+                (unsigned long long)unculled,
+                (unsigned long long)checksumGrid(reference.getGrid()),
+                deterministic ? "" : ", NOT DETERMINISTIC");
+    return ok;
+}
+
+// Render every frame back from the integrated volume
+static bool
+verifyRendering(const std::vector<SyntheticFrame> &frames)
+{
+    Volume volume(glm::vec3(VOLUME_DIMS), VOLUME_RESOLUTION, glm::vec3(0.0f),
+                  glm::vec2(FRAME_SIZE));
+    integrate(&volume, nullptr, frames, MAX_BATCH_FRAMES);
+
+    std::vector<RenderView> views;
+    for (const SyntheticFrame &frame : frames)
+        views.push_back({frame.extrinsic, syntheticIntrinsic()});
+    RenderTarget target(FRAME_SIZE, int(views.size()));
+    volume.renderViews(views.data(), int(views.size()), &target);
+
+    RenderTarget::Maps maps;
+    if (!target.startReadback(int(views.size())) ||
+        !target.finishReadback(&maps, true)) {
+        std::printf("rendering: FAILED, no readback\n");
+        return false;
+    }
+
+    size_t pixels = size_t(FRAME_SIZE.x) * FRAME_SIZE.y;
+    size_t compared = 0, matched = 0;
+    for (size_t v = 0; v < frames.size(); ++v)
+    for (size_t i = 0; i < pixels; ++i) {
+        unsigned short depth_mm = frames[v].depth[i];
+        float rendered = maps.depth[v * pixels + i];
+        if (depth_mm == 0 || depth_mm == 65535 || rendered == 0.0f)
+            continue;
+        ++compared;
+        if (std::fabs(rendered - depth_mm / 1000.0f) <= DEPTH_TOLERANCE)
+            ++matched;
+    }
+    double ratio = double(matched) / std::max(compared, size_t(1));
+    bool ok = compared > 0 && ratio >= MIN_DEPTH_MATCHED;
+    std::printf("rendering: %s\n"
+                "    %zu of %zu depth samples within %.3f m (%.2f%%)\n",
+                ok ? "ok" : "FAILED", matched, compared, DEPTH_TOLERANCE,
+                ratio * 100.0);
+    return ok;
+}
+
+// Integrate frames and take them back out. Every voxel they observed alone
+// goes back to unobserved, so from an empty volume the round trip must give
+// it back bit for bit. On top of other frames the voxels are only restored up
+// to the rounding of their storage format.
+static bool
+verifyDeintegration(const std::vector<SyntheticFrame> &frames)
+{
+    Volume volume(glm::vec3(VOLUME_DIMS), VOLUME_RESOLUTION, glm::vec3(0.0f),
+                  glm::vec2(FRAME_SIZE));
+    uint64_t empty = volume.checksum();
+    integrate(&volume, nullptr, frames, MAX_BATCH_FRAMES);
+    deintegrate(&volume, frames, MAX_BATCH_FRAMES);
+    uint64_t cleared = volume.checksum();
+
+    std::vector<SyntheticFrame> kept(frames.begin(),
+                                     frames.begin() + frames.size() / 2);
+    std::vector<SyntheticFrame> removed(frames.begin() + frames.size() / 2,
+                                        frames.end());
+    volume.reset();
+    integrate(&volume, nullptr, kept, MAX_BATCH_FRAMES);
+    BrickedGrid<Voxel> before;
+    volume.readRegion(glm::ivec3(0), VOLUME_DIMS, &before);
+    uint64_t checksum = checksumGrid(before);
+    integrate(&volume, nullptr, removed, MAX_BATCH_FRAMES);
+    deintegrate(&volume, removed, MAX_BATCH_FRAMES);
+    BrickedGrid<Voxel> after;
+    volume.readRegion(glm::ivec3(0), VOLUME_DIMS, &after);
+
+    GridDifference diff = compareGrids(before, after, HALF_TOLERANCE,
+                                       COLOR_TOLERANCE);
+    double mismatched = double(diff.mismatched) /
+                        std::max(diff.observed, size_t(1));
+    bool ok = cleared == empty && diff.observed > 0 &&
+              mismatched <= MAX_MISMATCHED;
+    std::printf("de-integration: %s\n"
+                "    round trip from empty: checksum %016llx, empty %016llx\n"
+                "    round trip over %zu frames: %zu of %zu observed voxels "
+                "mismatched (%.4f%%), weight error %d%s\n",
+                ok ? "ok" : "FAILED",
+                (unsigned long long)cleared, (unsigned long long)empty,
+                kept.size(), diff.mismatched, diff.observed,
+                mismatched * 100.0, diff.max_weight_error,
+                checksumGrid(after) == checksum ? ", bit-exact" : "");
+    return ok;
+}
+
+// Integrate frames at drifted poses, then move them to the right ones
+// through the frame cache. With a single batch every voxel is back to
+// unobserved before the frames are integrated again, so the volume must
+// match integrating them at the right poses bit for bit.
+static bool
+verifyReintegration(const std::vector<SyntheticFrame> &frames)
+{
+    std::vector<SyntheticFrame> batch(frames.begin(),
+                                      frames.begin() + MAX_BATCH_FRAMES);
+    Volume reference(glm::vec3(VOLUME_DIMS), VOLUME_RESOLUTION,
+                     glm::vec3(0.0f), glm::vec2(FRAME_SIZE));
+    integrate(&reference, nullptr, batch, MAX_BATCH_FRAMES);
+    uint64_t expected = reference.checksum();
+
+    std::vector<SyntheticFrame> drifted = batch;
+    std::vector<glm::mat4> extrinsics;
+    std::vector<int> ids;
+    for (int i = 0; i < int(batch.size()); ++i) {
+        glm::mat4 drift = glm::rotate(glm::mat4(1.0f), 0.01f * (i + 1),
+                                      glm::vec3(0.0f, 1.0f, 0.0f));
+        drift = glm::translate(drift, glm::vec3(0.02f * (i + 1), -0.01f * i,
+                                                0.015f));
+        drifted[i].extrinsic = batch[i].extrinsic * drift;
+        extrinsics.push_back(batch[i].extrinsic);
+        ids.push_back(i);
+    }
+
+    Volume volume(glm::vec3(VOLUME_DIMS), VOLUME_RESOLUTION, glm::vec3(0.0f),
+                  glm::vec2(FRAME_SIZE));
+    FrameCache cache(FRAME_SIZE, size_t(1) << 30);
+    integrate(&volume, nullptr, drifted, MAX_BATCH_FRAMES);
+    for (int i = 0; i < int(drifted.size()); ++i)
+        cache.add(&volume, i, drifted[i].depth.data(),
+                  drifted[i].color.data(), syntheticIntrinsic(),
+                  drifted[i].extrinsic);
+    int updated = cache.reintegrate(&volume, ids.data(), extrinsics.data(),
+                                    int(ids.size()));
+    uint64_t checksum = volume.checksum();
+
+    bool ok = updated == int(ids.size()) && checksum == expected;
+    std::printf("re-integration: %s\n"
+                "    %d of %zu frames moved, checksum %016llx, "
+                "reference %016llx\n",
+                ok ? "ok" : "FAILED", updated, ids.size(),
+                (unsigned long long)checksum, (unsigned long long)expected);
+    return ok;
+}
+
+int
+main()
+{
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return EXIT_FAILURE;
+    }
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *window = glfwCreateWindow(64, 64, "sfm_verify", NULL, NULL);
+    if (!window) {
+        std::cerr << "Failed to create an OpenGL 4.5 context" << std::endl;
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    glfwMakeContextCurrent(window);
+    if (!gladLoadGL()) {
+        std::cerr << "Failed to initialize OpenGL loader (glad)" << std::endl;
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    std::cout << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
+
+    std::vector<SyntheticFrame> frames;
+    for (int n = 0; n < FRAME_COUNT; ++n)
+        frames.push_back(renderFrame(n));
+
+    struct {
+        Volume::VoxelFormat format;
+        const char *name;
+    } formats[] = {
+        {Volume::SEPARATE_VOXELS,             "separate"},
+        {Volume::PACKED_VOXELS,               "packed"},
+        {Volume::SEPARATE_VOXELS_8BIT_WEIGHT, "8-bit"},
+    };
+
+    bool ok = true;
+    try {
+        for (const auto &f : formats) {
+            // Uncapped weights, then weights saturating within the sequence
+            ok &= verify(f.format, f.name, 1, 65535, frames);
+            ok &= verify(f.format, f.name, MAX_BATCH_FRAMES, 65535, frames);
+            ok &= verify(f.format, f.name, 3, 4, frames);
+        }
+        ok &= verifyRendering(frames);
+        ok &= verifyDeintegration(frames);
+        ok &= verifyReintegration(frames);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        ok = false;
+    }
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    std::cout << (ok ? "All checks passed" : "Some checks FAILED") << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
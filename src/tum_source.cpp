@@ -0,0 +1,245 @@
+#include "tum_source.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <dirent.h>
+
+#include <glm/gtc/quaternion.hpp>
+
+#include "dataset_source.hpp"
+#include "profiler.hpp"
+
+
+// Largest time difference between a depth image and the color image or pose
+// it's paired with, same as the benchmark's associate.py
+const double MAX_TIME_DIFFERENCE = 0.02;
+
+static double
+timestamp(const std::vector<std::string> &fields)
+{
+    return std::strtod(fields[0].c_str(), nullptr);
+}
+
+// First file in 'dir' whose name ends with 'suffix'
+static std::string
+findFile(const std::string &dir, const std::string &suffix)
+{
+    std::string found;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return found;
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() >= suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(),
+                         suffix) == 0) {
+            found = dir + "/" + name;
+            break;
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+void
+TumFrameSource::IndexFile::open(const std::string &filename)
+{
+    _filename = filename;
+    rewind();
+}
+
+void
+TumFrameSource::IndexFile::rewind()
+{
+    _ifs.close();
+    _ifs.clear();
+    _ifs.open(_filename);
+    if (!_ifs)
+        throw std::runtime_error("Failed to open '" + _filename + "'");
+    _current.clear();
+    _next.clear();
+}
+
+bool
+TumFrameSource::IndexFile::readLine(std::vector<std::string> *fields)
+{
+    fields->clear();
+    std::string line;
+    while (std::getline(_ifs, line)) {
+        // Skip comments and empty lines
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        std::istringstream iss(line);
+        std::string field;
+        while (iss >> field)
+            fields->push_back(field);
+        return true;
+    }
+    return false;
+}
+
+bool
+TumFrameSource::IndexFile::next(std::vector<std::string> *fields)
+{
+    return readLine(fields);
+}
+
+const std::vector<std::string> *
+TumFrameSource::IndexFile::closest(double t, double max_difference)
+{
+    if (_next.empty())
+        readLine(&_next);
+    while (!_next.empty() && timestamp(_next) <= t) {
+        _current.swap(_next);
+        readLine(&_next);
+    }
+
+    const std::vector<std::string> *best = nullptr;
+    double best_difference = max_difference;
+    if (!_current.empty() && t - timestamp(_current) <= best_difference) {
+        best = &_current;
+        best_difference = t - timestamp(_current);
+    }
+    if (!_next.empty() && timestamp(_next) - t < best_difference)
+        best = &_next;
+    return best;
+}
+
+TumFrameSource::TumFrameSource(const std::string &dir, glm::uvec2 frame_size,
+                               Layout layout) :
+    _dir(dir),
+    _frame_size(frame_size),
+    _layout(layout),
+    _intrinsic(1.0f)
+{
+    loadIntrinsics();
+
+    if (_layout == TUM) {
+        _frames.open(_dir + "/depth.txt");
+        _colors.open(_dir + "/rgb.txt");
+        _poses.open(_dir + "/groundtruth.txt");
+    } else {
+        _frames.open(_dir + "/associations.txt");
+        std::string trajectory = findFile(_dir, ".gt.freiburg");
+        _poses.open(trajectory.empty() ? _dir + "/groundtruth.txt"
+                                       : trajectory);
+    }
+}
+
+void
+TumFrameSource::loadIntrinsics()
+{
+    float fx = 525.0f, fy = 525.0f, cx = 319.5f, cy = 239.5f;
+    float depth_units = 5000.0f;
+
+    if (_layout == ICL_NUIM) {
+        // The negative focal length matches the handedness of the ICL-NUIM
+        // trajectories
+        fx = 481.2f;
+        fy = -480.0f;
+    } else if (_dir.find("freiburg1") != std::string::npos) {
+        fx = 517.3f; fy = 516.5f; cx = 318.6f; cy = 255.3f;
+    } else if (_dir.find("freiburg2") != std::string::npos) {
+        fx = 520.9f; fy = 521.0f; cx = 325.1f; cy = 249.7f;
+    } else if (_dir.find("freiburg3") != std::string::npos) {
+        fx = 535.4f; fy = 539.2f; cx = 320.1f; cy = 247.6f;
+    }
+
+    std::ifstream ifs(_dir + "/intrinsics.txt");
+    if (ifs) {
+        ifs >> fx >> fy >> cx >> cy;
+        float units;
+        if (ifs >> units)
+            depth_units = units;
+    }
+
+    _intrinsic = glm::mat3(0.0f);
+    _intrinsic[0][0] = fx;
+    _intrinsic[1][1] = fy;
+    _intrinsic[2][0] = cx;
+    _intrinsic[2][1] = cy;
+    _intrinsic[2][2] = 1.0f;
+    _depth_scale = 1000.0f / depth_units;
+}
+
+void
+TumFrameSource::rewind()
+{
+    _frames.rewind();
+    if (_layout == TUM)
+        _colors.rewind();
+    _poses.rewind();
+    _position = 0;
+}
+
+bool
+TumFrameSource::read(Frame *frame)
+{
+    PROFILE_SCOPE("TumFrameSource::read");
+    std::vector<std::string> fields;
+    // Frames that fail to load are skipped
+    while (_frames.next(&fields)) {
+        ++_position;
+        double t = timestamp(fields);
+
+        std::string depth_filename, color_filename;
+        if (_layout == TUM) {
+            if (fields.size() < 2)
+                continue;
+            depth_filename = fields[1];
+            const std::vector<std::string> *color =
+                _colors.closest(t, MAX_TIME_DIFFERENCE);
+            if (!color || color->size() < 2) {
+                std::cerr << "No color image for depth image '"
+                          << depth_filename << "'. Skipping frame..."
+                          << std::endl;
+                continue;
+            }
+            color_filename = (*color)[1];
+        } else {
+            if (fields.size() < 4)
+                continue;
+            depth_filename = fields[1];
+            color_filename = fields[3];
+            // Some releases list the color image first
+            if (depth_filename.find("rgb") != std::string::npos)
+                std::swap(depth_filename, color_filename);
+        }
+
+        const std::vector<std::string> *pose =
+            _poses.closest(t, MAX_TIME_DIFFERENCE);
+        if (!pose || pose->size() < 8) {
+            std::cerr << "No ground truth pose for depth image '"
+                      << depth_filename << "'. Skipping frame..."
+                      << std::endl;
+            continue;
+        }
+        glm::vec3 translation(std::stof((*pose)[1]),
+                              std::stof((*pose)[2]),
+                              std::stof((*pose)[3]));
+        // glm takes the scalar part first
+        glm::quat rotation(std::stof((*pose)[7]),
+                           std::stof((*pose)[4]),
+                           std::stof((*pose)[5]),
+                           std::stof((*pose)[6]));
+        glm::mat4 pose_matrix = glm::mat4_cast(rotation);
+        pose_matrix[3] = glm::vec4(translation, 1.0f);
+
+        if (!loadDepth(_dir + "/" + depth_filename, _frame_size,
+                       _depth_scale, &frame->depth, &_depth_buffer) ||
+            !loadColorImage(_dir + "/" + color_filename, _frame_size,
+                            &frame->color))
+            continue;
+
+        frame->extrinsic = glm::inverse(pose_matrix);
+        frame->has_intrinsic = true;
+        frame->intrinsic = _intrinsic;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+
+// Sequences in the TUM RGB-D benchmark layout, and the TUM compatible release
+// of ICL-NUIM.
+//
+// TUM: depth.txt and rgb.txt list "timestamp filename" and groundtruth.txt
+// lists "timestamp tx ty tz qx qy qz qw" camera to world poses. Each depth
+// image is paired with the closest color image and pose in time.
+//
+// ICL-NUIM: associations.txt lists "timestamp depth timestamp rgb" pairs and
+// the *.gt.freiburg file has the poses in the format of groundtruth.txt.
+//
+// Depth is stored in units of 1/5000 meters, in PNGs or in their transcoded
+// .sfmd versions, see loadDepth(). Intrinsics come from the sequence name,
+// and an optional intrinsics.txt with "fx fy cx cy [depth units per meter]"
+// overrides them. The index files are read as frames are requested, so
+// sequences of any length start immediately.
+class TumFrameSource : public FrameSource {
+public:
+    enum Layout {
+        TUM,
+        ICL_NUIM
+    };
+
+    TumFrameSource(const std::string &dir, glm::uvec2 frame_size,
+                   Layout layout);
+
+    bool read(Frame *frame) override;
+    void rewind() override;
+    int position() const override { return _position; }
+private:
+    // Whitespace separated lines of an index file with a leading timestamp,
+    // read on demand. Lookups must be made in increasing timestamp order.
+    class IndexFile {
+    public:
+        void open(const std::string &filename);
+        void rewind();
+        bool next(std::vector<std::string> *fields);
+        // Entry closest to 'timestamp', or nullptr if none is within
+        // 'max_difference' seconds
+        const std::vector<std::string> *closest(double timestamp,
+                                                double max_difference);
+    private:
+        bool readLine(std::vector<std::string> *fields);
+
+        std::string _filename;
+        std::ifstream _ifs;
+        std::vector<std::string> _current;
+        std::vector<std::string> _next;
+    };
+
+    void loadIntrinsics();
+
+    std::string _dir;
+    glm::uvec2  _frame_size;
+    Layout      _layout;
+
+    glm::mat3   _intrinsic;
+    float       _depth_scale = 0.2f;
+
+    // Drives the frame order, depth.txt or associations.txt
+    IndexFile   _frames;
+    IndexFile   _colors;
+    IndexFile   _poses;
+    int         _position = 0;
+    // File contents of the last transcoded depth image, see loadDepth()
+    std::vector<unsigned char> _depth_buffer;
+};
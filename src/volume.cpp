@@ -1,43 +1,197 @@
 #include "volume.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_access.hpp>
+
 #include "imgui.h"
 
+#include "block_store.hpp"
 #include "camera.hpp"
+#include "profiler.hpp"
+#include "render_target.hpp"
+
+// Distance in voxels that reprojected ray starts are moved back towards the
+// camera
+const float REPROJECTION_BACKOFF = 2.0f;
+
+// Growth of the proxy boxes in voxels, so rays that graze a box edge still
+// cover it
+const float PROXY_MARGIN = 0.01f;
+
+static std::string
+formatDefines(Volume::VoxelFormat format)
+{
+    switch (format) {
+    case Volume::PACKED_VOXELS:
+        return "#define PACKED_VOXELS\n";
+    case Volume::SEPARATE_VOXELS_8BIT_WEIGHT:
+        return "#define WEIGHT_8BIT\n";
+    default:
+        return "";
+    }
+}
+
+// Camera space to image coordinates (x, y, w) in xyz, keeping the camera
+// space z in w
+static glm::mat4
+cameraToImage(const glm::mat3 &intrinsic)
+{
+    glm::mat4 m = glm::mat4(intrinsic);
+    m[2][3] = 1.0f;
+    m[3][3] = 0.0f;
+    return m;
+}
 
 Volume::Volume(glm::vec3 dims, float resolution, glm::vec3 offset,
-               glm::vec2 frame_size) :
+               glm::vec2 frame_size, VoxelFormat format, int levels) :
     _dims(dims),
     _resolution(resolution),
     _offset(offset),
     _frame_size(frame_size),
-    _integrate_shader("res/shaders/tsdf.glsl"),
-    _raycast_shader("res/shaders/raycast.vert",
-                    "res/shaders/raycast.frag")
+    _format(format),
+    _integrate_shader("res/shaders/tsdf.glsl", formatDefines(format)),
+    _raycast_shader("res/shaders/raycast.glsl", formatDefines(format)),
+    _composite_shader("res/shaders/composite.vert",
+                      "res/shaders/composite.frag"),
+    _render_shader("res/shaders/render_views.glsl", formatDefines(format)),
+    _occupancy_shader("res/shaders/occupancy.glsl", formatDefines(format)),
+    _reproject_shader("res/shaders/reproject.glsl"),
+    _normals_shader("res/shaders/normals.glsl", formatDefines(format)),
+    _depth_pyramid_shader("res/shaders/depth_pyramid.glsl"),
+    _proxy_build_shader("res/shaders/proxy.glsl"),
+    _proxy_shader("res/shaders/proxy.vert", "res/shaders/proxy.frag")
 {
     _model = glm::mat4(1.0f);
+    _max_weight = getMaxWeightLimit();
 
-    // Translate then scale (instruction order is reversed due to glm being
-    // column major)
-    _texture_to_model = glm::scale(
-        glm::mat4(1.0f),
-        glm::vec3(_dims) * _resolution);
-    _texture_to_model = glm::translate(
-        _texture_to_model,
-        glm::vec3(-0.5f, -0.5f, -0.5f));
+    glGenQueries(1, &_time_query);
 
-    _integrate_shader.use();
-    _integrate_shader.setMat4("texture_to_model", _texture_to_model);
-    _integrate_shader.setFloat("trunc_margin", _resolution * _trunc_margin);
+    if (levels < 1 || levels > MAX_VOLUME_LEVELS)
+        throw std::runtime_error("Unsupported number of volume levels");
 
-    _raycast_shader.use();
-    _raycast_shader.setInt("tsdf_tex", 0);
-    _raycast_shader.setInt("color_tex", 1);
+    _levels.resize(levels);
+    for (int i = 0; i < levels; ++i) {
+        Level &level = _levels[i];
+        level.resolution = _resolution * float(1 << i);
+        // Translate then scale (instruction order is reversed due to glm
+        // being column major)
+        level.texture_to_model = glm::scale(
+            glm::mat4(1.0f),
+            glm::vec3(_dims) * level.resolution);
+        level.texture_to_model = glm::translate(
+            level.texture_to_model,
+            glm::vec3(-0.5f, -0.5f, -0.5f));
+    }
+
+    setupSamplers(_raycast_shader);
+    setupSamplers(_render_shader);
 
     //--------------------------------------------------------------------------
     // TEXTURES
 
-    glGenTextures(1, &_tsdf_tex);
-    glBindTexture(GL_TEXTURE_3D, _tsdf_tex);
+    for (Level &level : _levels) {
+        if (_format == PACKED_VOXELS)
+            createPackedTextures(&level);
+        else
+            createSeparateTextures(&level);
+        createOccupancyTexture(&level);
+
+        glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+        glGenBuffers(1, &level.touched_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, level.touched_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     sizeof(GLuint) * bricks.x * bricks.y * bricks.z,
+                     nullptr, GL_DYNAMIC_DRAW);
+
+        glm::ivec3 blocks = glm::ivec3(_dims) / BLOCK_SIZE;
+        GLuint zero = 0;
+        glGenBuffers(1, &level.dirty_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, level.dirty_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     2 * sizeof(GLuint) * blocks.x * blocks.y * blocks.z,
+                     nullptr, GL_DYNAMIC_DRAW);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                          GL_UNSIGNED_INT, &zero);
+    }
+
+    glGenTextures(1, &_frame_depth_tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _frame_depth_tex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY,
+        0,
+        GL_R16UI,
+        _frame_size.x, _frame_size.y, MAX_BATCH_FRAMES,
+        0,
+        GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+        (void*)0);
+
+    glGenTextures(1, &_frame_color_tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _frame_color_tex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY,
+        0,
+        GL_RGB8,
+        _frame_size.x, _frame_size.y, MAX_BATCH_FRAMES,
+        0,
+        GL_RGB, GL_UNSIGNED_BYTE,
+        (void*)0);
+
+    // Down to a single texel, see depth_pyramid.glsl
+    int frame_extent = std::max(int(_frame_size.x), int(_frame_size.y));
+    _depth_pyramid_levels = 1;
+    while (frame_extent >> _depth_pyramid_levels)
+        ++_depth_pyramid_levels;
+    glGenTextures(1, &_depth_pyramid_tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _depth_pyramid_tex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                    GL_NEAREST_MIPMAP_NEAREST);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, _depth_pyramid_levels, GL_R32F,
+                   _frame_size.x, _frame_size.y, MAX_BATCH_FRAMES);
+
+    // The composite pass and the proxy draw without any vertex data, but a
+    // vertex array must still be bound
+    glGenVertexArrays(1, &_empty_vao);
+    _composite_shader.use();
+    _composite_shader.setInt("raycast_tex", 0);
+
+    // Every brick can be split in up to 8 boxes by the seams of a rolled
+    // volume, but only the bricks along the seams are
+    glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+    size_t max_boxes = size_t(bricks.x) * bricks.y * bricks.z +
+        7 * size_t(bricks.x * bricks.y + bricks.y * bricks.z +
+                   bricks.x * bricks.z);
+    glGenBuffers(1, &_proxy_brick_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _proxy_brick_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 max_boxes * _levels.size() * 2 * sizeof(glm::vec4),
+                 nullptr, GL_DYNAMIC_DRAW);
+    GLuint command[] = {36, 0, 0, 0};
+    glGenBuffers(1, &_proxy_command_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _proxy_command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(command), command,
+                 GL_DYNAMIC_DRAW);
+
+    reset();
+}
+
+// One texture per voxel attribute: tsdf, color and weight
+void
+Volume::createSeparateTextures(Level *level)
+{
+    glGenTextures(1, &level->tsdf_tex);
+    glBindTexture(GL_TEXTURE_3D, level->tsdf_tex);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
@@ -51,10 +205,9 @@ Volume::Volume(glm::vec3 dims, float resolution, glm::vec3 offset,
         0,
         GL_RED, GL_HALF_FLOAT,
         (void*)0);
-    glBindImageTexture(0, _tsdf_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R16F);
 
-    glGenTextures(1, &_color_tex);
-    glBindTexture(GL_TEXTURE_3D, _color_tex);
+    glGenTextures(1, &level->color_tex);
+    glBindTexture(GL_TEXTURE_3D, level->color_tex);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
@@ -68,10 +221,9 @@ Volume::Volume(glm::vec3 dims, float resolution, glm::vec3 offset,
         0,
         GL_RGBA, GL_UNSIGNED_BYTE,
         (void*)0);
-    glBindImageTexture(1, _color_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA8);
 
-    glGenTextures(1, &_weight_tex);
-    glBindTexture(GL_TEXTURE_3D, _weight_tex);
+    glGenTextures(1, &level->weight_tex);
+    glBindTexture(GL_TEXTURE_3D, level->weight_tex);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
@@ -80,177 +232,1426 @@ Volume::Volume(glm::vec3 dims, float resolution, glm::vec3 offset,
     glTexImage3D(
         GL_TEXTURE_3D,
         0,
-        GL_R16UI,
+        _format == SEPARATE_VOXELS_8BIT_WEIGHT ? GL_R8UI : GL_R16UI,
         _dims.x, _dims.y, _dims.z,
         0,
         GL_RED_INTEGER, GL_SHORT,
         (void*)0);
-    glBindImageTexture(2, _weight_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R16UI);
+}
 
-    glGenTextures(1, &_frame_depth_tex);
-    glBindTexture(GL_TEXTURE_2D, _frame_depth_tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D(
-        GL_TEXTURE_2D,
+// All the attributes of a voxel interleaved in a single 64-bit texel, so the
+// integration shader does a single load and store per voxel
+void
+Volume::createPackedTextures(Level *level)
+{
+    glGenTextures(1, &level->voxel_tex);
+    glBindTexture(GL_TEXTURE_3D, level->voxel_tex);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage3D(
+        GL_TEXTURE_3D,
         0,
-        GL_R16UI,
-        _frame_size.x, _frame_size.y,
+        GL_RG32UI,
+        _dims.x, _dims.y, _dims.z,
         0,
-        GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+        GL_RG_INTEGER, GL_UNSIGNED_INT,
         (void*)0);
+}
 
-    glGenTextures(1, &_frame_color_tex);
-    glBindTexture(GL_TEXTURE_2D, _frame_color_tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D(
-        GL_TEXTURE_2D,
+// One RG32UI texel per brick of texels, see occupancy.glsl
+void
+Volume::createOccupancyTexture(Level *level)
+{
+    glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+    glGenTextures(1, &level->occupancy_tex);
+    glBindTexture(GL_TEXTURE_3D, level->occupancy_tex);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage3D(
+        GL_TEXTURE_3D,
         0,
-        GL_RGB8,
-        _frame_size.x, _frame_size.y,
+        GL_RG32UI,
+        bricks.x, bricks.y, bricks.z,
         0,
-        GL_RGB, GL_UNSIGNED_BYTE,
+        GL_RG_INTEGER, GL_UNSIGNED_INT,
         (void*)0);
+    // The occupancy shader compares against the previous contents
+    glClearTexImage(level->occupancy_tex, 0, GL_RG_INTEGER, GL_UNSIGNED_INT,
+                    (void *)0);
+}
 
-    reset();
-    createVolume();
+// Two snorm8 octahedral coordinates per voxel, see normals.glsl
+void
+Volume::createNormalTexture(Level *level)
+{
+    glGenTextures(1, &level->normal_tex);
+    glBindTexture(GL_TEXTURE_3D, level->normal_tex);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_RG8_SNORM, _dims.x, _dims.y, _dims.z);
 }
 
 Volume::~Volume()
 {
-    // XXX
-    //glDeleteVertexArrays(1, &volume_vao);
-    //glDeleteBuffers(1, &volume_vbo);
+    // Textures of the formats not in use are still 0, which GL ignores
+    for (const Level &level : _levels) {
+        GLuint textures[] = {level.tsdf_tex, level.color_tex,
+                             level.weight_tex, level.voxel_tex,
+                             level.occupancy_tex, level.normal_tex};
+        glDeleteTextures(6, textures);
+        GLuint buffers[] = {level.touched_buffer, level.dirty_buffer};
+        glDeleteBuffers(2, buffers);
+    }
+
+    GLuint textures[] = {_raycast_tex, _hit_history_tex, _reprojected_tex,
+                         _proxy_t_min_tex, _proxy_t_max_tex,
+                         _frame_depth_tex, _frame_color_tex,
+                         _depth_pyramid_tex};
+    glDeleteTextures(8, textures);
+    GLuint buffers[] = {_proxy_brick_buffer, _proxy_command_buffer};
+    glDeleteBuffers(2, buffers);
+    glDeleteFramebuffers(1, &_proxy_fbo);
+    glDeleteVertexArrays(1, &_empty_vao);
+    glDeleteQueries(1, &_time_query);
+
+    // Shader doesn't own its program
+    const Shader *shaders[] = {
+        &_integrate_shader, &_raycast_shader, &_composite_shader,
+        &_render_shader, &_occupancy_shader, &_reproject_shader,
+        &_normals_shader, &_depth_pyramid_shader, &_proxy_build_shader,
+        &_proxy_shader};
+    for (const Shader *shader : shaders)
+        glDeleteProgram(shader->_program);
 }
 
 void
 Volume::integrate(const unsigned short *depth_data,
                   const unsigned char  *color_data,
-                  const glm::mat4 &intrinsic,
+                  const glm::mat3 &intrinsic,
                   const glm::mat4 &extrinsic)
+{
+    integrateBatch(&depth_data, &color_data, intrinsic, &extrinsic, 1);
+}
+
+void
+Volume::integrateBatch(const unsigned short *const *depth_data,
+                       const unsigned char  *const *color_data,
+                       const glm::mat3 &intrinsic,
+                       const glm::mat4 *extrinsics,
+                       int count)
+{
+    PROFILE_SCOPE("Volume::integrate");
+    if (count <= 0)
+        return;
+    if (count > MAX_BATCH_FRAMES)
+        throw std::runtime_error("Too many frames in an integration batch");
+
+    // The volume follows the most recent frame of the batch
+    if (_rolling)
+        roll(extrinsics[count - 1]);
+
+    updateBatch(depth_data, color_data, intrinsic, extrinsics, count, false);
+}
+
+void
+Volume::deintegrate(const unsigned short *depth_data,
+                    const unsigned char  *color_data,
+                    const glm::mat3 &intrinsic,
+                    const glm::mat4 &extrinsic)
+{
+    deintegrateBatch(&depth_data, &color_data, intrinsic, &extrinsic, 1);
+}
+
+void
+Volume::deintegrateBatch(const unsigned short *const *depth_data,
+                         const unsigned char  *const *color_data,
+                         const glm::mat3 &intrinsic,
+                         const glm::mat4 *extrinsics,
+                         int count)
+{
+    PROFILE_SCOPE("Volume::deintegrate");
+    if (count <= 0)
+        return;
+    if (count > MAX_BATCH_FRAMES)
+        throw std::runtime_error("Too many frames in an integration batch");
+
+    // The volume doesn't roll back to old frames, their voxels that already
+    // left it keep the contribution
+    updateBatch(depth_data, color_data, intrinsic, extrinsics, count, true);
+}
+
+void
+Volume::reintegrateBatch(const unsigned short *const *depth_data,
+                         const unsigned char  *const *color_data,
+                         const glm::mat3 &intrinsic,
+                         const glm::mat4 *old_extrinsics,
+                         const glm::mat4 *new_extrinsics,
+                         int count)
+{
+    PROFILE_SCOPE("Volume::reintegrate");
+    if (count <= 0)
+        return;
+    if (count > MAX_BATCH_FRAMES)
+        throw std::runtime_error("Too many frames in an integration batch");
+
+    // The second pass must see the voxels written by the first one
+    updateBatch(depth_data, color_data, intrinsic, old_extrinsics, count, true);
+    updateBatch(depth_data, color_data, intrinsic, new_extrinsics, count, false);
+}
+
+// Add or subtract a batch of frames to every level
+void
+Volume::updateBatch(const unsigned short *const *depth_data,
+                    const unsigned char  *const *color_data,
+                    const glm::mat3 &intrinsic,
+                    const glm::mat4 *extrinsics,
+                    int count, bool deintegrate)
 {
     _integrate_shader.use();
-    _integrate_shader.setMat4("model", _model);
-    _integrate_shader.setMat4("extrinsic", extrinsic);
-    _integrate_shader.setMat3("intrinsic", intrinsic);
+    _integrate_shader.setBool("deintegrate", deintegrate);
+    _integrate_shader.setBool("depth_culling", _depth_culling);
+    _integrate_shader.setUInt("max_weight", _max_weight);
+    _integrate_shader.setInt("num_frames", count);
+    _integrate_shader.setIVec3("volume_dims", glm::ivec3(_dims));
 
     glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, _frame_depth_tex);
-    glTexSubImage2D(GL_TEXTURE_2D,
-                    0,
-                    0, 0,
-                    _frame_size.x, _frame_size.y,
-                    GL_RED_INTEGER, GL_UNSIGNED_SHORT,
-                    depth_data);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _frame_depth_tex);
+    for (int i = 0; i < count; ++i)
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+                        0,
+                        0, 0, i,
+                        _frame_size.x, _frame_size.y, 1,
+                        GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                        depth_data[i]);
 
     glActiveTexture(GL_TEXTURE4);
-    glBindTexture(GL_TEXTURE_2D, _frame_color_tex);
-    glTexSubImage2D(GL_TEXTURE_2D,
-                    0,
-                    0, 0,
-                    _frame_size.x, _frame_size.y,
-                    GL_RGB, GL_UNSIGNED_BYTE,
-                    color_data);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _frame_color_tex);
+    for (int i = 0; i < count; ++i)
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+                        0,
+                        0, 0, i,
+                        _frame_size.x, _frame_size.y, 1,
+                        GL_RGB, GL_UNSIGNED_BYTE,
+                        color_data[i]);
+
+    // Only one query is kept in flight, integrations issued while it's
+    // pending aren't timed
+    if (_time_query_pending) {
+        GLint available = 0;
+        glGetQueryObjectiv(_time_query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(_time_query, GL_QUERY_RESULT, &elapsed);
+            _integrate_time = elapsed / 1e6f;
+            _time_query_pending = false;
+        }
+    }
+    bool timed = !_time_query_pending;
+    if (timed)
+        glBeginQuery(GL_TIME_ELAPSED, _time_query);
+
+    // The pyramid is timed along with the integration it culls
+    if (_depth_culling)
+        buildDepthPyramid(count);
+    _integrate_shader.use();
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _depth_pyramid_tex);
+
+    // Every level integrates the whole frame, also the central half that the
+    // next finer level covers. The sampling never reads it there, but it is
+    // what the coarse level holds once a region leaves the finer level when
+    // the volume rolls. The truncation margin is given in voxels, so it grows
+    // along with the voxel size.
+    for (int l = 0; l < int(_levels.size()); ++l) {
+        const Level &level = _levels[l];
+        bindLevelImages(level);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, level.touched_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, level.dirty_buffer);
+        _integrate_shader.setFloat("trunc_margin",
+                                   level.resolution * _trunc_margin);
+        _integrate_shader.setIVec3("volume_wrap", wrappedOrigin(level));
+        // From the index of a voxel inside the level to its center
+        glm::mat4 voxel_to_model = glm::translate(
+            getVoxelToModel(l),
+            glm::vec3(level.origin) + 0.5f);
+        for (int i = 0; i < count; ++i)
+            _integrate_shader.setMat4(
+                "voxel_to_image[" + std::to_string(i) + "]",
+                cameraToImage(intrinsic) * extrinsics[i] * voxel_to_model);
+
+        // Every invocation walks a whole column of voxels
+        glDispatchCompute(_dims.x / OCCUPANCY_BRICK_SIZE,
+                          _dims.y / OCCUPANCY_BRICK_SIZE,
+                          1);
+    }
 
-    glDispatchCompute(_dims.x / 32, _dims.y / 32, _dims.z);
+    if (timed) {
+        glEndQuery(GL_TIME_ELAPSED);
+        _time_query_pending = true;
+    }
 
     // Don't allow other shaders to access the buffers touched by the compute
     // shader until it's done executing
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_SHADER_STORAGE_BARRIER_BIT);
+    _occupancy_dirty = true;
+    _normals_dirty = true;
+}
+
+// Reduce the depth of every frame of the batch to the farthest one around
+// each pixel, one level at a time
+void
+Volume::buildDepthPyramid(int count)
+{
+    PROFILE_SCOPE("Volume::buildDepthPyramid");
+    _depth_pyramid_shader.use();
+    for (int i = 0; i < _depth_pyramid_levels; ++i) {
+        _depth_pyramid_shader.setInt("level", i);
+        glBindImageTexture(0, _depth_pyramid_tex, i, GL_TRUE, 0,
+                           GL_WRITE_ONLY, GL_R32F);
+        if (i > 0)
+            glBindImageTexture(1, _depth_pyramid_tex, i - 1, GL_TRUE, 0,
+                               GL_READ_ONLY, GL_R32F);
+        glm::ivec2 size = glm::max(glm::ivec2(_frame_size) >> i, 1);
+        glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, count);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
 
+void
+Volume::bindLevelImages(const Level &level)
+{
+    if (_format == PACKED_VOXELS) {
+        glBindImageTexture(0, level.voxel_tex, 0, GL_FALSE, 0,
+                           GL_READ_WRITE, GL_RG32UI);
+        return;
+    }
+    glBindImageTexture(0, level.tsdf_tex, 0, GL_FALSE, 0,
+                       GL_READ_WRITE, GL_R16F);
+    glBindImageTexture(1, level.color_tex, 0, GL_FALSE, 0,
+                       GL_READ_WRITE, GL_RGBA8);
+    glBindImageTexture(2, level.weight_tex, 0, GL_FALSE, 0, GL_READ_WRITE,
+                       _format == SEPARATE_VOXELS_8BIT_WEIGHT
+                       ? GL_R8UI : GL_R16UI);
+}
+
+// Raycast into an image with a compute shader, one workgroup per screen tile,
+// then composite the image over the framebuffer
 void
 Volume::draw(const Camera *camera)
 {
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_FRONT);
+    PROFILE_SCOPE("Volume::draw");
+    glm::ivec2 size(camera->_viewport.width, camera->_viewport.height);
+    if (size.x <= 0 || size.y <= 0)
+        return;
+    if (size != _raycast_size)
+        createRaycastTextures(size);
+    updateBricks();
 
-    _raycast_shader.use();
+    // The volume is moved along with its origin when it rolls, so the
+    // raycaster only deals with texture coordinates relative to the current
+    // volume. All levels share the same center.
+    const Level &base = _levels[0];
+    glm::mat4 model = glm::translate(
+        _model, glm::vec3(base.origin) * base.resolution);
 
     glm::mat4 view = camera->getViewMatrix();
     glm::mat4 projection = camera->getProjectionMatrix();
-    glm::mat4 mvp = projection * view * _model;
-    glm::vec4 camera_pos_tex_space =
-        glm::inverse(_texture_to_model) *
-        glm::inverse(_model) *
+    glm::mat4 mvp = projection * view * model * base.texture_to_model;
+    glm::mat4 inv_mvp = glm::inverse(mvp);
+    glm::vec3 camera_pos_tex_space = glm::vec3(
+        glm::inverse(base.texture_to_model) *
+        glm::inverse(model) *
         glm::inverse(view) *
-        glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-    _raycast_shader.setMat4("mvp", mvp);
+        glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    // Farthest point of the near plane, the proxy boxes are clipped before it
+    float near_distance = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+        glm::vec4 corner = inv_mvp * glm::vec4(i & 1 ? 1.0f : -1.0f,
+                                               i & 2 ? 1.0f : -1.0f,
+                                               -1.0f, 1.0f);
+        near_distance = std::max(near_distance, glm::distance(
+            glm::vec3(corner) / corner.w, camera_pos_tex_space));
+    }
+    glm::uvec3 groups((size.x + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE,
+                      (size.y + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE,
+                      1);
+
+    if (_proxy_bounds)
+        drawProxy(mvp, camera_pos_tex_space);
+
+    // The hits are kept in texture space, which moves when the volume rolls
+    bool use_history = _reprojection && _history_valid &&
+                       _history_origin == base.origin;
+    glBindImageTexture(1, _hit_history_tex, 0, GL_FALSE, 0,
+                       GL_READ_WRITE, GL_R32F);
+    glBindImageTexture(2, _reprojected_tex, 0, GL_FALSE, 0,
+                       GL_READ_WRITE, GL_R32UI);
+    if (use_history) {
+        PROFILE_SCOPE("Volume::reproject");
+        GLuint far = 0xFFFFFFFF;
+        glClearTexImage(_reprojected_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                        &far);
+        _reproject_shader.use();
+        _reproject_shader.setMat4("prev_inv_mvp", _history_inv_mvp);
+        _reproject_shader.setVec3("prev_camera_pos", _history_camera_pos);
+        _reproject_shader.setMat4("mvp", mvp);
+        _reproject_shader.setVec3("camera_pos_tex_space", camera_pos_tex_space);
+        _reproject_shader.setIVec2("size", size);
+        glDispatchCompute(groups.x, groups.y, groups.z);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+
+    _raycast_shader.use();
+    _raycast_shader.setMat4("inv_mvp", inv_mvp);
     _raycast_shader.setVec3("volume_dims", _dims);
-    _raycast_shader.setVec3("camera_pos_tex_space",
-                          glm::vec3(camera_pos_tex_space));
+    _raycast_shader.setVec3("camera_pos_tex_space", camera_pos_tex_space);
     _raycast_shader.setFloat("step_size", _step_size);
     _raycast_shader.setInt("display_mode", _display_mode);
+    _raycast_shader.setIVec2("size", size);
+    _raycast_shader.setBool("cached_normals", _cached_normals);
+    _raycast_shader.setBool("use_history", use_history);
+    _raycast_shader.setBool("use_proxy", _proxy_bounds);
+    _raycast_shader.setFloat("proxy_margin", 2.0f * PROXY_MARGIN / _dims.x +
+                             _step_size * float(1 << (_levels.size() - 1)));
+    _raycast_shader.setFloat("near_distance", near_distance);
+    _raycast_shader.setUInt("history_epoch", _history_epoch);
+    _raycast_shader.setFloat("history_backoff", REPROJECTION_BACKOFF);
+
+    bindLevelTextures(_raycast_shader);
+    glBindImageTexture(0, _raycast_tex, 0, GL_FALSE, 0,
+                       GL_WRITE_ONLY, GL_RGBA8);
+    glBindImageTexture(3, _proxy_t_min_tex, 0, GL_FALSE, 0,
+                       GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(4, _proxy_t_max_tex, 0, GL_FALSE, 0,
+                       GL_READ_ONLY, GL_R32F);
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    _history_valid = true;
+    _history_inv_mvp = inv_mvp;
+    _history_camera_pos = camera_pos_tex_space;
+    _history_origin = base.origin;
+    _history_epoch = _occupancy_epoch;
 
-    glBindVertexArray(_box_vao);
+    _composite_shader.use();
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_3D, _tsdf_tex);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_3D, _color_tex);
-    glDrawElements(GL_TRIANGLE_STRIP, 14, GL_UNSIGNED_INT, 0);
+    glBindTexture(GL_TEXTURE_2D, _raycast_tex);
+    glBindVertexArray(_empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void
+Volume::renderViews(const RenderView *views, int count, RenderTarget *target)
+{
+    PROFILE_SCOPE("Volume::renderViews");
+    if (count <= 0)
+        return;
+    if (count > target->getLayers())
+        throw std::runtime_error("More views than render target layers");
+    updateBricks();
+
+    // Unlike draw(), views are given in the world space of the integrated
+    // frames, so undo the y and z flip of the integration shader. The result
+    // is relative to the current origin, like the raycaster expects.
+    const Level &base = _levels[0];
+    glm::mat4 flip = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, -1.0f));
+    flip[3] = glm::vec4(0.0f, 1.0f, 1.0f, 1.0f);
+    glm::mat4 world_to_tex =
+        glm::translate(glm::mat4(1.0f), -glm::vec3(base.origin) / _dims) *
+        flip *
+        glm::inverse(base.texture_to_model) *
+        glm::inverse(_model);
+    glm::mat4 tex_to_world = glm::inverse(world_to_tex);
+    // Gradients in voxel units are covectors of texture space
+    glm::mat3 normal_matrix = glm::transpose(glm::mat3(world_to_tex)) *
+                              glm::mat3(glm::scale(glm::mat4(1.0f), _dims));
+
+    _render_shader.use();
+    _render_shader.setVec3("volume_dims", _dims);
+    _render_shader.setFloat("step_size", _step_size);
+    _render_shader.setMat3("normal_matrix", normal_matrix);
+    _render_shader.setBool("cached_normals", _cached_normals);
+    _render_shader.setIVec2("size", glm::ivec2(target->getSize()));
+    bindLevelTextures(_render_shader);
+
+    glBindImageTexture(0, target->getColorTexture(), 0, GL_TRUE, 0,
+                       GL_WRITE_ONLY, GL_RGBA8);
+    glBindImageTexture(1, target->getDepthTexture(), 0, GL_TRUE, 0,
+                       GL_WRITE_ONLY, GL_R32F);
+    glBindImageTexture(2, target->getNormalTexture(), 0, GL_TRUE, 0,
+                       GL_WRITE_ONLY, GL_RGBA16F);
+
+    glm::uvec2 size = target->getSize();
+    for (int first = 0; first < count; first += MAX_RENDER_VIEWS) {
+        int chunk = std::min(count - first, MAX_RENDER_VIEWS);
+        for (int i = 0; i < chunk; ++i) {
+            const RenderView &view = views[first + i];
+            glm::mat4 pose = glm::inverse(view.extrinsic);
+            std::string index = "[" + std::to_string(i) + "]";
+            _render_shader.setVec3("view_origin" + index,
+                                   glm::vec3(world_to_tex * pose[3]));
+            _render_shader.setMat3("view_rays" + index,
+                                   glm::mat3(world_to_tex) *
+                                   glm::mat3(pose) *
+                                   glm::inverse(view.intrinsic));
+            _render_shader.setVec4("view_depth" + index,
+                                   glm::row(view.extrinsic * tex_to_world, 2));
+        }
+        _render_shader.setInt("first_layer", first);
+        _render_shader.setInt("num_views", chunk);
+        glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, chunk);
+    }
+
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Every level samples its own texture units, see bindLevelTextures().
+// The occupancy textures go after the voxel textures of all the levels.
+void
+Volume::setupSamplers(Shader &shader)
+{
+    shader.use();
+    shader.setInt("num_levels", int(_levels.size()));
+    for (int i = 0; i < MAX_VOLUME_LEVELS; ++i) {
+        std::string index = "[" + std::to_string(i) + "]";
+        if (_format == PACKED_VOXELS) {
+            shader.setInt("voxel_tex" + index, i);
+        } else {
+            shader.setInt("tsdf_tex" + index, i * 2);
+            shader.setInt("color_tex" + index, i * 2 + 1);
+        }
+        shader.setInt("occupancy_tex" + index, OCCUPANCY_UNIT + i);
+        shader.setInt("normal_tex" + index, NORMAL_UNIT + i);
+    }
+}
+
+// The shader must be in use
+void
+Volume::bindLevelTextures(const Shader &shader)
+{
+    for (int i = 0; i < int(_levels.size()); ++i) {
+        const Level &level = _levels[i];
+        shader.setIVec3("volume_wrap[" + std::to_string(i) + "]",
+                        wrappedOrigin(level));
+        if (_format == PACKED_VOXELS) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glBindTexture(GL_TEXTURE_3D, level.voxel_tex);
+        } else {
+            glActiveTexture(GL_TEXTURE0 + i * 2);
+            glBindTexture(GL_TEXTURE_3D, level.tsdf_tex);
+            glActiveTexture(GL_TEXTURE0 + i * 2 + 1);
+            glBindTexture(GL_TEXTURE_3D, level.color_tex);
+        }
+        glActiveTexture(GL_TEXTURE0 + OCCUPANCY_UNIT + i);
+        glBindTexture(GL_TEXTURE_3D, level.occupancy_tex);
+        glActiveTexture(GL_TEXTURE0 + NORMAL_UNIT + i);
+        glBindTexture(GL_TEXTURE_3D, level.normal_tex);
+    }
+}
+
+// Bring the occupancy and the normals of the touched bricks and their
+// neighbours up to date, then clear the flags they share
+void
+Volume::updateBricks()
+{
+    if (!_occupancy_dirty && !_normals_dirty)
+        return;
+    updateOccupancy();
+    updateNormals();
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    for (const Level &level : _levels) {
+        GLuint zero = 0;
+        glClearNamedBufferData(level.touched_buffer, GL_R32UI, GL_RED_INTEGER,
+                               GL_UNSIGNED_INT, &zero);
+    }
+}
+
+// Flag the bricks of every level that may contain a surface. Only runs when
+// the voxels have changed since the last time.
+void
+Volume::updateOccupancy()
+{
+    if (!_occupancy_dirty)
+        return;
+    PROFILE_SCOPE("Volume::updateOccupancy");
+    _occupancy_shader.use();
+    _occupancy_shader.setUInt("epoch", ++_occupancy_epoch);
+    glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+    for (const Level &level : _levels) {
+        bindLevelImages(level);
+        glBindImageTexture(3, level.occupancy_tex, 0, GL_TRUE, 0,
+                           GL_READ_WRITE, GL_RG32UI);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, level.touched_buffer);
+        glDispatchCompute(bricks.x, bricks.y, bricks.z);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    _occupancy_dirty = false;
+    buildProxy();
+}
+
+// Append a box for every occupied brick of every level
+void
+Volume::buildProxy()
+{
+    PROFILE_SCOPE("Volume::buildProxy");
+    GLuint zero = 0;
+    glClearNamedBufferSubData(_proxy_command_buffer, GL_R32UI,
+                              sizeof(GLuint), sizeof(GLuint),
+                              GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    _proxy_build_shader.use();
+    _proxy_build_shader.setIVec3("volume_dims", glm::ivec3(_dims));
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _proxy_command_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _proxy_brick_buffer);
+    glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+    for (int i = 0; i < int(_levels.size()); ++i) {
+        const Level &level = _levels[i];
+        _proxy_build_shader.setInt("level", i);
+        _proxy_build_shader.setIVec3("volume_wrap", wrappedOrigin(level));
+        glBindImageTexture(3, level.occupancy_tex, 0, GL_TRUE, 0,
+                           GL_READ_ONLY, GL_RG32UI);
+        glDispatchCompute((bricks.x + 7) / 8, (bricks.y + 7) / 8, bricks.z);
+    }
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                    GL_COMMAND_BARRIER_BIT);
+}
+
+// Rasterize the proxy boxes into the distances where every ray enters the
+// first one and leaves the last one
+void
+Volume::drawProxy(const glm::mat4 &mvp, glm::vec3 camera_pos_tex_space)
+{
+    PROFILE_SCOPE("Volume::drawProxy");
+    glBindFramebuffer(GL_FRAMEBUFFER, _proxy_fbo);
+    const GLfloat far[] = {1e30f, 0.0f, 0.0f, 0.0f};
+    const GLfloat near[] = {0.0f, 0.0f, 0.0f, 0.0f};
+    glClearBufferfv(GL_COLOR, 0, far);
+    glClearBufferfv(GL_COLOR, 1, near);
+
+    glEnablei(GL_BLEND, 0);
+    glEnablei(GL_BLEND, 1);
+    glBlendEquationi(0, GL_MIN);
+    glBlendEquationi(1, GL_MAX);
+
+    _proxy_shader.use();
+    _proxy_shader.setMat4("mvp", mvp);
+    _proxy_shader.setVec3("camera_pos_tex_space", camera_pos_tex_space);
+    _proxy_shader.setFloat("margin", PROXY_MARGIN / _dims.x);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _proxy_brick_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _proxy_command_buffer);
+    glBindVertexArray(_empty_vao);
+    glDrawArraysIndirect(GL_TRIANGLES, (void *)0);
+
+    glDisablei(GL_BLEND, 0);
+    glDisablei(GL_BLEND, 1);
+    glBlendEquation(GL_FUNC_ADD);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+// Recompute the normals of the touched bricks and their neighbours.
+// Without cached normals the touched bricks are forgotten,
+// setCachedNormals() touches every brick anyway.
+void
+Volume::updateNormals()
+{
+    if (!_normals_dirty)
+        return;
+    _normals_dirty = false;
+    if (!_cached_normals)
+        return;
+    PROFILE_SCOPE("Volume::updateNormals");
+    _normals_shader.use();
+    glm::ivec3 bricks = glm::ivec3(_dims) / OCCUPANCY_BRICK_SIZE;
+    for (const Level &level : _levels) {
+        bindLevelImages(level);
+        glBindImageTexture(4, level.normal_tex, 0, GL_TRUE, 0,
+                           GL_WRITE_ONLY, GL_RG8_SNORM);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, level.touched_buffer);
+        glDispatchCompute(bricks.x, bricks.y, bricks.z);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// For changes made outside of the integration shader
+void
+Volume::touchAllBricks(const Level &level)
+{
+    GLuint one = 1;
+    glClearNamedBufferData(level.touched_buffer, GL_R32UI, GL_RED_INTEGER,
+                           GL_UNSIGNED_INT, &one);
+    _occupancy_dirty = true;
+    _normals_dirty = true;
+}
+
+void
+Volume::setCachedNormals(bool cached_normals)
+{
+    _cached_normals = cached_normals;
+    if (!_cached_normals)
+        return;
+    // Created on first use, and the normals may be stale if they were
+    // turned off in between
+    for (Level &level : _levels) {
+        if (!level.normal_tex)
+            createNormalTexture(&level);
+        touchAllBricks(level);
+    }
+}
+
+// Output of the raycaster and the hits it keeps for the next frame
+void
+Volume::createRaycastTextures(glm::ivec2 size)
+{
+    GLuint *textures[] = {&_raycast_tex, &_hit_history_tex, &_reprojected_tex,
+                          &_proxy_t_min_tex, &_proxy_t_max_tex};
+    GLenum formats[] = {GL_RGBA8, GL_R32F, GL_R32UI, GL_R32F, GL_R32F};
+    for (int i = 0; i < 5; ++i) {
+        if (*textures[i])
+            glDeleteTextures(1, textures[i]);
+        glGenTextures(1, textures[i]);
+        glBindTexture(GL_TEXTURE_2D, *textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], size.x, size.y);
+    }
+
+    if (!_proxy_fbo)
+        glGenFramebuffers(1, &_proxy_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, _proxy_fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         _proxy_t_min_tex, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                         _proxy_t_max_tex, 0);
+    GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, buffers);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    _raycast_size = size;
+    _history_valid = false;
 }
 
 void
 Volume::reset()
 {
-    glClearTexImage(_tsdf_tex, 0, GL_RED, GL_HALF_FLOAT, (void *)0);
+    for (Level &level : _levels) {
+        clearRegion(level, glm::ivec3(0), glm::ivec3(_dims));
+        level.origin = glm::ivec3(0);
+        touchAllBricks(level);
+        GLuint zero = 0;
+        glClearNamedBufferData(level.dirty_buffer, GL_R32UI, GL_RED_INTEGER,
+                               GL_UNSIGNED_INT, &zero);
+        level.evicted_dirty.clear();
+    }
+    if (_block_store)
+        _block_store->clear();
+    updateWrapMode();
+    _history_valid = false;
+    ++_reset_count;
+}
+
+void
+Volume::setMaxWeight(int max_weight)
+{
+    _max_weight = std::max(1, std::min(max_weight, getMaxWeightLimit()));
+}
+
+int
+Volume::getMaxWeightLimit() const
+{
+    return _format == SEPARATE_VOXELS_8BIT_WEIGHT ? 255 : 65535;
+}
+
+void
+Volume::setRolling(bool rolling)
+{
+    _rolling = rolling;
+    updateWrapMode();
+}
+
+// Shift the volume so it stays centered around the sensor. Only the slabs
+// that become exposed by the shift are cleared, the rest of the voxels keep
+// their texels thanks to the toroidal addressing.
+void
+Volume::roll(const glm::mat4 &extrinsic)
+{
+    PROFILE_SCOPE("Volume::roll");
+    const Level &base = _levels[0];
+
+    glm::vec4 sensor_pos = glm::inverse(extrinsic) *
+        glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    glm::vec3 sensor_tex = glm::vec3(
+        glm::inverse(base.texture_to_model) *
+        glm::inverse(_model) *
+        sensor_pos);
+    // Undo the y and z inversion done by the integration shader
+    sensor_tex.y = 1.0f - sensor_tex.y;
+    sensor_tex.z = 1.0f - sensor_tex.z;
+
+    glm::vec3 center = glm::vec3(base.origin) + _dims * 0.5f;
+    glm::vec3 diff = sensor_tex * _dims - center;
+
+    // The levels stay concentric, so level 0 moves in steps that every level
+    // can follow with a whole number of its own voxels (or blocks, when they
+    // are streamed)
+    int coarsest = 1 << (int(_levels.size()) - 1);
+    int step = coarsest * (_block_store ? BLOCK_SIZE : 1);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float distance = std::abs(diff[axis]) * _resolution;
+        if (distance <= _roll_threshold) {
+            // Start bringing back the blocks the volume is heading to
+            if (_block_store && distance > _roll_threshold * 0.5f) {
+                for (int i = 0; i < int(_levels.size()); ++i) {
+                    int origin = _levels[i].origin[axis];
+                    prefetchSlab(i, axis, diff[axis] > 0.0f
+                                 ? origin + int(_dims[axis])
+                                 : origin - BLOCK_SIZE);
+                }
+            }
+            continue;
+        }
+
+        int shift = int(std::round(diff[axis] / step)) * step;
+        if (shift == 0)
+            continue;
+        for (int i = 0; i < int(_levels.size()); ++i)
+            shiftLevel(i, axis, shift >> i);
+    }
+
+    updateWrapMode();
+}
+
+// Move a level 'shift' voxels along 'axis', evicting the slab that leaves it
+// and clearing (or restoring) the one that enters it
+void
+Volume::shiftLevel(int level, int axis, int shift)
+{
+    Level &l = _levels[level];
+    int dim = int(_dims[axis]);
+    int count = std::min(std::abs(shift), dim);
+
+    if (_block_store)
+        evictSlab(level, axis,
+                  shift > 0 ? l.origin[axis] : l.origin[axis] + dim - count,
+                  count);
+
+    // First global voxel index of the newly exposed slab
+    int first = shift > 0 ? l.origin[axis] + dim + shift - count
+                          : l.origin[axis] + shift;
+    l.origin[axis] += shift;
+    clearSlab(l, axis, first, count);
+
+    if (_block_store)
+        restoreSlab(level, axis, first, count);
+    touchAllBricks(l);
+}
+
+// Clear 'count' slices perpendicular to 'axis', starting at the global voxel
+// index 'first'. The slab is split in two when it wraps around the textures.
+void
+Volume::clearSlab(const Level &level, int axis, int first, int count)
+{
+    int dim = int(_dims[axis]);
+    int start = ((first % dim) + dim) % dim;
+    int head = std::min(count, dim - start);
+
+    glm::ivec3 offset(0), size(_dims);
+    offset[axis] = start;
+    size[axis] = head;
+    clearRegion(level, offset, size);
+
+    if (count > head) {
+        offset[axis] = 0;
+        size[axis] = count - head;
+        clearRegion(level, offset, size);
+    }
+}
+
+void
+Volume::setBlockStore(BlockStore *block_store)
+{
+    glm::ivec3 dims(_dims);
+    if (dims % BLOCK_SIZE != glm::ivec3(0))
+        throw std::runtime_error(
+            "Volume dimensions must be multiples of the block size");
+    for (const Level &level : _levels)
+        if (level.origin % BLOCK_SIZE != glm::ivec3(0))
+            throw std::runtime_error(
+                "Volume origin must be a multiple of the block size");
+    _block_store = block_store;
+}
+
+static int
+floorDiv(int a, int b)
+{
+    return (a >= 0 ? a : a - b + 1) / b;
+}
+
+// Range of blocks, in global block coordinates, covered by a slab of the
+// volume perpendicular to 'axis'
+static void
+slabBlocks(glm::ivec3 origin, glm::ivec3 dims, int axis, int first, int count,
+           glm::ivec3 *begin, glm::ivec3 *end)
+{
+    for (int i = 0; i < 3; ++i) {
+        (*begin)[i] = floorDiv(origin[i], BLOCK_SIZE);
+        (*end)[i] = (*begin)[i] + dims[i] / BLOCK_SIZE;
+    }
+    (*begin)[axis] = floorDiv(first, BLOCK_SIZE);
+    (*end)[axis] = floorDiv(first + count, BLOCK_SIZE);
+}
+
+// Move the blocks of a slab that is about to leave the volume to the block
+// store. Blocks that were never observed are simply dropped.
+void
+Volume::evictSlab(int level, int axis, int first, int count)
+{
+    // Make sure the integration shader writes are visible to the readback
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    Level &l = _levels[level];
+    glm::ivec3 blocks = glm::ivec3(_dims) / BLOCK_SIZE;
+    const int block_count = blocks.x * blocks.y * blocks.z;
+    std::vector<GLuint> dirty(2 * block_count);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glGetNamedBufferSubData(l.dirty_buffer, 0, dirty.size() * sizeof(GLuint),
+                            dirty.data());
+
+    glm::ivec3 begin, end, b;
+    slabBlocks(l.origin, glm::ivec3(_dims), axis, first, count, &begin, &end);
+    for (b.z = begin.z; b.z < end.z; ++b.z)
+    for (b.y = begin.y; b.y < end.y; ++b.y)
+    for (b.x = begin.x; b.x < end.x; ++b.x) {
+        std::vector<unsigned char> data;
+        if (readBlock(level, b, &data))
+            _block_store->put(level, b, std::move(data));
+        // The flags go with the block, the texels are reused by another one
+        glm::ivec3 t = (b % blocks + blocks) % blocks;
+        int index = (t.z * blocks.y + t.y) * blocks.x + t.x;
+        if (dirty[index])
+            l.evicted_dirty.push_back(b);
+        dirty[index] = 0;
+        dirty[block_count + index] = 0;
+    }
+    glNamedBufferSubData(l.dirty_buffer, 0, dirty.size() * sizeof(GLuint),
+                         dirty.data());
+}
+
+// Upload the stored blocks of a slab that has just entered the volume. The
+// slab must have been cleared already.
+void
+Volume::restoreSlab(int level, int axis, int first, int count)
+{
+    glm::ivec3 begin, end, b;
+    slabBlocks(_levels[level].origin, glm::ivec3(_dims), axis, first, count,
+               &begin, &end);
+    std::vector<unsigned char> data;
+    for (b.z = begin.z; b.z < end.z; ++b.z)
+    for (b.y = begin.y; b.y < end.y; ++b.y)
+    for (b.x = begin.x; b.x < end.x; ++b.x) {
+        if (_block_store->take(level, b, &data))
+            writeBlock(level, b, data);
+    }
+}
+
+void
+Volume::prefetchSlab(int level, int axis, int first)
+{
+    glm::ivec3 begin, end, b;
+    slabBlocks(_levels[level].origin, glm::ivec3(_dims), axis, first,
+               BLOCK_SIZE, &begin, &end);
+    for (b.z = begin.z; b.z < end.z; ++b.z)
+    for (b.y = begin.y; b.y < end.y; ++b.y)
+    for (b.x = begin.x; b.x < end.x; ++b.x)
+        _block_store->prefetch(level, b);
+}
+
+void
+Volume::setModel(const glm::mat4 &model)
+{
+    _model = model;
+    // The hits of the last frame were cast into the old placement
+    _history_valid = false;
+}
+
+glm::vec3
+Volume::voxelToModel(glm::vec3 voxel, int level) const
+{
+    return glm::vec3(getVoxelToModel(level) * glm::vec4(voxel, 1.0f));
+}
+
+glm::mat4
+Volume::getVoxelToModel(int level) const
+{
+    // Same y and z inversion as the integration shader
+    glm::mat4 voxel_to_tex = glm::translate(glm::mat4(1.0f),
+                                            glm::vec3(0.0f, 1.0f, 1.0f));
+    voxel_to_tex = glm::scale(voxel_to_tex,
+                              glm::vec3(1.0f, -1.0f, -1.0f) / _dims);
+    return _model * _levels[level].texture_to_model * voxel_to_tex;
+}
+
+static float
+halfToFloat(unsigned short h)
+{
+    int exponent = (h >> 10) & 0x1F;
+    int mantissa = h & 0x3FF;
+    float value;
+    if (exponent == 0)
+        value = std::ldexp(float(mantissa), -24);
+    else if (exponent == 31)
+        value = mantissa ? NAN : INFINITY;
+    else
+        value = std::ldexp(float(mantissa | 0x400), exponent - 25);
+    return (h & 0x8000) ? -value : value;
+}
+
+// Split a region where it wraps around the texture borders. Each piece is
+// (texel start, offset in the region, length) along one axis.
+static void
+splitRegion(glm::ivec3 first, glm::ivec3 size, glm::ivec3 dims,
+            std::vector<glm::ivec3> pieces[3])
+{
+    for (int axis = 0; axis < 3; ++axis) {
+        int start = ((first[axis] % dims[axis]) + dims[axis]) % dims[axis];
+        for (int offset = 0; offset < size[axis]; ) {
+            int length = std::min(size[axis] - offset, dims[axis] - start);
+            pieces[axis].push_back(glm::ivec3(start, offset, length));
+            offset += length;
+            start = 0;
+        }
+    }
+}
+
+void
+Volume::readRegion(glm::ivec3 first, glm::ivec3 size, BrickedGrid<Voxel> *grid,
+                   int level)
+{
+    PROFILE_SCOPE("Volume::readRegion");
+    // Make sure the integration shader writes are visible to the readback
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    grid->resize(size);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    std::vector<glm::ivec3> pieces[3];
+    splitRegion(first, size, glm::ivec3(_dims), pieces);
+
+    for (const glm::ivec3 &z : pieces[2])
+    for (const glm::ivec3 &y : pieces[1])
+    for (const glm::ivec3 &x : pieces[0])
+        readTexels(_levels[level],
+                   glm::ivec3(x[0], y[0], z[0]),
+                   glm::ivec3(x[2], y[2], z[2]),
+                   glm::ivec3(x[1], y[1], z[1]),
+                   grid);
+}
+
+void
+Volume::copyRegion(glm::ivec3 first, glm::ivec3 size, int level,
+                   size_t offset)
+{
+    PROFILE_SCOPE("Volume::copyRegion");
+    // Make sure the integration shader writes are visible to the copy
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT |
+                    GL_PIXEL_BUFFER_BARRIER_BIT);
+
+    const Level &l = _levels[level];
+    const size_t voxels = size_t(size.x) * size.y * size.z;
+    struct {
+        GLuint texture;
+        GLenum format, type;
+        size_t texel_size;
+        size_t plane;
+    } copies[3];
+    int count;
+    if (_format == PACKED_VOXELS) {
+        copies[0] = {l.voxel_tex, GL_RG_INTEGER, GL_UNSIGNED_INT, 8, 0};
+        count = 1;
+    } else {
+        copies[0] = {l.tsdf_tex, GL_RED, GL_HALF_FLOAT, 2, 0};
+        copies[1] = {l.color_tex, GL_RGBA, GL_UNSIGNED_BYTE, 4, voxels * 2};
+        copies[2] = {l.weight_tex, GL_RED_INTEGER, GL_UNSIGNED_SHORT, 2,
+                     voxels * 6};
+        count = 3;
+    }
+
+    // The pieces are written straight into their place inside the region
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glPixelStorei(GL_PACK_ROW_LENGTH, size.x);
+    glPixelStorei(GL_PACK_IMAGE_HEIGHT, size.y);
+
+    std::vector<glm::ivec3> pieces[3];
+    splitRegion(first, size, glm::ivec3(_dims), pieces);
+    for (const glm::ivec3 &z : pieces[2])
+    for (const glm::ivec3 &y : pieces[1])
+    for (const glm::ivec3 &x : pieces[0])
+    for (int i = 0; i < count; ++i) {
+        size_t index = (size_t(z[1]) * size.y + y[1]) * size.x + x[1];
+        size_t start = offset + copies[i].plane + index * copies[i].texel_size;
+        // With a pack buffer bound the pointer is an offset into it, and the
+        // copy is queued instead of stalling
+        glGetTextureSubImage(copies[i].texture, 0,
+                             x[0], y[0], z[0],
+                             x[2], y[2], z[2],
+                             copies[i].format, copies[i].type,
+                             GLsizei(offset + voxels * 8),
+                             (void *)start);
+    }
+
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_IMAGE_HEIGHT, 0);
+}
+
+uint64_t
+Volume::checksum(int level)
+{
+    BrickedGrid<Voxel> grid;
+    readRegion(_levels[level].origin, glm::ivec3(_dims), &grid, level);
+    return checksumGrid(grid);
+}
+
+void
+Volume::readTexels(const Level &level, glm::ivec3 texel, glm::ivec3 size,
+                   glm::ivec3 offset, BrickedGrid<Voxel> *grid)
+{
+    const GLsizei voxels = size.x * size.y * size.z;
+    glm::ivec3 p;
+
+    if (_format == PACKED_VOXELS) {
+        std::vector<unsigned int> texels(voxels * 2);
+        glGetTextureSubImage(level.voxel_tex, 0,
+                             texel.x, texel.y, texel.z,
+                             size.x, size.y, size.z,
+                             GL_RG_INTEGER, GL_UNSIGNED_INT,
+                             voxels * 8, texels.data());
+        const unsigned int *t = texels.data();
+        for (p.z = 0; p.z < size.z; ++p.z)
+        for (p.y = 0; p.y < size.y; ++p.y)
+        for (p.x = 0; p.x < size.x; ++p.x, t += 2) {
+            Voxel &voxel = grid->at(offset + p);
+            voxel.tsdf = std::max(short(t[0] & 0xFFFF) / 32767.0f, -1.0f);
+            voxel.weight = (unsigned short)(t[0] >> 16);
+            voxel.color[0] = t[1] & 0xFF;
+            voxel.color[1] = (t[1] >> 8) & 0xFF;
+            voxel.color[2] = (t[1] >> 16) & 0xFF;
+        }
+        return;
+    }
+
+    std::vector<unsigned short> tsdf(voxels);
+    std::vector<unsigned char> color(voxels * 4);
+    std::vector<unsigned short> weight(voxels);
+    glGetTextureSubImage(level.tsdf_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         size.x, size.y, size.z,
+                         GL_RED, GL_HALF_FLOAT,
+                         voxels * 2, tsdf.data());
+    glGetTextureSubImage(level.color_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         size.x, size.y, size.z,
+                         GL_RGBA, GL_UNSIGNED_BYTE,
+                         voxels * 4, color.data());
+    glGetTextureSubImage(level.weight_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         size.x, size.y, size.z,
+                         GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                         voxels * 2, weight.data());
+    size_t i = 0;
+    for (p.z = 0; p.z < size.z; ++p.z)
+    for (p.y = 0; p.y < size.y; ++p.y)
+    for (p.x = 0; p.x < size.x; ++p.x, ++i) {
+        Voxel &voxel = grid->at(offset + p);
+        voxel.tsdf = halfToFloat(tsdf[i]);
+        voxel.weight = weight[i];
+        voxel.color[0] = color[i * 4 + 0];
+        voxel.color[1] = color[i * 4 + 1];
+        voxel.color[2] = color[i * 4 + 2];
+    }
+}
+
+// A block is stored as three consecutive planes: tsdf (half float), color
+// (RGBA8) and weight (uint16, also for 8-bit weight textures), or as the raw
+// texels with packed voxels. Returns false if no voxel of the block has been
+// observed yet.
+bool
+Volume::readBlock(int level, glm::ivec3 block,
+                  std::vector<unsigned char> *data)
+{
+    const Level &l = _levels[level];
+    glm::ivec3 dims(_dims);
+    glm::ivec3 texel = ((block * BLOCK_SIZE) % dims + dims) % dims;
+    const GLsizei voxels = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+    data->resize(voxels * 8);
+
+    if (_format == PACKED_VOXELS) {
+        glGetTextureSubImage(l.voxel_tex, 0,
+                             texel.x, texel.y, texel.z,
+                             BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                             GL_RG_INTEGER, GL_UNSIGNED_INT,
+                             voxels * 8, data->data());
+        // The weight lives in the high half of the first word
+        const unsigned int *texels =
+            reinterpret_cast<const unsigned int *>(data->data());
+        for (GLsizei i = 0; i < voxels; ++i)
+            if (texels[i * 2] >> 16)
+                return true;
+        return false;
+    }
+
+    unsigned char *tsdf   = data->data();
+    unsigned char *color  = tsdf + voxels * 2;
+    unsigned char *weight = color + voxels * 4;
+
+    glGetTextureSubImage(l.weight_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                         GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                         voxels * 2, weight);
+    const unsigned short *weights =
+        reinterpret_cast<const unsigned short *>(weight);
+    if (std::all_of(weights, weights + voxels,
+                    [](unsigned short w) { return w == 0; }))
+        return false;
+
+    glGetTextureSubImage(l.tsdf_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                         GL_RED, GL_HALF_FLOAT,
+                         voxels * 2, tsdf);
+    glGetTextureSubImage(l.color_tex, 0,
+                         texel.x, texel.y, texel.z,
+                         BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                         GL_RGBA, GL_UNSIGNED_BYTE,
+                         voxels * 4, color);
+    return true;
+}
+
+std::vector<glm::ivec3>
+Volume::copyModifiedBlocks(int level, GLuint buffer, size_t offset)
+{
+    Level &l = _levels[level];
+    if (glm::any(glm::notEqual(l.origin % BLOCK_SIZE, glm::ivec3(0))))
+        throw std::runtime_error("Modified blocks are only tracked for "
+                                 "volumes that roll in whole blocks");
+
+    glm::ivec3 blocks = glm::ivec3(_dims) / BLOCK_SIZE;
+    GLsizeiptr size = sizeof(GLuint) * blocks.x * blocks.y * blocks.z;
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glCopyNamedBufferSubData(l.dirty_buffer, buffer, 0, offset, size);
+    GLuint zero = 0;
+    glClearNamedBufferSubData(l.dirty_buffer, GL_R32UI, 0, size,
+                              GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    std::vector<glm::ivec3> evicted;
+    evicted.swap(l.evicted_dirty);
+    return evicted;
+}
+
+void
+Volume::copyObservedBlocks(int level, GLuint buffer, size_t offset)
+{
+    const Level &l = _levels[level];
+    if (glm::any(glm::notEqual(l.origin % BLOCK_SIZE, glm::ivec3(0))))
+        throw std::runtime_error("Observed blocks are only tracked for "
+                                 "volumes that roll in whole blocks");
+
+    glm::ivec3 blocks = glm::ivec3(_dims) / BLOCK_SIZE;
+    GLsizeiptr size = sizeof(GLuint) * blocks.x * blocks.y * blocks.z;
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glCopyNamedBufferSubData(l.dirty_buffer, buffer, size, offset, size);
+}
+
+std::vector<glm::ivec3>
+Volume::decodeBlockFlags(const GLuint *flags, glm::ivec3 origin) const
+{
+    glm::ivec3 blocks = glm::ivec3(_dims) / BLOCK_SIZE;
+    glm::ivec3 first = origin / BLOCK_SIZE;
+    std::vector<glm::ivec3> modified;
+    glm::ivec3 b;
+    for (b.z = first.z; b.z < first.z + blocks.z; ++b.z)
+    for (b.y = first.y; b.y < first.y + blocks.y; ++b.y)
+    for (b.x = first.x; b.x < first.x + blocks.x; ++b.x) {
+        glm::ivec3 t = (b % blocks + blocks) % blocks;
+        if (flags[(t.z * blocks.y + t.y) * blocks.x + t.x])
+            modified.push_back(b);
+    }
+    return modified;
+}
+
+bool
+Volume::containsBlock(int level, glm::ivec3 block) const
+{
+    glm::ivec3 first = block * BLOCK_SIZE - _levels[level].origin;
+    return glm::all(glm::greaterThanEqual(first, glm::ivec3(0))) &&
+           glm::all(glm::lessThanEqual(first + BLOCK_SIZE, glm::ivec3(_dims)));
+}
+
+void
+Volume::uploadBlocks(int level, const std::vector<glm::ivec3> &blocks,
+                     const std::vector<std::vector<unsigned char>> &data)
+{
+    PROFILE_SCOPE("Volume::uploadBlocks");
+    for (size_t i = 0; i < blocks.size(); ++i)
+        writeBlock(level, blocks[i], data[i]);
+    touchAllBricks(_levels[level]);
+    _history_valid = false;
+}
+
+void
+Volume::writeBlock(int level, glm::ivec3 block,
+                   const std::vector<unsigned char> &data)
+{
+    const Level &l = _levels[level];
+    glm::ivec3 dims(_dims);
+    glm::ivec3 texel = ((block * BLOCK_SIZE) % dims + dims) % dims;
+    const GLsizei voxels = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+    // The block holds observed voxels again, see copyObservedBlocks()
+    glm::ivec3 blocks = dims / BLOCK_SIZE;
+    glm::ivec3 t = texel / BLOCK_SIZE;
+    GLintptr index = blocks.x * blocks.y * blocks.z +
+                     (t.z * blocks.y + t.y) * blocks.x + t.x;
+    GLuint one = 1;
+    glNamedBufferSubData(l.dirty_buffer, sizeof(GLuint) * index,
+                         sizeof(GLuint), &one);
+
+    if (_format == PACKED_VOXELS) {
+        glTextureSubImage3D(l.voxel_tex, 0,
+                            texel.x, texel.y, texel.z,
+                            BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                            GL_RG_INTEGER, GL_UNSIGNED_INT, data.data());
+        return;
+    }
+
+    const unsigned char *tsdf   = data.data();
+    const unsigned char *color  = tsdf + voxels * 2;
+    const unsigned char *weight = color + voxels * 4;
+
+    glTextureSubImage3D(l.tsdf_tex, 0,
+                        texel.x, texel.y, texel.z,
+                        BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        GL_RED, GL_HALF_FLOAT, tsdf);
+    glTextureSubImage3D(l.color_tex, 0,
+                        texel.x, texel.y, texel.z,
+                        BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        GL_RGBA, GL_UNSIGNED_BYTE, color);
+    glTextureSubImage3D(l.weight_tex, 0,
+                        texel.x, texel.y, texel.z,
+                        BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        GL_RED_INTEGER, GL_UNSIGNED_SHORT, weight);
+}
+
+void
+Volume::decodeBlock(VoxelFormat format, const std::vector<unsigned char> &data,
+                    BrickedGrid<Voxel> *grid, glm::ivec3 offset)
+{
+    decodeRegion(format, data.data(), glm::ivec3(BLOCK_SIZE), grid, offset);
+}
+
+void
+Volume::decodeRegion(VoxelFormat format, const unsigned char *data,
+                     glm::ivec3 size, BrickedGrid<Voxel> *grid,
+                     glm::ivec3 offset)
+{
+    const size_t voxels = size_t(size.x) * size.y * size.z;
+    glm::ivec3 p;
+    size_t i = 0;
+
+    if (format == PACKED_VOXELS) {
+        const unsigned int *t = reinterpret_cast<const unsigned int *>(data);
+        for (p.z = 0; p.z < size.z; ++p.z)
+        for (p.y = 0; p.y < size.y; ++p.y)
+        for (p.x = 0; p.x < size.x; ++p.x, t += 2) {
+            Voxel &voxel = grid->at(offset + p);
+            voxel.tsdf = std::max(short(t[0] & 0xFFFF) / 32767.0f, -1.0f);
+            voxel.weight = (unsigned short)(t[0] >> 16);
+            voxel.color[0] = t[1] & 0xFF;
+            voxel.color[1] = (t[1] >> 8) & 0xFF;
+            voxel.color[2] = (t[1] >> 16) & 0xFF;
+        }
+        return;
+    }
+
+    const unsigned short *tsdf = reinterpret_cast<const unsigned short *>(data);
+    const unsigned char *color = data + voxels * 2;
+    const unsigned short *weight =
+        reinterpret_cast<const unsigned short *>(color + voxels * 4);
+    for (p.z = 0; p.z < size.z; ++p.z)
+    for (p.y = 0; p.y < size.y; ++p.y)
+    for (p.x = 0; p.x < size.x; ++p.x, ++i) {
+        Voxel &voxel = grid->at(offset + p);
+        voxel.tsdf = halfToFloat(tsdf[i]);
+        voxel.weight = weight[i];
+        voxel.color[0] = color[i * 4 + 0];
+        voxel.color[1] = color[i * 4 + 1];
+        voxel.color[2] = color[i * 4 + 2];
+    }
+}
+
+void
+Volume::clearRegion(const Level &level, glm::ivec3 offset, glm::ivec3 size)
+{
+    if (_format == PACKED_VOXELS) {
+        // Zero tsdf and weight, white color
+        unsigned int clear_voxel[] = {0, 0xFFFFFFFF};
+        glClearTexSubImage(level.voxel_tex, 0,
+                           offset.x, offset.y, offset.z,
+                           size.x, size.y, size.z,
+                           GL_RG_INTEGER, GL_UNSIGNED_INT, &clear_voxel);
+        return;
+    }
+
+    glClearTexSubImage(level.tsdf_tex, 0,
+                       offset.x, offset.y, offset.z,
+                       size.x, size.y, size.z,
+                       GL_RED, GL_HALF_FLOAT, (void *)0);
     unsigned char clear_color[] = {255, 255, 255, 255};
-    glClearTexImage(_color_tex, 0, GL_RGBA, GL_UNSIGNED_BYTE, &clear_color);
-    glClearTexImage(_weight_tex, 0, GL_RED_INTEGER, GL_SHORT, (void *)0);
-}
-
-// Create a box that will contain the volume.
-// The box is centered on its center of gravity.
-void
-Volume::createVolume()
-{
-    glm::vec3 min, max;
-    min = -(glm::vec3(_dims) * (_resolution * 0.5f));
-    max =  (glm::vec3(_dims) * (_resolution * 0.5f));
-
-    static GLfloat vertices[] = {
-        // vertices            texcoords
-        max.x, max.y, max.z,   1.0f, 1.0f, 1.0f,
-        min.x, max.y, max.z,   0.0f, 1.0f, 1.0f,
-        max.x, max.y, min.z,   1.0f, 1.0f, 0.0f,
-        min.x, max.y, min.z,   0.0f, 1.0f, 0.0f,
-        max.x, min.y, max.z,   1.0f, 0.0f, 1.0f,
-        min.x, min.y, max.z,   0.0f, 0.0f, 1.0f,
-        min.x, min.y, min.z,   0.0f, 0.0f, 0.0f,
-        max.x, min.y, min.z,   1.0f, 0.0f, 0.0f
-    };
-    static GLuint indices[] = {
-        3, 2, 6, 7, 4, 2, 0,
-        3, 1, 6, 5, 4, 1, 0
-    };
-
-    unsigned int vbo, ebo;
-    glGenVertexArrays(1, &_box_vao);
-    glBindVertexArray(_box_vao);
-
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER,
-                 sizeof(vertices),
-                 vertices,
-                 GL_STATIC_DRAW);
-
-    glGenBuffers(1, &ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 sizeof(indices),
-                 indices,
-                 GL_STATIC_DRAW);
-
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                          6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                          6 * sizeof(float), (void*)(3 * sizeof(float)));
+    glClearTexSubImage(level.color_tex, 0,
+                       offset.x, offset.y, offset.z,
+                       size.x, size.y, size.z,
+                       GL_RGBA, GL_UNSIGNED_BYTE, &clear_color);
+    glClearTexSubImage(level.weight_tex, 0,
+                       offset.x, offset.y, offset.z,
+                       size.x, size.y, size.z,
+                       GL_RED_INTEGER, GL_SHORT, (void *)0);
+}
+
+// Samples must wrap around the texture borders as soon as the volume has
+// been shifted, otherwise the raycaster would see a seam
+void
+Volume::updateWrapMode()
+{
+    // Packed voxels are fetched and wrapped by hand
+    if (_format == PACKED_VOXELS)
+        return;
+
+    for (const Level &level : _levels) {
+        GLint wrap = (_rolling || level.origin != glm::ivec3(0))
+            ? GL_REPEAT : GL_CLAMP_TO_BORDER;
+        GLuint textures[] = {level.tsdf_tex, level.color_tex};
+        for (GLuint tex : textures) {
+            glBindTexture(GL_TEXTURE_3D, tex);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, wrap);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, wrap);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, wrap);
+        }
+    }
+}
+
+// Texel that holds the first voxel of a level
+glm::ivec3
+Volume::wrappedOrigin(const Level &level) const
+{
+    glm::ivec3 dims(_dims);
+    return ((level.origin % dims) + dims) % dims;
 }
@@ -1,24 +1,100 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include "glad/glad.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "shader.hpp"
+#include "voxel_grid.hpp"
+
+// Edge length in voxels of the blocks streamed between the GPU and the host
+const int BLOCK_SIZE = 32;
+
+// Maximum number of frames integrated by a single dispatch. Must match the
+// integration shader.
+const int MAX_BATCH_FRAMES = 8;
+
+// Maximum number of resolution levels of a volume. Must match the raycaster.
+const int MAX_VOLUME_LEVELS = 4;
+
+// Edge length in texels of the bricks whose occupancy lets the raycaster skip
+// empty space. Must match the raycaster and the occupancy shader.
+const int OCCUPANCY_BRICK_SIZE = 8;
 
+// Edge length in pixels of the screen tiles raycast by a workgroup. Must match
+// the raycaster.
+const int RAYCAST_TILE_SIZE = 8;
+
+class BlockStore;
 class Camera;
+class RenderTarget;
+struct RenderView;
 
 class Volume {
 public:
+    enum VoxelFormat {
+        // Separate tsdf (R16F), color (RGBA8) and weight (R16UI) textures
+        SEPARATE_VOXELS,
+        // A single RG32UI texture with snorm16 tsdf, 16-bit weight and RGBA8
+        // color interleaved
+        PACKED_VOXELS,
+        // Like SEPARATE_VOXELS but with an R8UI weight, so the weight must be
+        // capped to at most 255
+        SEPARATE_VOXELS_8BIT_WEIGHT
+    };
+
+    // Level 0 has the given dimensions and resolution. Every additional level
+    // has the same dimensions but twice the voxel size of the previous one,
+    // and all of them share the same center.
     Volume(glm::vec3 dims, float resolution, glm::vec3 offset,
-           glm::vec2 frame_size);
+           glm::vec2 frame_size, VoxelFormat format = SEPARATE_VOXELS,
+           int levels = 1);
     ~Volume();
 
+    Volume(const Volume &) = delete;
+    Volume &operator=(const Volume &) = delete;
+
     void integrate(const unsigned short *depth_data,
                    const unsigned char  *color_data,
-                   const glm::mat4 &intrinsic,
+                   const glm::mat3 &intrinsic,
                    const glm::mat4 &extrinsic);
+    // Integrate up to MAX_BATCH_FRAMES frames in a single pass over the
+    // volume, so each voxel is loaded and stored once per batch instead of
+    // once per frame
+    void integrateBatch(const unsigned short *const *depth_data,
+                        const unsigned char  *const *color_data,
+                        const glm::mat3 &intrinsic,
+                        const glm::mat4 *extrinsics,
+                        int count);
+    // Remove the contribution of frames integrated earlier with the same
+    // data and extrinsics, so they can be integrated again with a corrected
+    // pose. The result is exact as long as the voxel weights haven't
+    // saturated and the voxels haven't left the volume in between.
+    void deintegrate(const unsigned short *depth_data,
+                     const unsigned char  *color_data,
+                     const glm::mat3 &intrinsic,
+                     const glm::mat4 &extrinsic);
+    void deintegrateBatch(const unsigned short *const *depth_data,
+                          const unsigned char  *const *color_data,
+                          const glm::mat3 &intrinsic,
+                          const glm::mat4 *extrinsics,
+                          int count);
+    // Move frames integrated earlier from the old extrinsics to the new ones.
+    // Unlike integrateBatch() the volume doesn't roll.
+    void reintegrateBatch(const unsigned short *const *depth_data,
+                          const unsigned char  *const *color_data,
+                          const glm::mat3 &intrinsic,
+                          const glm::mat4 *old_extrinsics,
+                          const glm::mat4 *new_extrinsics,
+                          int count);
     void draw(const Camera *camera);
+    // Raycast color, depth and normal maps of every view into the layers of
+    // the target, starting at layer 0. Views are dispatched MAX_RENDER_VIEWS
+    // at a time and nothing is read back, see RenderTarget::startReadback().
+    void renderViews(const RenderView *views, int count, RenderTarget *target);
     void reset();
 
     void setStepSize(float step_size) { _step_size = step_size; }
@@ -27,37 +103,266 @@ public:
     void setTruncMargin(float trunc_margin) { _trunc_margin = trunc_margin; }
     float getTruncMargin() const { return _trunc_margin; }
 
+    VoxelFormat getVoxelFormat() const { return _format; }
+
+    // Voxel weights saturate at this many observations, after which the
+    // running average keeps adapting at a fixed rate
+    void setMaxWeight(int max_weight);
+    int getMaxWeight() const { return _max_weight; }
+    int getMaxWeightLimit() const;
+
+    // GPU time of the last integration that has completed, in milliseconds
+    float getIntegrateTime() const { return _integrate_time; }
+
+    glm::ivec3 getDims() const { return glm::ivec3(_dims); }
+
+    int getLevels() const { return int(_levels.size()); }
+    float getResolution(int level = 0) const { return _levels[level].resolution; }
+
     void setDisplayMode(int display_mode) { _display_mode = display_mode; }
     int getDisplayMode() const { return _display_mode; }
 
+    // Skip the bricks of voxels that no frame of an integration can update,
+    // using a pyramid of the farthest depth around every pixel
+    void setDepthCulling(bool depth_culling) { _depth_culling = depth_culling; }
+    bool getDepthCulling() const { return _depth_culling; }
+
+    // Keep the normal of every voxel in a texture, updated only for the
+    // bricks touched by each integration, so shading reads one texel instead
+    // of computing the gradient from six
+    void setCachedNormals(bool cached_normals);
+    bool getCachedNormals() const { return _cached_normals; }
+
+    // Bound the rays of draw() with the occupied bricks, rasterized as boxes
+    void setProxyBounds(bool proxy_bounds) { _proxy_bounds = proxy_bounds; }
+    bool getProxyBounds() const { return _proxy_bounds; }
+
+    // Start the rays of draw() close to the surface hits of the previous
+    // frame reprojected into the current view
+    void setReprojection(bool reprojection) { _reprojection = reprojection; }
+    bool getReprojection() const { return _reprojection; }
+
+    void setRolling(bool rolling);
+    bool getRolling() const { return _rolling; }
+
+    void setRollThreshold(float roll_threshold) { _roll_threshold = roll_threshold; }
+    float getRollThreshold() const { return _roll_threshold; }
+
+    glm::ivec3 getOrigin(int level = 0) const { return _levels[level].origin; }
+
+    // Placement of the volume in the world, identity by default
+    void setModel(const glm::mat4 &model);
+    const glm::mat4 &getModel() const { return _model; }
+
+    // Model space position of a point given in global voxel coordinates,
+    // where integer coordinates are voxel corners
+    glm::vec3 voxelToModel(glm::vec3 voxel, int level = 0) const;
+    glm::mat4 getVoxelToModel(int level = 0) const;
+
+    // Copy a region of a level, in global voxel coordinates, to the host.
+    // This stalls until all pending integrations have finished.
+    void readRegion(glm::ivec3 first, glm::ivec3 size, BrickedGrid<Voxel> *grid,
+                    int level = 0);
+    // Read back a whole level and hash it with checksumGrid(). Stalls like
+    // readRegion().
+    uint64_t checksum(int level = 0);
+    // Queue a copy of a region of a level, in global voxel coordinates, into
+    // the buffer bound to GL_PIXEL_PACK_BUFFER, starting at 'offset'. Returns
+    // right away, the data is in place once a fence issued afterwards is
+    // signaled. Takes 8 bytes per voxel, laid out like a block of the block
+    // store, see decodeRegion(). Used by VolumeReadback.
+    void copyRegion(glm::ivec3 first, glm::ivec3 size, int level,
+                    size_t offset);
+
+    // Blocks leaving a rolling volume are evicted to the block store and
+    // brought back when the volume returns to them
+    void setBlockStore(BlockStore *block_store);
+    BlockStore *getBlockStore() const { return _block_store; }
+
+    // Copy the flags of the blocks of a level modified since the last call
+    // into 'buffer' at 'offset', one GLuint per block in texel order, and
+    // clear them. Doesn't wait for the GPU. Returns the modified blocks that
+    // left the volume in the meantime, in global block coordinates, their
+    // data is in the block store, or nowhere if none of their voxels was
+    // observed. Needs a level origin aligned to BLOCK_SIZE, which is always
+    // the case with a block store. Used by VolumeReadback.
+    std::vector<glm::ivec3> copyModifiedBlocks(int level, GLuint buffer,
+                                               size_t offset);
+    // Same for the blocks of a level modified since the last reset(),
+    // without clearing them. The ones that left the volume are in the block
+    // store.
+    void copyObservedBlocks(int level, GLuint buffer, size_t offset);
+    // Global block coordinates of the blocks flagged in a copy made while
+    // the level origin was 'origin'. Doesn't touch the GPU.
+    std::vector<glm::ivec3> decodeBlockFlags(const GLuint *flags,
+                                             glm::ivec3 origin) const;
+    // Whether a block, in global block coordinates, is inside the volume
+    bool containsBlock(int level, glm::ivec3 block) const;
+    // Write blocks kept by the block store back into the volume, e.g. when
+    // restoring a checkpoint. The blocks must be inside the volume.
+    void uploadBlocks(int level, const std::vector<glm::ivec3> &blocks,
+                      const std::vector<std::vector<unsigned char>> &data);
+    // Incremented by every reset()
+    int getResetCount() const { return _reset_count; }
+
+    // Unpack a block kept by the block store into a grid, starting at
+    // 'offset'. Doesn't touch the GPU, so it can run on any thread.
+    static void decodeBlock(VoxelFormat format,
+                            const std::vector<unsigned char> &data,
+                            BrickedGrid<Voxel> *grid, glm::ivec3 offset);
+    // Same for a region of any size, e.g. one copied with copyRegion()
+    static void decodeRegion(VoxelFormat format, const unsigned char *data,
+                             glm::ivec3 size, BrickedGrid<Voxel> *grid,
+                             glm::ivec3 offset);
+
+    // 2D array texture, layer 0 holds the first frame of the last batch
     GLuint getFrameColorTexture() const { return _frame_color_tex; }
 
 private:
-    void createVolume();
+    struct Level {
+        float      resolution;
+        glm::mat4  texture_to_model;
+        // Global index of the first voxel inside the level
+        glm::ivec3 origin = glm::ivec3(0);
+
+        GLuint     tsdf_tex = 0;
+        GLuint     color_tex = 0;
+        GLuint     weight_tex = 0;
+        GLuint     voxel_tex = 0;
+        GLuint     occupancy_tex = 0;
+        GLuint     normal_tex = 0;
+        // One uint per brick of texels, set by the integration shader
+        GLuint     touched_buffer = 0;
+        // Two uints per block of texels set by the integration shader, the
+        // first half cleared by copyModifiedBlocks(), the second one by
+        // reset()
+        GLuint     dirty_buffer = 0;
+        // Global coordinates of the modified blocks that left the volume
+        // since the last copyModifiedBlocks()
+        std::vector<glm::ivec3> evicted_dirty;
+    };
+
+    // Texture units of the occupancy and normals of level 0, the ones of the
+    // other levels follow
+    static const int OCCUPANCY_UNIT = 2 * MAX_VOLUME_LEVELS;
+    static const int NORMAL_UNIT = OCCUPANCY_UNIT + MAX_VOLUME_LEVELS;
+
+    void createSeparateTextures(Level *level);
+    void createPackedTextures(Level *level);
+    void createOccupancyTexture(Level *level);
+    void createNormalTexture(Level *level);
+    void touchAllBricks(const Level &level);
+    void createRaycastTextures(glm::ivec2 size);
+    void updateBatch(const unsigned short *const *depth_data,
+                     const unsigned char  *const *color_data,
+                     const glm::mat3 &intrinsic,
+                     const glm::mat4 *extrinsics,
+                     int count, bool deintegrate);
+    void buildDepthPyramid(int count);
+    void updateBricks();
+    void updateOccupancy();
+    void updateNormals();
+    void buildProxy();
+    void drawProxy(const glm::mat4 &mvp, glm::vec3 camera_pos_tex_space);
+    void bindLevelImages(const Level &level);
+    void setupSamplers(Shader &shader);
+    void bindLevelTextures(const Shader &shader);
+    void roll(const glm::mat4 &extrinsic);
+    void shiftLevel(int level, int axis, int shift);
+    void clearRegion(const Level &level, glm::ivec3 offset, glm::ivec3 size);
+    void clearSlab(const Level &level, int axis, int first, int count);
+    void evictSlab(int level, int axis, int first, int count);
+    void restoreSlab(int level, int axis, int first, int count);
+    void prefetchSlab(int level, int axis, int first);
+    void readTexels(const Level &level, glm::ivec3 texel, glm::ivec3 size,
+                    glm::ivec3 offset, BrickedGrid<Voxel> *grid);
+    bool readBlock(int level, glm::ivec3 block,
+                   std::vector<unsigned char> *data);
+    void writeBlock(int level, glm::ivec3 block,
+                    const std::vector<unsigned char> &data);
+    void updateWrapMode();
+    glm::ivec3 wrappedOrigin(const Level &level) const;
 
     glm::vec3 _dims;
     float     _resolution;
     glm::vec3 _offset;
     glm::vec2 _frame_size;
-
-    GLuint    _box_vao;
+    VoxelFormat _format;
 
     Shader    _integrate_shader;
     Shader    _raycast_shader;
+    Shader    _composite_shader;
+    Shader    _render_shader;
+    Shader    _occupancy_shader;
+    Shader    _reproject_shader;
+    Shader    _normals_shader;
+    Shader    _depth_pyramid_shader;
+    Shader    _proxy_build_shader;
+    Shader    _proxy_shader;
+
+    GLuint     _raycast_tex = 0;
+    GLuint     _hit_history_tex = 0;
+    GLuint     _reprojected_tex = 0;
+    GLuint     _proxy_t_min_tex = 0;
+    GLuint     _proxy_t_max_tex = 0;
+    GLuint     _proxy_fbo = 0;
+    glm::ivec2 _raycast_size = glm::ivec2(0);
+    // For draws without vertex data
+    GLuint     _empty_vao;
+
+    // Boxes of the occupied bricks of every level, rebuilt along with the
+    // occupancy, and the indirect draw command that draws them
+    bool       _proxy_bounds = true;
+    GLuint     _proxy_brick_buffer;
+    GLuint     _proxy_command_buffer;
 
-    glm::mat4 _texture_to_model;
     glm::mat4 _model;
 
-    GLuint    _tsdf_tex;
-    GLuint    _color_tex;
-    GLuint    _weight_tex;
+    std::vector<Level> _levels;
 
     GLuint    _frame_depth_tex;
     GLuint    _frame_color_tex;
+    GLuint    _depth_pyramid_tex;
+    int       _depth_pyramid_levels;
+    bool      _depth_culling = true;
 
     float     _step_size = 0.001f;
     float     _trunc_margin = 2.0f;
+    int       _max_weight;
+
+    GLuint    _time_query = 0;
+    bool      _time_query_pending = false;
+    float     _integrate_time = 0.0f;
+
+    // Set whenever the voxels change, the occupancy of the touched bricks is
+    // updated lazily. Every update has its own epoch, starting at 1.
+    bool      _occupancy_dirty = true;
+    unsigned  _occupancy_epoch = 0;
+
+    bool      _cached_normals = false;
+    // Some bricks have been touched since the last normal update
+    bool      _normals_dirty = false;
+
+    int       _reset_count = 0;
+
+    // Camera and occupancy epoch of the hits in _hit_history_tex
+    bool       _reprojection = true;
+    bool       _history_valid = false;
+    glm::mat4  _history_inv_mvp;
+    glm::vec3  _history_camera_pos;
+    glm::ivec3 _history_origin;
+    unsigned   _history_epoch = 0;
 
     // 0 = true color, 1 = normals, 2 = phong shading
     int       _display_mode = 0;
+
+    // Rolling volume: the voxel grid follows the sensor and is addressed
+    // toroidally, so the level origins can grow without bounds while the
+    // textures stay the same size.
+    bool       _rolling = false;
+    // Distance in meters the sensor can move away from the volume center
+    // before the volume is shifted
+    float      _roll_threshold = 1.0f;
+
+    BlockStore *_block_store = nullptr;
 };
@@ -0,0 +1,301 @@
+#include "volume_readback.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <tuple>
+
+#include "profiler.hpp"
+
+// The buffers stay mapped for their whole life, so the worker can read them
+// while the GL thread keeps issuing commands
+const GLbitfield BUFFER_FLAGS =
+    GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+// A free buffer is only reused for requests at least this fraction of its
+// size, otherwise e.g. a whole level readback would end up holding small
+// block chunks and push the next one over the budget
+const size_t BUFFER_REUSE_RATIO = 2;
+// Buffers above this size are deleted as soon as their callback returns
+const size_t BUFFER_KEEP_MAX_SIZE = size_t(64) << 20;
+
+VolumeReadback::VolumeReadback(Volume *volume, size_t memory_budget) :
+    _volume(volume),
+    _memory_budget(memory_budget)
+{
+    _worker = std::thread(&VolumeReadback::workerLoop, this);
+}
+
+VolumeReadback::~VolumeReadback()
+{
+    finish();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_all();
+    _worker.join();
+    for (const Buffer &buffer : _free_buffers)
+        deleteBuffer(buffer);
+}
+
+bool
+VolumeReadback::startRegions(const glm::ivec3 *firsts, const glm::ivec3 *sizes,
+                             int count, int level, Callback callback)
+{
+    PROFILE_SCOPE("VolumeReadback::start");
+    if (count < 0)
+        return false;
+
+    std::unique_ptr<Readback> r(new Readback);
+    size_t size = 0;
+    for (int i = 0; i < count; ++i) {
+        r->offsets.push_back(size);
+        size += size_t(sizes[i].x) * sizes[i].y * sizes[i].z * 8;
+    }
+    if (size > 0 && !acquireBuffer(size, &r->buffer))
+        return false;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r->buffer.id);
+    for (int i = 0; i < count; ++i) {
+        _volume->copyRegion(firsts[i], sizes[i], level, r->offsets[i]);
+        r->result.regions.push_back({firsts[i], sizes[i], nullptr});
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // Writes to persistently mapped buffers must be made visible to the host
+    // before the fence
+    glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    r->result.level = level;
+    r->result.format = _volume->getVoxelFormat();
+    r->callback = std::move(callback);
+    _readbacks.push_back(std::move(r));
+    return true;
+}
+
+bool
+VolumeReadback::startBlocks(const std::vector<glm::ivec3> &blocks, int level,
+                            Callback callback)
+{
+    std::vector<glm::ivec3> firsts;
+    for (const glm::ivec3 &block : blocks)
+        firsts.push_back(block * BLOCK_SIZE);
+    std::vector<glm::ivec3> sizes(blocks.size(), glm::ivec3(BLOCK_SIZE));
+    return startRegions(firsts.data(), sizes.data(), int(blocks.size()),
+                        level, std::move(callback));
+}
+
+bool
+VolumeReadback::startLevel(int level, Callback callback)
+{
+    glm::ivec3 first = _volume->getOrigin(level);
+    glm::ivec3 size = _volume->getDims();
+    return startRegions(&first, &size, 1, level, std::move(callback));
+}
+
+bool
+VolumeReadback::startModifiedBlocks(int level, Callback callback)
+{
+    return startBlockFlags(level, false, std::move(callback));
+}
+
+bool
+VolumeReadback::startObservedBlocks(int level, Callback callback)
+{
+    return startBlockFlags(level, true, std::move(callback));
+}
+
+bool
+VolumeReadback::startBlockFlags(int level, bool observed, Callback callback)
+{
+    glm::ivec3 blocks = _volume->getDims() / BLOCK_SIZE;
+    std::unique_ptr<Readback> r(new Readback);
+    if (!acquireBuffer(sizeof(GLuint) * blocks.x * blocks.y * blocks.z,
+                       &r->buffer))
+        return false;
+
+    try {
+        if (observed)
+            _volume->copyObservedBlocks(level, r->buffer.id, 0);
+        else
+            r->result.blocks = _volume->copyModifiedBlocks(level,
+                                                           r->buffer.id, 0);
+    } catch (...) {
+        releaseBuffer(r->buffer);
+        throw;
+    }
+    r->block_flags = true;
+    r->origin = _volume->getOrigin(level);
+    glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    r->result.level = level;
+    r->result.format = _volume->getVoxelFormat();
+    r->callback = std::move(callback);
+    _readbacks.push_back(std::move(r));
+    return true;
+}
+
+void
+VolumeReadback::poll()
+{
+    // Readbacks are delivered in order, so stop at the first copy that
+    // hasn't finished. Flush on the first check, otherwise the fence may
+    // never be signaled.
+    while (_delivered < _readbacks.size()) {
+        Readback *r = _readbacks[_delivered].get();
+        GLenum status = glClientWaitSync(r->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         0);
+        if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+            break;
+        glDeleteSync(r->fence);
+        r->fence = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back(r);
+        }
+        _cond.notify_one();
+        ++_delivered;
+    }
+
+    std::vector<Buffer> released;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        while (_delivered > 0 && _readbacks.front()->done) {
+            released.push_back(_readbacks.front()->buffer);
+            _readbacks.pop_front();
+            --_delivered;
+        }
+    }
+    for (const Buffer &buffer : released)
+        if (buffer.id)
+            releaseBuffer(buffer);
+}
+
+void
+VolumeReadback::finish()
+{
+    PROFILE_SCOPE("VolumeReadback::finish");
+    while (!_readbacks.empty()) {
+        if (_delivered < _readbacks.size()) {
+            glClientWaitSync(_readbacks[_delivered]->fence,
+                             GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        } else {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done_cond.wait(lock, [this] { return _readbacks.front()->done; });
+        }
+        poll();
+    }
+}
+
+// Reuse the smallest free buffer that fits without wasting too much of it,
+// otherwise create one, dropping free buffers if needed to stay within the
+// budget
+bool
+VolumeReadback::acquireBuffer(size_t size, Buffer *buffer)
+{
+    int best = -1;
+    for (int i = 0; i < int(_free_buffers.size()); ++i)
+        if (_free_buffers[i].size >= size &&
+            _free_buffers[i].size <= size * BUFFER_REUSE_RATIO &&
+            (best < 0 || _free_buffers[i].size < _free_buffers[best].size))
+            best = i;
+    if (best >= 0) {
+        *buffer = _free_buffers[best];
+        _free_buffers.erase(_free_buffers.begin() + best);
+        return true;
+    }
+
+    // Drop the largest free buffers first
+    while (_memory_usage + size > _memory_budget && !_free_buffers.empty()) {
+        auto largest = std::max_element(
+            _free_buffers.begin(), _free_buffers.end(),
+            [](const Buffer &a, const Buffer &b) { return a.size < b.size; });
+        deleteBuffer(*largest);
+        _free_buffers.erase(largest);
+    }
+    if (_memory_usage + size > _memory_budget)
+        return false;
+
+    glGenBuffers(1, &buffer->id);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer->id);
+    glBufferStorage(GL_PIXEL_PACK_BUFFER, size, nullptr, BUFFER_FLAGS);
+    buffer->data = static_cast<unsigned char *>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, BUFFER_FLAGS));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!buffer->data) {
+        glDeleteBuffers(1, &buffer->id);
+        throw std::runtime_error("Failed to map a volume readback buffer");
+    }
+    buffer->size = size;
+    _memory_usage += size;
+    return true;
+}
+
+void
+VolumeReadback::releaseBuffer(const Buffer &buffer)
+{
+    if (buffer.size > BUFFER_KEEP_MAX_SIZE) {
+        deleteBuffer(buffer);
+        return;
+    }
+    _free_buffers.push_back(buffer);
+}
+
+void
+VolumeReadback::deleteBuffer(const Buffer &buffer)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteBuffers(1, &buffer.id);
+    _memory_usage -= buffer.size;
+}
+
+void
+VolumeReadback::workerLoop()
+{
+    Profiler::setThreadName("Readback");
+    for (;;) {
+        Readback *r;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _quit || !_jobs.empty(); });
+            if (_jobs.empty())
+                return;
+            r = _jobs.front();
+            _jobs.pop_front();
+        }
+
+        {
+            PROFILE_SCOPE("VolumeReadback::deliver");
+            for (size_t i = 0; i < r->offsets.size(); ++i)
+                r->result.regions[i].data = r->buffer.data + r->offsets[i];
+            if (r->block_flags) {
+                std::vector<glm::ivec3> &blocks = r->result.blocks;
+                std::vector<glm::ivec3> flagged = _volume->decodeBlockFlags(
+                    reinterpret_cast<const GLuint *>(r->buffer.data),
+                    r->origin);
+                blocks.insert(blocks.end(), flagged.begin(), flagged.end());
+                // A block may have left and come back
+                auto less = [](const glm::ivec3 &a, const glm::ivec3 &b) {
+                    return std::tie(a.z, a.y, a.x) < std::tie(b.z, b.y, b.x);
+                };
+                std::sort(blocks.begin(), blocks.end(), less);
+                blocks.erase(std::unique(blocks.begin(), blocks.end()),
+                             blocks.end());
+            }
+            try {
+                r->callback(r->result);
+            } catch (const std::exception &e) {
+                std::cerr << "Volume readback callback failed: " << e.what()
+                          << std::endl;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            r->done = true;
+        }
+        _done_cond.notify_all();
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "glad/glad.h"
+#include <glm/glm.hpp>
+
+#include "volume.hpp"
+
+// Reads voxels back without stalling the pipeline. start*() queues copies of
+// the volume into persistently mapped pixel buffers followed by a fence and
+// returns right away, poll() hands the readbacks whose fence has been
+// signaled to a worker thread, which runs their callbacks straight on the
+// mapped memory. Integration and rendering keep going in the meantime.
+//
+// Everything but the callbacks runs on the thread that owns the GL context.
+// Callbacks run in the order the readbacks were started.
+class VolumeReadback {
+public:
+    struct Region {
+        // Global voxel coordinates of the level
+        glm::ivec3 first;
+        glm::ivec3 size;
+        // 8 bytes per voxel, see Volume::decodeRegion()
+        const unsigned char *data;
+    };
+
+    struct Result {
+        int level;
+        Volume::VoxelFormat format;
+        std::vector<Region> regions;
+        // Global block coordinates, for startModifiedBlocks()
+        std::vector<glm::ivec3> blocks;
+    };
+
+    // The data of the regions is only valid during the call
+    typedef std::function<void(const Result &)> Callback;
+
+    // 'memory_budget' bounds the pixel buffers, the readbacks that don't fit
+    // are refused. The volume must outlive the readback.
+    VolumeReadback(Volume *volume, size_t memory_budget);
+    // Delivers every pending readback first
+    ~VolumeReadback();
+
+    VolumeReadback(const VolumeReadback &) = delete;
+    VolumeReadback &operator=(const VolumeReadback &) = delete;
+
+    // Queue a copy of regions of a level, in global voxel coordinates.
+    // Returns false if they don't fit in the memory budget. Without regions
+    // the callback still runs after the ones of the pending readbacks.
+    bool startRegions(const glm::ivec3 *firsts, const glm::ivec3 *sizes,
+                      int count, int level, Callback callback);
+    // Same for BLOCK_SIZE blocks, in global block coordinates
+    bool startBlocks(const std::vector<glm::ivec3> &blocks, int level,
+                     Callback callback);
+    // Same for the whole level as a single region
+    bool startLevel(int level, Callback callback);
+    // Take the blocks of a level modified since the last call, see
+    // Volume::copyModifiedBlocks(). They are passed sorted in the blocks of
+    // the result, without regions.
+    bool startModifiedBlocks(int level, Callback callback);
+    // Same for the blocks modified since the last reset, which are left
+    // flagged, see Volume::copyObservedBlocks()
+    bool startObservedBlocks(int level, Callback callback);
+
+    // Pass the finished copies on to the worker and recycle the buffers it's
+    // done with. Call once per frame.
+    void poll();
+    // Wait until every readback has been delivered
+    void finish();
+
+    int getPending() const { return int(_readbacks.size()); }
+    size_t getMemoryUsage() const { return _memory_usage; }
+private:
+    struct Buffer {
+        GLuint id = 0;
+        size_t size = 0;
+        unsigned char *data = nullptr;
+    };
+
+    struct Readback {
+        Buffer   buffer;
+        GLsync   fence = 0;
+        Result   result;
+        // Offset of every region inside the buffer
+        std::vector<size_t> offsets;
+        // Level origin when the block flags were copied, if the buffer holds
+        // them
+        bool       block_flags = false;
+        glm::ivec3 origin;
+        Callback callback;
+        // Set by the worker once the callback returns
+        bool     done = false;
+    };
+
+    bool startBlockFlags(int level, bool observed, Callback callback);
+    bool acquireBuffer(size_t size, Buffer *buffer);
+    void releaseBuffer(const Buffer &buffer);
+    void deleteBuffer(const Buffer &buffer);
+    void workerLoop();
+
+    Volume *_volume;
+    size_t  _memory_budget;
+    // Every buffer alive, including the free ones
+    size_t  _memory_usage = 0;
+    std::vector<Buffer> _free_buffers;
+
+    // In the order they were started, the ones waiting for their fence last
+    std::deque<std::unique_ptr<Readback>> _readbacks;
+    // Number of readbacks at the front of _readbacks given to the worker
+    size_t _delivered = 0;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _done_cond;
+    std::deque<Readback *> _jobs;
+    bool _quit = false;
+    std::thread _worker;
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+
+// Host side copy of a voxel
+struct Voxel {
+    float          tsdf     = 0.0f;
+    unsigned short weight   = 0;
+    unsigned char  color[3] = {255, 255, 255};
+};
+
+
+// Dense 3D grid stored as 8x8x8 bricks. Voxels inside a brick are laid out in
+// Morton (Z-order) so the 26 neighbours of a voxel are almost always in the
+// same brick, which keeps gradients and zero-crossing searches cache and TLB
+// friendly. Bricks themselves are stored x-fastest.
+template <typename T>
+class BrickedGrid {
+public:
+    static const int BRICK_BITS   = 3;
+    static const int BRICK_SIZE   = 1 << BRICK_BITS;
+    static const int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+    template <typename Grid, typename Ref>
+    class basic_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Ref *pointer;
+        typedef Ref &reference;
+
+        basic_iterator(Grid *grid, size_t i) : _grid(grid), _i(i) { skip(); }
+
+        reference operator*() const { return _grid->data()[_i]; }
+        pointer operator->() const { return &_grid->data()[_i]; }
+        glm::ivec3 coord() const { return _grid->coord(_i); }
+
+        basic_iterator &operator++() { ++_i; skip(); return *this; }
+        basic_iterator operator++(int) { basic_iterator it = *this; ++*this; return it; }
+
+        bool operator==(const basic_iterator &o) const { return _i == o._i; }
+        bool operator!=(const basic_iterator &o) const { return _i != o._i; }
+    private:
+        void skip() {
+            if (!_grid->_padded)
+                return;
+            size_t end = _grid->_data.size();
+            while (_i < end && !_grid->contains(_grid->coord(_i)))
+                ++_i;
+        }
+
+        Grid  *_grid;
+        size_t _i;
+    };
+
+    typedef basic_iterator<BrickedGrid, T> iterator;
+    typedef basic_iterator<const BrickedGrid, const T> const_iterator;
+
+    BrickedGrid() = default;
+    explicit BrickedGrid(glm::ivec3 dims, const T &value = T()) {
+        resize(dims, value);
+    }
+
+    void resize(glm::ivec3 dims, const T &value = T()) {
+        _dims = dims;
+        _bricks = (dims + (BRICK_SIZE - 1)) / BRICK_SIZE;
+        _padded = _bricks * BRICK_SIZE != dims;
+        _data.assign(size_t(_bricks.x) * _bricks.y * _bricks.z * BRICK_VOXELS,
+                     value);
+    }
+
+    void fill(const T &value) { std::fill(_data.begin(), _data.end(), value); }
+
+    glm::ivec3 dims() const { return _dims; }
+    size_t size() const { return size_t(_dims.x) * _dims.y * _dims.z; }
+
+    bool contains(glm::ivec3 p) const {
+        return p.x >= 0 && p.y >= 0 && p.z >= 0 &&
+               p.x < _dims.x && p.y < _dims.y && p.z < _dims.z;
+    }
+
+    T &at(glm::ivec3 p) { return _data[index(p)]; }
+    const T &at(glm::ivec3 p) const { return _data[index(p)]; }
+    T &operator[](glm::ivec3 p) { return _data[index(p)]; }
+    const T &operator[](glm::ivec3 p) const { return _data[index(p)]; }
+
+    // Neighbour access. Voxels outside the grid return 'outside'.
+    const T &get(glm::ivec3 p, const T &outside) const {
+        return contains(p) ? _data[index(p)] : outside;
+    }
+    const T &neighbour(glm::ivec3 p, int axis, int step,
+                       const T &outside) const {
+        p[axis] += step;
+        return get(p, outside);
+    }
+
+    // Storage offset of a voxel
+    size_t index(glm::ivec3 p) const {
+        glm::ivec3 b = p >> BRICK_BITS;
+        glm::ivec3 l = p & (BRICK_SIZE - 1);
+        size_t brick = (size_t(b.z) * _bricks.y + b.y) * _bricks.x + b.x;
+        return brick * BRICK_VOXELS + morton(l);
+    }
+
+    // Inverse of index()
+    glm::ivec3 coord(size_t i) const {
+        size_t brick = i / BRICK_VOXELS;
+        unsigned int m = unsigned(i % BRICK_VOXELS);
+        glm::ivec3 b(int(brick % _bricks.x),
+                     int(brick / _bricks.x % _bricks.y),
+                     int(brick / (size_t(_bricks.x) * _bricks.y)));
+        return b * BRICK_SIZE + glm::ivec3(compact(m),
+                                           compact(m >> 1),
+                                           compact(m >> 2));
+    }
+
+    T *data() { return _data.data(); }
+    const T *data() const { return _data.data(); }
+
+    // Iteration follows the storage order. Padding voxels of bricks on the
+    // border of a grid whose dimensions aren't multiples of the brick size
+    // are skipped.
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _data.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _data.size()); }
+
+private:
+    // Interleave the 3 low bits of each coordinate
+    static unsigned int morton(glm::ivec3 l) {
+        return spread(l.x) | (spread(l.y) << 1) | (spread(l.z) << 2);
+    }
+    static unsigned int spread(unsigned int v) {
+        return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4);
+    }
+    static int compact(unsigned int m) {
+        return int((m & 1) | ((m >> 2) & 2) | ((m >> 4) & 4));
+    }
+
+    glm::ivec3     _dims   = glm::ivec3(0);
+    glm::ivec3     _bricks = glm::ivec3(0);
+    bool           _padded = false;
+    std::vector<T> _data;
+};
+
+
+// FNV-1a hash of the voxels in x-fastest order, independent of the brick
+// layout. Used to check that two integrations produced the same volume.
+inline uint64_t
+checksumGrid(const BrickedGrid<Voxel> &grid)
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    glm::ivec3 dims = grid.dims(), p;
+    for (p.z = 0; p.z < dims.z; ++p.z)
+    for (p.y = 0; p.y < dims.y; ++p.y)
+    for (p.x = 0; p.x < dims.x; ++p.x) {
+        const Voxel &voxel = grid.at(p);
+        uint32_t tsdf;
+        std::memcpy(&tsdf, &voxel.tsdf, sizeof(tsdf));
+        add(&tsdf, sizeof(tsdf));
+        add(&voxel.weight, sizeof(voxel.weight));
+        add(voxel.color, sizeof(voxel.color));
+    }
+    return hash;
+}